@@ -36,6 +36,10 @@
 #endif
 
 
+/* Number of DST frames that may be in flight between the read-ahead thread
+   and the consumer, i.e. queued for decoding or decoded but not yet read */
+#define DSDIFF_READAHEAD_FRAMES 128
+
 typedef struct dsdiff_read_context_t {
     chunk_header_t  current_chunk;
     uint64_t        bytes_read;
@@ -46,36 +50,653 @@ typedef struct dsdiff_read_context_t {
 
     dst_decoder_t  *dst_decoder;
     uint32_t        dst_frame_size;
-    uint32_t        dst_frames_remain;
-    char           *dest_buffer;
-    uint32_t        dest_buffer_frames_remain;
-    pthread_cond_t  dst_decode_done;
-    pthread_mutex_t dst_decode_done_mutex;
+    uint32_t        dst_frame_count;
+    off_t           dst_data_start;
+    off_t           dst_data_end;
+    dst_frame_index_t *dst_index;
+    int             dst_crc;
+    const uint8_t  *dst_map;          /* the mapped input, frames are decoded straight from it */
+    uint64_t        dst_map_size;
+
+    /* Read-ahead thread, walks the DST sound data chunk and feeds the decoder */
+    dsd_reader_t   *dst_reader;
+    FILE           *dst_input;
+    pthread_t       dst_readahead;
+    int             dst_readahead_running;
+    int             dst_readahead_stop;
+    int             dst_readahead_eof;
+    uint32_t        dst_frames_queued;
+    uint32_t        dst_frame_first;
+    uint32_t        dst_frame_end;
+
+    /* Ring of decoded frames, filled in order by the decoder's write thread */
+    uint8_t        *dst_ring;
+    uint32_t        dst_ring_head;
+    uint32_t        dst_ring_tail;
+    uint32_t        dst_ring_pos;
+    int             dst_planar;       /* layout of the decoded frames in the ring */
+    int             dst_lsb_first;
+    pthread_cond_t  dst_ring_cond;
+    pthread_mutex_t dst_ring_mutex;
+
+    /* Decoding straight into the output file instead, see dsdiff_decode_extent */
+    FILE           *dst_direct_output;
+    uint64_t        dst_direct_offset;    /* where the sound data from dst_direct_start goes */
+    uint64_t        dst_direct_start;
+    uint64_t        dst_direct_end;
+    uint32_t        dst_direct_first;     /* the frame with decoder sequence number dst_direct_base */
+    uint32_t        dst_direct_base;
+    uint32_t        dst_direct_placed;
+    int             dst_direct_failed;
 } dsdiff_read_context_t;
 
 static void dsdiff_dst_decode_done(uint8_t *frame_data, size_t frame_size, void *userdata)
 {
     dsdiff_read_context_t *context = (dsdiff_read_context_t*) userdata;
+    uint8_t *slot = context->dst_ring + (size_t) (context->dst_ring_head % DSDIFF_READAHEAD_FRAMES) * context->dst_frame_size;
+
+    /* The read-ahead thread never queues more frames than the ring can hold, so
+       this slot is free and nobody else touches it until we publish it */
+    if (frame_size > context->dst_frame_size) {
+        frame_size = context->dst_frame_size;
+    }
+    memcpy(slot, frame_data, frame_size);
+
+    pthread_mutex_lock(&context->dst_ring_mutex);
+    context->dst_ring_head++;
+    pthread_cond_broadcast(&context->dst_ring_cond);
+    pthread_mutex_unlock(&context->dst_ring_mutex);
+}
 
-    memcpy(context->dest_buffer, frame_data, frame_size);
-    context->dest_buffer += frame_size;
+/* Called on the decoding threads in whatever order the frames finish, writes the part of the
+   frame that was asked for to where it belongs in the output. A frame that didn't decode is
+   written all the same (as silence) but fails the whole extent. */
+static void dsdiff_dst_place(uint8_t *frame_data, size_t frame_size, long frame_number, int frame_error, void *userdata)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) userdata;
+    uint64_t frame_start = (uint64_t) (context->dst_direct_first + (uint32_t) (frame_number - context->dst_direct_base)) * context->dst_frame_size;
+    uint64_t from = frame_start > context->dst_direct_start ? frame_start : context->dst_direct_start;
+    uint64_t to = frame_start + context->dst_frame_size;
+    int failed = frame_error != 0;
 
-    if (!--context->dest_buffer_frames_remain) {
-        pthread_mutex_lock(&context->dst_decode_done_mutex);
-        pthread_cond_signal(&context->dst_decode_done);
-        pthread_mutex_unlock(&context->dst_decode_done_mutex);
+    if (to > context->dst_direct_end) {
+        to = context->dst_direct_end;
     }
+    if (from < to && (from - frame_start + (to - from) > frame_size
+        || dsd_pwrite(context->dst_direct_output, frame_data + (from - frame_start), (size_t) (to - from),
+            context->dst_direct_offset + (from - context->dst_direct_start)) != to - from)) {
+        failed = 1;
+    }
+
+    pthread_mutex_lock(&context->dst_ring_mutex);
+    context->dst_direct_failed |= failed;
+    context->dst_direct_placed++;
+    pthread_cond_broadcast(&context->dst_ring_cond);
+    pthread_mutex_unlock(&context->dst_ring_mutex);
 }
 
+/* Called on the decoder's write thread in frame order, with the number of the frame in the file
+   (see dst_decoder_set_frame_number) */
 static void dsdiff_dst_decode_error(int frame_count, int frame_error_code, const char *frame_error_message, void *userdata)
 {
-    fprintf(stderr, "DST decoding error %d: %s\n", frame_error_code, frame_error_message);
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) userdata;
+    dsd_reader_t *reader = context->dst_reader;
+
+    fprintf(stderr, "%s: DST frame %u: %s (error %d)\n", reader->filename ? reader->filename : "-",
+        (uint32_t) frame_count, frame_error_message, frame_error_code);
+    pthread_mutex_lock(&context->dst_ring_mutex);
+    reader->frame_errors++;
+    pthread_mutex_unlock(&context->dst_ring_mutex);
+}
+
+/* Read frames for the decoding threads, using positions from the DSTI chunk */
+static size_t dsdiff_dst_fetch(uint8_t *frame_data, size_t frame_capacity, long frame_index, void *userdata)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) userdata;
+    dst_frame_index_t *index = &context->dst_index[frame_index];
+
+    if (index->length > frame_capacity
+        || dsd_pread(context->dst_input, frame_data, index->length, index->offset) != index->length) {
+        return 0;
+    }
+    return index->length;
+}
+
+/* Convert a big endian frame index to host order and make sure it matches the frames we expect to
+   find, also works out whether the frames are followed by CRC chunks */
+static int dsdiff_check_index(FILE *fp, dst_frame_index_t *index, uint32_t frame_count, dsdiff_read_context_t *context)
+{
+    chunk_header_t header;
+    uint32_t i;
+
+    for (i = 0; i < frame_count; i++) {
+        SWAP64(index[i].offset);
+        SWAP32(index[i].length);
+        if (index[i].length == 0 || index[i].length > context->dst_frame_size + 1) {
+            return 0;
+        }
+    }
+
+    /* Make sure the index really points at frame data, not at the DSTF chunk headers */
+    if (index[0].offset < DST_FRAME_DATA_CHUNK_SIZE
+        || dsd_pread(fp, &header, CHUNK_HEADER_SIZE, index[0].offset - DST_FRAME_DATA_CHUNK_SIZE) != CHUNK_HEADER_SIZE
+        || header.chunk_id != DSTF_MARKER || hton64(header.chunk_data_size) != index[0].length) {
+        return 0;
+    }
+
+    /* CRC chunks are all or nothing, so looking after the first frame is enough */
+    context->dst_crc = dsd_pread(fp, &header, CHUNK_HEADER_SIZE, index[0].offset + CEIL_ODD_NUMBER(index[0].length)) == CHUNK_HEADER_SIZE
+        && header.chunk_id == DSTC_MARKER;
+
+    return 1;
+}
+
+/* Load the frame positions from a DSTI chunk */
+static dst_frame_index_t *dsdiff_read_index(FILE *fp, uint64_t chunk_size, dsdiff_read_context_t *context)
+{
+    dst_frame_index_t *index;
+
+    if (context->dst_frame_count == 0 || chunk_size / DST_FRAME_INDEX_SIZE < context->dst_frame_count) {
+        return NULL;
+    }
+
+    index = (dst_frame_index_t*) malloc((size_t) context->dst_frame_count * DST_FRAME_INDEX_SIZE);
+    if (fread(index, DST_FRAME_INDEX_SIZE, context->dst_frame_count, fp) != context->dst_frame_count
+        || !dsdiff_check_index(fp, index, context->dst_frame_count, context)) {
+        free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+/* Build a frame index by walking the chunk headers of the DST sound data chunk */
+static dst_frame_index_t *dsdiff_scan_index(FILE *fp, dsdiff_read_context_t *context)
+{
+    dst_frame_index_t *index;
+    chunk_header_t header;
+    off_t pos = context->dst_data_start;
+    uint32_t frames = 0;
+    int crc = 0;
+
+    if (context->dst_frame_count == 0) {
+        return NULL;
+    }
+
+    index = (dst_frame_index_t*) malloc((size_t) context->dst_frame_count * DST_FRAME_INDEX_SIZE);
+    while (frames < context->dst_frame_count && pos + (off_t) CHUNK_HEADER_SIZE <= context->dst_data_end) {
+        fseeko(fp, pos, SEEK_SET);
+        if (fread(&header, CHUNK_HEADER_SIZE, 1, fp) != 1) {
+            break;
+        }
+        SWAP64(header.chunk_data_size);
+        if (header.chunk_data_size > (uint64_t) (context->dst_data_end - pos - (off_t) CHUNK_HEADER_SIZE)) {
+            /* Runs past the sound data chunk (or wraps pos around), nothing more to be found */
+            break;
+        }
+        if (header.chunk_id == DSTF_MARKER) {
+            if (header.chunk_data_size == 0 || header.chunk_data_size > context->dst_frame_size + 1) {
+                break;
+            }
+            index[frames].offset = pos + CHUNK_HEADER_SIZE;
+            index[frames].length = (uint32_t) header.chunk_data_size;
+            frames++;
+        } else if (header.chunk_id == DSTC_MARKER) {
+            crc = 1;
+        }
+        pos += CHUNK_HEADER_SIZE + CEIL_ODD_NUMBER(header.chunk_data_size);
+    }
+    fseeko(fp, context->dst_data_start, SEEK_SET);
+
+    if (frames == 0) {
+        free(index);
+        return NULL;
+    }
+
+    /* A truncated file simply has fewer frames than FRTE promised */
+    context->dst_frame_count = frames;
+    context->dst_crc = crc;
+    return index;
+}
+
+/* The index sidecar of foo.dff is foo.dff.dsti */
+static char *dsdiff_index_file_name(dsd_reader_t *reader)
+{
+    char *name = (char*) malloc(strlen(reader->filename) + 6);
+    sprintf(name, "%s.dsti", reader->filename);
+    return name;
+}
+
+/* Load a frame index from the sidecar file, as long as it was made for this very file */
+static dst_frame_index_t *dsdiff_load_index_file(dsd_reader_t *reader, dsdiff_read_context_t *context)
+{
+    dst_index_file_header_t header;
+    dst_frame_index_t *index = NULL;
+    uint64_t file_size;
+    int64_t file_mtime;
+    char *name;
+    FILE *fp;
+
+    if (!dsd_file_identity(reader->input, &file_size, &file_mtime)) {
+        return NULL;
+    }
+
+    name = dsdiff_index_file_name(reader);
+    fp = fopen(name, "rb");
+    free(name);
+    if (!fp) {
+        return NULL;
+    }
+
+    if (fread(&header, DST_INDEX_FILE_HEADER_SIZE, 1, fp) == 1
+        && header.chunk_id == DSTX_MARKER
+        && hton32(header.version) == DST_INDEX_FILE_VERSION
+        && hton64(header.file_size) == file_size
+        && (int64_t) hton64(header.file_mtime) == file_mtime
+        && hton32(header.frame_count) > 0
+        && hton32(header.frame_count) <= context->dst_frame_count) {
+        uint32_t frame_count = hton32(header.frame_count);
+
+        index = (dst_frame_index_t*) malloc((size_t) frame_count * DST_FRAME_INDEX_SIZE);
+        if (fread(index, DST_FRAME_INDEX_SIZE, frame_count, fp) == frame_count
+            && dsdiff_check_index(reader->input, index, frame_count, context)) {
+            context->dst_frame_count = frame_count;
+        } else {
+            free(index);
+            index = NULL;
+        }
+    }
+    fclose(fp);
+
+    return index;
+}
+
+/* Keep the frame index in a sidecar file, so the next open doesn't have to scan the file again */
+static void dsdiff_save_index_file(dsd_reader_t *reader, dsdiff_read_context_t *context)
+{
+    dst_index_file_header_t header;
+    dst_frame_index_t entry;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint32_t i;
+    char *name;
+    FILE *fp;
+    int ok;
+
+    if (!dsd_file_identity(reader->input, &file_size, &file_mtime)) {
+        return;
+    }
+
+    name = dsdiff_index_file_name(reader);
+    if ((fp = fopen(name, "wb")) != NULL) {
+        header.chunk_id = DSTX_MARKER;
+        header.version = hton32(DST_INDEX_FILE_VERSION);
+        header.file_size = hton64(file_size);
+        header.file_mtime = hton64((uint64_t) file_mtime);
+        header.frame_count = hton32(context->dst_frame_count);
+        header.flags = hton32(context->dst_crc ? DST_INDEX_FILE_CRC : 0);
+        ok = fwrite(&header, DST_INDEX_FILE_HEADER_SIZE, 1, fp) == 1;
+
+        for (i = 0; ok && i < context->dst_frame_count; i++) {
+            entry.offset = hton64(context->dst_index[i].offset);
+            entry.length = hton32(context->dst_index[i].length);
+            ok = fwrite(&entry, DST_FRAME_INDEX_SIZE, 1, fp) == 1;
+        }
+
+        if (fclose(fp) != 0 || !ok) {
+            remove(name);
+        }
+    }
+    free(name);
+}
+
+/* Read the next DSTF frame from the input, skipping CRC chunks, returns 0 at the end of the frames */
+static size_t dsdiff_dst_read_frame(dsdiff_read_context_t *context, uint8_t *frame)
+{
+    chunk_header_t dstf;
+
+    for (;;) {
+        if (fread(&dstf, DST_FRAME_DATA_CHUNK_SIZE, 1, context->dst_input) != 1) {
+            return 0;
+        }
+        SWAP64(dstf.chunk_data_size);
+        if (dstf.chunk_id == DSTC_MARKER) {
+            /* Ignore CRC chunks */
+            fseeko(context->dst_input, CEIL_ODD_NUMBER(dstf.chunk_data_size), SEEK_CUR);
+        } else if (dstf.chunk_id != DSTF_MARKER || dstf.chunk_data_size > context->dst_frame_size + 1) {
+            return 0;
+        } else if (fread(frame, 1, (size_t) CEIL_ODD_NUMBER(dstf.chunk_data_size), context->dst_input) < dstf.chunk_data_size) {
+            return 0;
+        } else {
+            return (size_t) dstf.chunk_data_size;
+        }
+    }
+}
+
+/* Find the next DSTF frame in the mapped input from *pos, skipping CRC chunks, returns 0 at the end of the frames */
+static size_t dsdiff_dst_map_frame(dsdiff_read_context_t *context, uint64_t *pos, const uint8_t **frame)
+{
+    chunk_header_t dstf;
+
+    for (;;) {
+        if (*pos + DST_FRAME_DATA_CHUNK_SIZE > context->dst_map_size) {
+            return 0;
+        }
+        memcpy(&dstf, context->dst_map + *pos, DST_FRAME_DATA_CHUNK_SIZE);
+        SWAP64(dstf.chunk_data_size);
+        /* Every chunk has to fit in what's mapped, or the walk could wrap around */
+        if ((dstf.chunk_id != DSTC_MARKER && dstf.chunk_id != DSTF_MARKER)
+            || dstf.chunk_data_size > context->dst_map_size - *pos - DST_FRAME_DATA_CHUNK_SIZE
+            || (dstf.chunk_id == DSTF_MARKER && dstf.chunk_data_size > context->dst_frame_size + 1)) {
+            return 0;
+        }
+        *frame = context->dst_map + *pos + DST_FRAME_DATA_CHUNK_SIZE;
+        *pos += DST_FRAME_DATA_CHUNK_SIZE + CEIL_ODD_NUMBER(dstf.chunk_data_size);
+        if (dstf.chunk_id == DSTF_MARKER) {
+            return (size_t) dstf.chunk_data_size;
+        }
+    }
+}
+
+/* Look for the CRC chunk of a frame at pos, straight after its data, and tell the decoder to check
+   the frame against it. The chunk is stepped over when the frames are read through the stream. */
+static void dsdiff_dst_expect_crc(dsdiff_read_context_t *context, uint64_t pos, int stream)
+{
+    uint8_t chunk[CHUNK_HEADER_SIZE + 4];
+    chunk_header_t header;
+
+    if (context->dst_map) {
+        if (pos + sizeof(chunk) > context->dst_map_size) {
+            return;
+        }
+        memcpy(chunk, context->dst_map + pos, sizeof(chunk));
+    } else if (dsd_pread(context->dst_input, chunk, sizeof(chunk), pos) != sizeof(chunk)) {
+        return;
+    }
+    memcpy(&header, chunk, CHUNK_HEADER_SIZE);
+    if (header.chunk_id != DSTC_MARKER || hton64(header.chunk_data_size) != 4) {
+        return;
+    }
+
+    dst_decoder_expect_crc(context->dst_decoder, (uint32_t) chunk[CHUNK_HEADER_SIZE] << 24 | (uint32_t) chunk[CHUNK_HEADER_SIZE + 1] << 16
+        | (uint32_t) chunk[CHUNK_HEADER_SIZE + 2] << 8 | chunk[CHUNK_HEADER_SIZE + 3]);
+    if (stream) {
+        fseeko(context->dst_input, (off_t) (pos + sizeof(chunk)), SEEK_SET);
+    }
+}
+
+/* Hand frame number frame to the decoder, by its index entry or as the next one in the file
+   (at *map_pos when mapped), returns 0 at the end of the frames */
+static int dsdiff_dst_queue(dsdiff_read_context_t *context, uint32_t frame, uint8_t *buffer, uint64_t *map_pos)
+{
+    dsd_reader_t *reader = context->dst_reader;
+    const uint8_t *data;
+    size_t frame_size;
+    int verify = reader->flags & DSD_READER_VERIFY;
+
+    if (verify && context->dst_index) {
+        dsdiff_dst_expect_crc(context, context->dst_index[frame].offset + CEIL_ODD_NUMBER(context->dst_index[frame].length), 0);
+    }
+
+    if (context->dst_index && context->dst_map) {
+        dst_frame_index_t *index = &context->dst_index[frame];
+        if (index->offset + index->length > context->dst_map_size) {
+            return 0;
+        }
+        dst_decoder_decode_mapped(context->dst_decoder, context->dst_map + index->offset, index->length);
+        dsd_reader_advance(reader, index->offset);
+    } else if (context->dst_index) {
+        dst_decoder_decode_indexed(context->dst_decoder, frame);
+        dsd_reader_advance(reader, context->dst_index[frame].offset);
+    } else if (context->dst_map) {
+        if ((frame_size = dsdiff_dst_map_frame(context, map_pos, &data)) == 0) {
+            return 0;
+        }
+        if (verify) {
+            dsdiff_dst_expect_crc(context, *map_pos, 0);
+        }
+        dst_decoder_decode_mapped(context->dst_decoder, data, frame_size);
+        dsd_reader_advance(reader, *map_pos);
+    } else {
+        if ((frame_size = dsdiff_dst_read_frame(context, buffer)) == 0) {
+            return 0;
+        }
+        if (verify) {
+            dsdiff_dst_expect_crc(context, (uint64_t) ftello(context->dst_input), 1);
+        }
+        dst_decoder_decode(context->dst_decoder, buffer, frame_size);
+        if (reader->flags & (DSD_READER_DROP_BEHIND | DSD_READER_SHARE_DEVICE)) {
+            dsd_reader_advance(reader, (uint64_t) ftello(context->dst_input));
+        }
+    }
+    return 1;
+}
+
+/* Walk the DST sound data chunk, reading DSTF frames and skipping DSTC chunks,
+   and hand each frame to the decoder, staying at most DSDIFF_READAHEAD_FRAMES
+   ahead of the consumer and stopping at dst_frame_end. With a frame index there
+   is nothing to read here, the decoding threads fetch the frames themselves. */
+static void *dsdiff_dst_readahead(void *userdata)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) userdata;
+    /* A frame stored without DST coding carries a one-byte header in front of the raw DSD data */
+    uint8_t *frame = malloc(context->dst_frame_size + 2);
+    uint32_t frames_read = context->dst_frame_first;
+    uint64_t map_pos = context->dst_map ? (uint64_t) ftello(context->dst_input) : 0;
+    int stop;
+
+    for (;;) {
+        pthread_mutex_lock(&context->dst_ring_mutex);
+        while (!context->dst_readahead_stop
+            && context->dst_frames_queued - context->dst_ring_tail >= DSDIFF_READAHEAD_FRAMES) {
+            pthread_cond_wait(&context->dst_ring_cond, &context->dst_ring_mutex);
+        }
+        stop = context->dst_readahead_stop || frames_read >= context->dst_frame_end;
+        pthread_mutex_unlock(&context->dst_ring_mutex);
+        if (stop) {
+            break;
+        }
+
+        if (!dsdiff_dst_queue(context, frames_read, frame, &map_pos)) {
+            break;
+        }
+        frames_read++;
+
+        pthread_mutex_lock(&context->dst_ring_mutex);
+        context->dst_frames_queued++;
+        pthread_mutex_unlock(&context->dst_ring_mutex);
+    }
+    free(frame);
+    if (context->dst_map && !context->dst_index) {
+        fseeko(context->dst_input, (off_t) map_pos, SEEK_SET);
+    }
+
+    pthread_mutex_lock(&context->dst_ring_mutex);
+    context->dst_readahead_eof = 1;
+    pthread_cond_broadcast(&context->dst_ring_cond);
+    pthread_mutex_unlock(&context->dst_ring_mutex);
+
+    return NULL;
+}
+
+/* Stop the read-ahead thread (if it is running) so that the main thread may use the input again */
+static void dsdiff_dst_stop(dsdiff_read_context_t *context)
+{
+    if (context->dst_readahead_running) {
+        pthread_mutex_lock(&context->dst_ring_mutex);
+        context->dst_readahead_stop = 1;
+        pthread_cond_broadcast(&context->dst_ring_cond);
+        pthread_mutex_unlock(&context->dst_ring_mutex);
+
+        pthread_join(context->dst_readahead, NULL);
+        context->dst_readahead_running = 0;
+    }
+}
+
+/* (Re)start the read-ahead thread at frame dst_frame_first, this happens on the first read
+   so that seeking straight after opening doesn't decode anything it doesn't need to. The ring
+   is empty at this point, so the decoder can switch to the layout the first read wants. */
+static void dsdiff_dst_start(dsdiff_read_context_t *context, int planar, int lsb_first)
+{
+    dst_decoder_set_output_layout(context->dst_decoder, planar, lsb_first);
+    context->dst_planar = planar;
+    context->dst_lsb_first = lsb_first;
+    dst_decoder_set_frame_number(context->dst_decoder, (long) context->dst_frame_first);
+    context->dst_readahead_stop = 0;
+    context->dst_readahead_eof = 0;
+    if (pthread_create(&context->dst_readahead, NULL, dsdiff_dst_readahead, context) == 0) {
+        context->dst_readahead_running = 1;
+    } else {
+        fprintf(stderr, "could not start DST read-ahead thread\n");
+        context->dst_readahead_eof = 1;
+    }
+}
+
+/* A marker from the edited master information, as a sample position in the sound data */
+typedef struct dsdiff_marker_t {
+    uint64_t position;
+    uint16_t type;
+} dsdiff_marker_t;
+
+static int dsdiff_compare_markers(const void *a, const void *b)
+{
+    const dsdiff_marker_t *ma = (const dsdiff_marker_t*) a;
+    const dsdiff_marker_t *mb = (const dsdiff_marker_t*) b;
+
+    return (ma->position > mb->position) - (ma->position < mb->position);
+}
+
+/* Marker times are absolute, so count them from the absolute start time of the sound data */
+static uint64_t dsdiff_marker_position(const marker_chunk_t *mark, int64_t start_time, uint32_t sample_rate)
+{
+    int64_t position = (((int64_t) hton16(mark->hours) * 60 + mark->minutes) * 60 + mark->seconds) * sample_rate
+        + hton32(mark->samples) + (int32_t) hton32((uint32_t) mark->offset) - start_time;
+
+    return (position > 0) ? (uint64_t) position : 0;
+}
+
+/* Turn the TrackStart and TrackStop markers of a DIIN chunk into the reader's track list, each track
+   ending at the next TrackStart or TrackStop marker or at the end of the sound data */
+static void dsdiff_read_tracks(FILE *fp, off_t pos, int64_t start_time, dsd_reader_t *reader)
+{
+    off_t resume = ftello(fp);
+    uint64_t sound_length = reader->data_length * 8 / reader->channel_count;
+    chunk_header_t header;
+    uint8_t *diin = NULL;
+    uint8_t *cur;
+    dsdiff_marker_t *markers;
+    uint32_t marker_count = 0;
+    uint32_t i, j;
+
+    /* The DIIN chunk normally follows the sound data */
+    fseeko(fp, pos, SEEK_SET);
+    while (fread(&header, CHUNK_HEADER_SIZE, 1, fp) == 1) {
+        SWAP64(header.chunk_data_size);
+        if (header.chunk_id == DIIN_MARKER) {
+            diin = malloc((size_t) header.chunk_data_size);
+            if (fread(diin, 1, (size_t) header.chunk_data_size, fp) != header.chunk_data_size) {
+                free(diin);
+                diin = NULL;
+            }
+            break;
+        }
+        fseeko(fp, CEIL_ODD_NUMBER(header.chunk_data_size), SEEK_CUR);
+    }
+    fseeko(fp, resume, SEEK_SET);
+    if (!diin) {
+        return;
+    }
+
+    /* No more markers than there is room for */
+    markers = (dsdiff_marker_t*) malloc((size_t) (header.chunk_data_size / EDITED_MASTER_MARKER_CHUNK_SIZE + 1) * sizeof(dsdiff_marker_t));
+    cur = diin;
+    while (cur + CHUNK_HEADER_SIZE <= diin + header.chunk_data_size) {
+        chunk_header_t *sub = (chunk_header_t*) cur;
+        uint64_t sub_size = hton64(sub->chunk_data_size);
+
+        if (sub_size > (uint64_t) (diin + header.chunk_data_size - cur) - CHUNK_HEADER_SIZE) {
+            break;
+        }
+        if (sub->chunk_id == MARK_MARKER && sub_size >= EDITED_MASTER_MARKER_CHUNK_SIZE - CHUNK_HEADER_SIZE) {
+            marker_chunk_t *mark = (marker_chunk_t*) cur;
+            uint16_t type = hton16(mark->mark_type);
+
+            if (hton16(mark->mark_channel) == 0
+                && (type == MARK_MARKER_TYPE_TRACKSTART || type == MARK_MARKER_TYPE_TRACKSTOP)) {
+                markers[marker_count].position = dsdiff_marker_position(mark, start_time, reader->sample_rate);
+                markers[marker_count].type = type;
+                marker_count++;
+            }
+        }
+        cur += CHUNK_HEADER_SIZE + CEIL_ODD_NUMBER(sub_size);
+    }
+    free(diin);
+
+    qsort(markers, marker_count, sizeof(dsdiff_marker_t), dsdiff_compare_markers);
+    reader->tracks = (dsd_track_t*) malloc((marker_count + 1) * sizeof(dsd_track_t));
+    for (i = 0; i < marker_count; i++) {
+        dsd_track_t *track = &reader->tracks[reader->track_count];
+
+        if (markers[i].type != MARK_MARKER_TYPE_TRACKSTART || markers[i].position >= sound_length
+            || (reader->track_count > 0 && track[-1].start == markers[i].position)) {
+            continue;
+        }
+        track->start = markers[i].position;
+        track->end = sound_length;
+        for (j = i + 1; j < marker_count; j++) {
+            if (markers[j].position > track->start) {
+                track->end = (markers[j].position < sound_length) ? markers[j].position : sound_length;
+                break;
+            }
+        }
+        reader->track_count++;
+    }
+    free(markers);
+
+    if (reader->track_count == 0) {
+        free(reader->tracks);
+        reader->tracks = NULL;
+    }
+}
+
+/* List the chunks from pos on, and an ID3 tag found in the property chunk after them, the way
+   dsdiff_read_next_chunk will return them */
+static void dsdiff_read_chunk_list(FILE *fp, off_t pos, uint64_t fake_id3_len, dsd_reader_t *reader)
+{
+    off_t resume = ftello(fp);
+    chunk_header_t header;
+    uint32_t capacity = 8;
+
+    reader->chunks = (dsd_chunk_info_t*) malloc(capacity * sizeof(dsd_chunk_info_t));
+    fseeko(fp, pos, SEEK_SET);
+    for (;;) {
+        if (reader->chunk_count == capacity) {
+            capacity *= 2;
+            reader->chunks = (dsd_chunk_info_t*) realloc(reader->chunks, capacity * sizeof(dsd_chunk_info_t));
+        }
+        if (fread(&header, CHUNK_HEADER_SIZE, 1, fp) == 1) {
+            SWAP64(header.chunk_data_size);
+            reader->chunks[reader->chunk_count].chunk_id = header.chunk_id;
+            reader->chunks[reader->chunk_count].length = header.chunk_data_size;
+            reader->chunk_count++;
+            fseeko(fp, CEIL_ODD_NUMBER(header.chunk_data_size), SEEK_CUR);
+        } else {
+            if (fake_id3_len) {
+                reader->chunks[reader->chunk_count].chunk_id = MAKE_MARKER('I', 'D', '3', ' ');
+                reader->chunks[reader->chunk_count].length = fake_id3_len;
+                reader->chunk_count++;
+            }
+            break;
+        }
+    }
+    fseeko(fp, resume, SEEK_SET);
 }
 
 static int dsdiff_read_open(FILE *fp, dsd_reader_t *reader)
 {
     uint8_t *fake_id3 = NULL;
     uint64_t fake_id3_len = 0;
+    int64_t start_time = 0;
 
     /* Check FRM8 header */
     {
@@ -129,6 +750,10 @@ static int dsdiff_read_open(FILE *fp, dsd_reader_t *reader)
             } else if (prop_head->chunk_id == CHNL_MARKER) {
                 channels_chunk_t *chnl = (channels_chunk_t*) cur_prop;
                 reader->channel_count = (uint8_t) hton16(chnl->channel_count);
+            } else if (prop_head->chunk_id == ABSS_MARKER) {
+                absolute_start_time_chunk_t *abss = (absolute_start_time_chunk_t*) cur_prop;
+                start_time = (((int64_t) hton16(abss->hours) * 60 + abss->minutes) * 60 + abss->seconds) * reader->sample_rate
+                    + hton32(abss->samples);
             } else if (prop_head->chunk_id == MAKE_MARKER('I', 'D', '3', ' ')) {
                 /* Some versions of sacd-ripper put ID3 tags in PROP instead of a chunk
                    at the end of the file, so we pretend it's at the end. */
@@ -157,26 +782,71 @@ static int dsdiff_read_open(FILE *fp, dsd_reader_t *reader)
                 
                 fread(&frte, DST_FRAME_INFORMATION_CHUNK_SIZE, 1, fp);
                 context->dst_frame_size = reader->sample_rate / hton16(frte.frame_rate) / 8 * reader->channel_count;
-                context->dst_frames_remain = hton32(frte.num_frames);
-                reader->data_length = (uint64_t) context->dst_frames_remain * context->dst_frame_size;
+                context->dst_frame_count = hton32(frte.num_frames);
+                reader->data_length = (uint64_t) context->dst_frame_count * context->dst_frame_size;
                 reader->compressed = 1;
+                reader->frame_rate = hton16(frte.frame_rate);
+                /* Room for the header byte of frames stored without DST coding, and the chunk padding */
+                reader->frame_capacity = context->dst_frame_size + 2;
 
                 context->dst_decoder = dst_decoder_create(reader->channel_count, reader->sample_rate / 44100, dsdiff_dst_decode_done, dsdiff_dst_decode_error, context);
-                context->dst_decode_done = PTHREAD_COND_INITIALIZER;
-                context->dst_decode_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+                context->dst_reader = reader;
+                context->dst_input = fp;
+                context->dst_map = reader->map;
+                context->dst_map_size = reader->map_size;
+                context->dst_readahead_running = 0;
+                context->dst_frames_queued = 0;
+                context->dst_frame_first = 0;
+                context->dst_readahead_eof = 0;
+                context->dst_ring = malloc((size_t) DSDIFF_READAHEAD_FRAMES * context->dst_frame_size);
+                context->dst_ring_head = 0;
+                context->dst_ring_tail = 0;
+                context->dst_ring_pos = 0;
+                context->dst_planar = 0;
+                context->dst_lsb_first = 0;
+                pthread_cond_init(&context->dst_ring_cond, NULL);
+                pthread_mutex_init(&context->dst_ring_mutex, NULL);
 
-                /* The next 'real' chunk is after the DSTI, so find where the DSTI chunk ends... */
+                /* The next 'real' chunk is after the DSTI (if there is one), so find where the
+                   DSTI chunk ends, picking up the frame index on the way */
                 start = ftello(fp);
                 fseeko(fp, CEIL_ODD_NUMBER(audio.chunk_data_size - DST_FRAME_INFORMATION_CHUNK_SIZE), SEEK_CUR);
-                fread(&dsti, CHUNK_HEADER_SIZE, 1, fp);
-                context->next_chunk = ftello(fp) + CEIL_ODD_NUMBER(hton64(dsti.chunk_data_size));
+                context->next_chunk = ftello(fp);
+                context->dst_data_start = start;
+                context->dst_data_end = start + (off_t) (audio.chunk_data_size - DST_FRAME_INFORMATION_CHUNK_SIZE);
+                context->dst_index = NULL;
+                context->dst_crc = 0;
+                if (fread(&dsti, CHUNK_HEADER_SIZE, 1, fp) == 1 && dsti.chunk_id == DSTI_MARKER) {
+                    SWAP64(dsti.chunk_data_size);
+                    context->next_chunk = ftello(fp) + CEIL_ODD_NUMBER(dsti.chunk_data_size);
+                    context->dst_index = dsdiff_read_index(fp, dsti.chunk_data_size, context);
+                }
+
+                /* No DSTI chunk, so look for an index we made earlier, or make one now if asked to */
+                if (!context->dst_index && reader->filename) {
+                    context->dst_index = dsdiff_load_index_file(reader, context);
+                }
+                if (!context->dst_index && (reader->flags & DSD_READER_BUILD_INDEX)) {
+                    context->dst_index = dsdiff_scan_index(fp, context);
+                    if (context->dst_index && reader->filename) {
+                        dsdiff_save_index_file(reader, context);
+                    }
+                }
+                reader->data_length = (uint64_t) context->dst_frame_count * context->dst_frame_size;
+                context->dst_frame_end = context->dst_frame_count;
                 fseeko(fp, start, SEEK_SET);
+
+                /* With an index, the decoding threads fetch their own frames */
+                if (context->dst_index) {
+                    dst_decoder_set_fetch_callback(context->dst_decoder, dsdiff_dst_fetch);
+                }
                 break;
             } else if (audio.chunk_id == DSD_MARKER) {
                 reader->data_length = audio.chunk_data_size;
                 reader->compressed = 0;
                 context->next_chunk = ftello(fp) + CEIL_ODD_NUMBER(audio.chunk_data_size);
                 context->dst_decoder = NULL;
+                context->dst_index = NULL;
                 break;
             } else if (feof(fp)) {
                 if (fake_id3) {
@@ -193,53 +863,93 @@ static int dsdiff_read_open(FILE *fp, dsd_reader_t *reader)
         context->fake_id3 = fake_id3;
         context->fake_id3_len = fake_id3_len;
         reader->private = context;
+
+        dsdiff_read_tracks(fp, context->next_chunk, start_time, reader);
+        dsdiff_read_chunk_list(fp, context->next_chunk, fake_id3 ? fake_id3_len : 0, reader);
     }
 
     return 1;
 }
 
+/* Wait for the frame at the ring's tail to be decoded, returns NULL once there are no more.
+   Called with the ring mutex held. */
+static uint8_t *dsdiff_dst_wait_frame(dsdiff_read_context_t *context)
+{
+    while (context->dst_ring_tail == context->dst_ring_head
+        && !(context->dst_readahead_eof && context->dst_ring_tail == context->dst_frames_queued)) {
+        pthread_cond_wait(&context->dst_ring_cond, &context->dst_ring_mutex);
+    }
+    if (context->dst_ring_tail == context->dst_ring_head) {
+        return NULL;
+    }
+    return context->dst_ring + (size_t) (context->dst_ring_tail % DSDIFF_READAHEAD_FRAMES) * context->dst_frame_size;
+}
+
+/* Copy len bytes of a decoded frame, starting at interleaved offset pos, out as interleaved
+   MSB-first data whatever layout the ring has */
+static void dsdiff_dst_copy_out(dsdiff_read_context_t *context, const uint8_t *frame, uint32_t pos,
+    uint8_t *dest, size_t len, int channel_count)
+{
+    if (context->dst_planar) {
+        size_t per_channel = context->dst_frame_size / channel_count;
+        size_t done = 0;
+
+        while (done < len) {
+            size_t offset = pos + done;
+
+            if (offset % channel_count == 0 && len - done >= (size_t) channel_count) {
+                size_t count = (len - done) / channel_count;
+                dsd_interleave(dest + done, frame + offset / channel_count, per_channel, count, channel_count);
+                done += count * channel_count;
+            } else {
+                dest[done++] = frame[(offset % channel_count) * per_channel + offset / channel_count];
+            }
+        }
+    } else {
+        memcpy(dest, frame + pos, len);
+    }
+    if (context->dst_lsb_first) {
+        dsd_reverse_bits(dest, len);
+    }
+}
+
 static size_t dsdiff_read_samples(char *buf, size_t len, dsd_reader_t *reader)
 {
     dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
     size_t amount = 0;
 
     if (context->current_chunk.chunk_id == DST_MARKER) {
-        uint32_t frame_count = len / context->dst_frame_size;
-        chunk_header_t dstf;
-        uint32_t i;
-        uint8_t *frame = malloc(context->dst_frame_size);
-        
-        if (frame_count > context->dst_frames_remain) {
-            frame_count = context->dst_frames_remain;
-        }
-
-        context->dest_buffer = buf;
-        context->dest_buffer_frames_remain = frame_count;
-        context->dst_frames_remain -= frame_count;
-        for (i = 0; i < frame_count; i++) {
-            /* Read DST frame and add to decoder queue */
-            fread(&dstf, DST_FRAME_DATA_CHUNK_SIZE, 1, reader->input);
-            SWAP64(dstf.chunk_data_size);
-            if (dstf.chunk_id == DSTC_MARKER) {
-                /* Ignore CRC chunks */
-                fseeko(reader->input, CEIL_ODD_NUMBER(dstf.chunk_data_size), SEEK_CUR);
-                continue;
-            } else if (dstf.chunk_id != DSTF_MARKER) {
-                context->dst_frames_remain = 0;
-                context->dest_buffer_frames_remain -= frame_count - i;
+        if (!context->dst_readahead_running && !context->dst_readahead_eof) {
+            dsdiff_dst_start(context, 0, 0);
+        }
+
+        /* Copy decoded frames out of the ring as they become available */
+        pthread_mutex_lock(&context->dst_ring_mutex);
+        while (amount < len) {
+            uint8_t *frame = dsdiff_dst_wait_frame(context);
+            size_t chunk;
+
+            if (!frame) {
                 break;
             }
-            fread(frame, 1, (size_t) CEIL_ODD_NUMBER(dstf.chunk_data_size), reader->input);
-            dst_decoder_decode(context->dst_decoder, frame, (size_t) dstf.chunk_data_size);
-        }
-        free(frame);
+            pthread_mutex_unlock(&context->dst_ring_mutex);
+
+            chunk = context->dst_frame_size - context->dst_ring_pos;
+            if (chunk > len - amount) {
+                chunk = len - amount;
+            }
+            dsdiff_dst_copy_out(context, frame, context->dst_ring_pos, (uint8_t*) buf + amount, chunk, reader->channel_count);
+            amount += chunk;
+            context->dst_ring_pos += (uint32_t) chunk;
 
-        if (frame_count > 0) {
-            pthread_mutex_lock(&context->dst_decode_done_mutex);
-            pthread_cond_wait(&context->dst_decode_done, &context->dst_decode_done_mutex);
-            pthread_mutex_unlock(&context->dst_decode_done_mutex);
+            pthread_mutex_lock(&context->dst_ring_mutex);
+            if (context->dst_ring_pos == context->dst_frame_size) {
+                context->dst_ring_pos = 0;
+                context->dst_ring_tail++;
+                pthread_cond_broadcast(&context->dst_ring_cond);
+            }
         }
-        amount = context->dest_buffer - buf;
+        pthread_mutex_unlock(&context->dst_ring_mutex);
     } else if (context->next_chunk == 0 && context->fake_id3) {
         /* Reached EOF alerady, so read from the 'fake' ID3 chunk */
         uint64_t bytes_remain = context->fake_id3_len - context->bytes_read;
@@ -251,25 +961,97 @@ static size_t dsdiff_read_samples(char *buf, size_t len, dsd_reader_t *reader)
         amount = (len > bytes_remain) ? (size_t) bytes_remain : len;
         amount = fread(buf, 1, amount, reader->input);
         context->bytes_read += amount;
+        if (context->next_chunk) {
+            dsd_reader_advance(reader, (uint64_t) context->next_chunk
+                - CEIL_ODD_NUMBER(context->current_chunk.chunk_data_size) + context->bytes_read);
+        }
     }
 
     return amount;
 }
 
+/* Decoded DST sound data a channel at a time. The decoder is asked for planar frames in the
+   order wanted, so normally they just need copying out. */
+static int dsdiff_read_planar(char *buf, size_t stride, size_t *len, int lsb_first, dsd_reader_t *reader)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
+    int channel_count = reader->channel_count;
+    size_t per_channel;
+    size_t amount = 0;
+    int c;
+
+    if (context->current_chunk.chunk_id != DST_MARKER || context->dst_ring_pos % channel_count != 0) {
+        return 0;
+    }
+    if (!context->dst_readahead_running && !context->dst_readahead_eof) {
+        dsdiff_dst_start(context, 1, lsb_first);
+    }
+    per_channel = context->dst_frame_size / channel_count;
+
+    pthread_mutex_lock(&context->dst_ring_mutex);
+    while (amount < *len) {
+        uint8_t *frame = dsdiff_dst_wait_frame(context);
+        size_t start;
+        size_t chunk;
+
+        if (!frame) {
+            break;
+        }
+        pthread_mutex_unlock(&context->dst_ring_mutex);
+
+        start = context->dst_ring_pos / channel_count;
+        chunk = per_channel - start;
+        if (chunk > *len - amount) {
+            chunk = *len - amount;
+        }
+        if (context->dst_planar) {
+            for (c = 0; c < channel_count; c++) {
+                memcpy(buf + (size_t) c * stride + amount, frame + (size_t) c * per_channel + start, chunk);
+            }
+        } else {
+            dsd_deinterleave((uint8_t*) buf + amount, stride, frame + context->dst_ring_pos, chunk, channel_count);
+        }
+        if (context->dst_lsb_first != lsb_first) {
+            for (c = 0; c < channel_count; c++) {
+                dsd_reverse_bits((uint8_t*) buf + (size_t) c * stride + amount, chunk);
+            }
+        }
+        amount += chunk;
+        context->dst_ring_pos += (uint32_t) (chunk * channel_count);
+
+        pthread_mutex_lock(&context->dst_ring_mutex);
+        if (context->dst_ring_pos == context->dst_frame_size) {
+            context->dst_ring_pos = 0;
+            context->dst_ring_tail++;
+            pthread_cond_broadcast(&context->dst_ring_cond);
+        }
+    }
+    pthread_mutex_unlock(&context->dst_ring_mutex);
+
+    *len = amount;
+    return 1;
+}
+
 static uint32_t dsdiff_read_next_chunk(dsd_reader_t *reader)
 {
     dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
 
+    if (context->dst_decoder) {
+        dsdiff_dst_stop(context);
+    }
+
     if (context->next_chunk) {
         context->bytes_read = 0;
         fseeko(reader->input, context->next_chunk, SEEK_SET);
         if (fread(&context->current_chunk, CHUNK_HEADER_SIZE, 1, reader->input) == 1) {
             SWAP64(context->current_chunk.chunk_data_size);
             context->next_chunk = ftello(reader->input) + CEIL_ODD_NUMBER(context->current_chunk.chunk_data_size);
+            reader->chunk_length = context->current_chunk.chunk_data_size;
         } else {
             context->current_chunk.chunk_id = context->fake_id3 ? MAKE_MARKER('I', 'D', '3', ' ') : 0;
             context->current_chunk.chunk_data_size = 0;
             context->next_chunk = 0;
+            reader->chunk_length = context->fake_id3 ? context->fake_id3_len : 0;
         }
     } else if (context->fake_id3) {
         context->current_chunk.chunk_id = 0;
@@ -290,11 +1072,271 @@ static void dsdiff_read_close(dsd_reader_t *reader)
     }
 
     if (context->dst_decoder) {
-        pthread_cond_destroy(&context->dst_decode_done);
-        pthread_mutex_destroy(&context->dst_decode_done_mutex);
+        /* The decoder flushes its remaining frames into the ring, so destroy it before the ring */
+        dsdiff_dst_stop(context);
         dst_decoder_destroy(context->dst_decoder);
         context->dst_decoder = NULL;
+        pthread_cond_destroy(&context->dst_ring_cond);
+        pthread_mutex_destroy(&context->dst_ring_mutex);
+        free(context->dst_ring);
+        context->dst_ring = NULL;
+        if (context->dst_index) {
+            free(context->dst_index);
+            context->dst_index = NULL;
+        }
+    }
+}
+
+/* DST frames decode independently of each other, so seeking restarts the decoding at the
+   frame holding the offset and drops the part of that frame before it */
+static int dsdiff_dst_seek(uint64_t offset, dsd_reader_t *reader)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
+    uint32_t frame = (uint32_t) (offset / context->dst_frame_size);
+
+    dsdiff_dst_stop(context);
+
+    /* Let the frames already handed to the decoder come out, then throw them away */
+    pthread_mutex_lock(&context->dst_ring_mutex);
+    while (context->dst_ring_head != context->dst_frames_queued) {
+        pthread_cond_wait(&context->dst_ring_cond, &context->dst_ring_mutex);
+    }
+    context->dst_ring_tail = context->dst_ring_head;
+    pthread_mutex_unlock(&context->dst_ring_mutex);
+
+    /* Without an index the frame positions are only known by walking the chunk headers */
+    if (!context->dst_index && frame > 0 && frame < context->dst_frame_count) {
+        context->dst_index = dsdiff_scan_index(reader->input, context);
+        if (!context->dst_index) {
+            return 0;
+        }
+        reader->data_length = (uint64_t) context->dst_frame_count * context->dst_frame_size;
+        if (context->dst_frame_end > context->dst_frame_count) {
+            context->dst_frame_end = context->dst_frame_count;
+        }
+        dst_decoder_set_fetch_callback(context->dst_decoder, dsdiff_dst_fetch);
+    }
+
+    if (frame >= context->dst_frame_count) {
+        context->dst_ring_pos = 0;
+        context->dst_readahead_eof = 1;
+        return 1;
+    }
+
+    /* The read-ahead thread starts again on the next read */
+    context->dst_ring_pos = (uint32_t) (offset % context->dst_frame_size);
+    context->dst_frame_first = frame;
+    context->dst_readahead_eof = 0;
+    if (!context->dst_index) {
+        fseeko(reader->input, context->dst_data_start, SEEK_SET);
+    }
+    return 1;
+}
+
+static void dsdiff_dst_set_end(uint64_t offset, dsdiff_read_context_t *context)
+{
+    uint64_t frame_end = (offset + context->dst_frame_size - 1) / context->dst_frame_size;
+
+    pthread_mutex_lock(&context->dst_ring_mutex);
+    context->dst_frame_end = (frame_end < context->dst_frame_count) ? (uint32_t) frame_end : context->dst_frame_count;
+    pthread_mutex_unlock(&context->dst_ring_mutex);
+}
+
+static int dsdiff_read_seek(uint64_t offset, dsd_reader_t *reader)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
+
+    if (context->current_chunk.chunk_id == DST_MARKER) {
+        return dsdiff_dst_seek(offset, reader);
+    } else if (context->current_chunk.chunk_id == DSD_MARKER) {
+        off_t data_start = context->next_chunk - CEIL_ODD_NUMBER(context->current_chunk.chunk_data_size);
+
+        if (offset > context->current_chunk.chunk_data_size) {
+            offset = context->current_chunk.chunk_data_size;
+        }
+        context->bytes_read = offset;
+        fseeko(reader->input, data_start + (off_t) offset, SEEK_SET);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Hand out the next DST frame and its CRC as they are, for copying without decoding */
+static int dsdiff_read_frame(dsd_frame_t *frame, dsd_reader_t *reader)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
+    chunk_header_t header;
+
+    if (context->current_chunk.chunk_id != DST_MARKER || context->dst_readahead_running
+        || context->dst_frame_first >= context->dst_frame_end) {
+        return 0;
+    }
+
+    frame->has_crc = 0;
+    if (context->dst_index) {
+        dst_frame_index_t *index = &context->dst_index[context->dst_frame_first];
+        off_t crc_start = index->offset + CEIL_ODD_NUMBER(index->length);
+
+        frame->size = dsdiff_dst_fetch(frame->data, reader->frame_capacity, context->dst_frame_first, context);
+        if (frame->size == 0) {
+            return 0;
+        }
+        if (context->dst_crc
+            && dsd_pread(reader->input, &header, CHUNK_HEADER_SIZE, crc_start) == CHUNK_HEADER_SIZE
+            && header.chunk_id == DSTC_MARKER && hton64(header.chunk_data_size) == sizeof(frame->crc)) {
+            frame->has_crc = dsd_pread(reader->input, frame->crc, sizeof(frame->crc), crc_start + CHUNK_HEADER_SIZE) == sizeof(frame->crc);
+        }
+    } else {
+        frame->size = dsdiff_dst_read_frame(context, frame->data);
+        if (frame->size == 0) {
+            return 0;
+        }
+        /* Pick up the CRC chunk after the frame, if there is one */
+        if (fread(&header, CHUNK_HEADER_SIZE, 1, reader->input) == 1) {
+            if (header.chunk_id == DSTC_MARKER && hton64(header.chunk_data_size) == sizeof(frame->crc)) {
+                frame->has_crc = fread(frame->crc, sizeof(frame->crc), 1, reader->input) == 1;
+            } else {
+                fseeko(reader->input, -(off_t) CHUNK_HEADER_SIZE, SEEK_CUR);
+            }
+        }
+    }
+
+    context->dst_frame_first++;
+    return 1;
+}
+
+/* Claim the next len bytes of a chunk that is read straight from the file, and say where they are */
+static uint64_t dsdiff_read_raw(uint64_t len, uint64_t *offset, dsd_reader_t *reader)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
+    uint64_t bytes_remain = context->current_chunk.chunk_data_size - context->bytes_read;
+
+    if (context->current_chunk.chunk_id == DST_MARKER || context->next_chunk == 0) {
+        return 0; /* decoded, or the 'fake' ID3 chunk held in memory */
+    }
+
+    if (len > bytes_remain) {
+        len = bytes_remain;
+    }
+    *offset = context->next_chunk - CEIL_ODD_NUMBER(context->current_chunk.chunk_data_size) + context->bytes_read;
+    context->bytes_read += len;
+    fseeko(reader->input, (off_t) (*offset + len), SEEK_SET);
+    return len;
+}
+
+static void dsdiff_read_set_end(uint64_t offset, dsd_reader_t *reader)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
+
+    if (context->current_chunk.chunk_id == DST_MARKER) {
+        dsdiff_dst_set_end(offset, context);
+    }
+}
+
+/* Uncompressed sound data is in the file as it is, for converting it in parallel. DST sound
+   data can be decoded in parallel, so long as no frames are waiting in the ring. */
+static int dsdiff_read_extent(dsd_extent_t *extent, dsd_reader_t *reader)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
+
+    if (context->current_chunk.chunk_id == DST_MARKER) {
+        extent->length = reader->data_length;
+        extent->position = (uint64_t) context->dst_frame_first * context->dst_frame_size + context->dst_ring_pos;
+        extent->compressed = 1;
+        return !context->dst_readahead_running && !context->dst_readahead_eof;
+    }
+    if (context->current_chunk.chunk_id != DSD_MARKER || context->next_chunk == 0) {
+        return 0;
     }
+    extent->offset = context->next_chunk - CEIL_ODD_NUMBER(context->current_chunk.chunk_data_size);
+    extent->length = context->current_chunk.chunk_data_size;
+    extent->position = context->bytes_read;
+    extent->block_size = 0;
+    extent->lsb_first = 0;
+    return 1;
+}
+
+/* Decode len bytes of DST sound data straight into the output at extent->offset, with the
+   decoding threads writing each frame as soon as it's done rather than in order through the
+   ring. Reading carries on after the last frame needed. */
+static uint64_t dsdiff_decode_extent(uint64_t len, dsd_writer_t *writer, const dsd_extent_t *extent, dsd_reader_t *reader)
+{
+    dsdiff_read_context_t *context = (dsdiff_read_context_t*) reader->private;
+    uint64_t start = (uint64_t) context->dst_frame_first * context->dst_frame_size + context->dst_ring_pos;
+    uint32_t frame_end, queued = 0;
+    uint32_t frame;
+    uint8_t *data;
+    uint64_t map_pos;
+
+    if (context->current_chunk.chunk_id != DST_MARKER || context->dst_readahead_running || context->dst_readahead_eof
+        || extent->block_size || extent->lsb_first) {
+        return 0;
+    }
+    if (len > reader->data_length - start) {
+        len = reader->data_length - start;
+    }
+    frame_end = (uint32_t) ((start + len + context->dst_frame_size - 1) / context->dst_frame_size);
+
+    context->dst_direct_output = writer->output;
+    context->dst_direct_offset = extent->offset;
+    context->dst_direct_start = start;
+    context->dst_direct_end = start + len;
+    context->dst_direct_first = context->dst_frame_first;
+    context->dst_direct_base = context->dst_frames_queued;
+    context->dst_direct_placed = 0;
+    context->dst_direct_failed = 0;
+    dst_decoder_set_output_layout(context->dst_decoder, 0, 0);
+    dst_decoder_set_placed_callback(context->dst_decoder, dsdiff_dst_place);
+    dst_decoder_set_frame_number(context->dst_decoder, (long) context->dst_direct_first);
+
+    /* Keep the decoder busy without queueing up the whole file */
+    data = malloc(context->dst_frame_size + 2);
+    map_pos = context->dst_map ? (uint64_t) ftello(context->dst_input) : 0;
+    for (frame = context->dst_frame_first; frame < frame_end; frame++) {
+        pthread_mutex_lock(&context->dst_ring_mutex);
+        while (queued - context->dst_direct_placed >= DSDIFF_READAHEAD_FRAMES) {
+            pthread_cond_wait(&context->dst_ring_cond, &context->dst_ring_mutex);
+        }
+        pthread_mutex_unlock(&context->dst_ring_mutex);
+
+        if (!dsdiff_dst_queue(context, frame, data, &map_pos)) {
+            break;
+        }
+        queued++;
+        if (queued > DSDIFF_READAHEAD_FRAMES) {
+            /* The frames placed are all around the ones being queued */
+            dsd_writer_drop_behind(writer, extent->offset
+                + (uint64_t) (queued - DSDIFF_READAHEAD_FRAMES) * context->dst_frame_size);
+        }
+    }
+    free(data);
+    if (context->dst_map && !context->dst_index) {
+        fseeko(context->dst_input, (off_t) map_pos, SEEK_SET);
+    }
+
+    pthread_mutex_lock(&context->dst_ring_mutex);
+    while (context->dst_direct_placed != queued) {
+        pthread_cond_wait(&context->dst_ring_cond, &context->dst_ring_mutex);
+    }
+    context->dst_frames_queued += queued;
+    context->dst_ring_head = context->dst_ring_tail = context->dst_frames_queued;
+    pthread_mutex_unlock(&context->dst_ring_mutex);
+    dst_decoder_set_placed_callback(context->dst_decoder, NULL);
+
+    /* Nothing more is read from this chunk until a seek */
+    context->dst_frame_first = frame;
+    context->dst_ring_pos = 0;
+    context->dst_readahead_eof = 1;
+
+    /* The frames are placed out of order, so after a failure nothing is known to be complete */
+    if (context->dst_direct_failed) {
+        return 0;
+    }
+    if (frame < frame_end) {
+        return frame > context->dst_direct_first ? (uint64_t) frame * context->dst_frame_size - start : 0;
+    }
+    return len;
 }
 
 dsd_reader_funcs_t *dsdiff_reader_funcs()
@@ -303,24 +1345,114 @@ dsd_reader_funcs_t *dsdiff_reader_funcs()
         dsdiff_read_open,
         dsdiff_read_samples,
         dsdiff_read_next_chunk,
-        dsdiff_read_close
+        dsdiff_read_close,
+        dsdiff_read_seek,
+        dsdiff_read_set_end,
+        dsdiff_read_frame,
+        dsdiff_read_raw,
+        dsdiff_read_planar,
+        dsdiff_read_extent,
+        dsdiff_decode_extent
     };
     return &funcs;
 }
 
 
+/* Uncompressed sound data is gathered into buffers of this size and written behind, with up
+   to DSDIFF_WRITE_QUEUE_DEPTH of them being written at once */
+#define DSDIFF_WRITE_BUFFER_SIZE (256 * 1024)
+#define DSDIFF_WRITE_QUEUE_DEPTH 8
+
+/* A size in a header that turned out different from what was written there at first, put
+   right with a positional write at close */
+typedef struct dsdiff_patch_t {
+    uint64_t offset;
+    uint8_t  data[8];
+    size_t   size;
+} dsdiff_patch_t;
+
 typedef struct dsdiff_write_context_t {
+    uint64_t position;               /* where the next byte goes */
+    uint64_t form_declared;          /* size written in the FRM8 header */
+    uint32_t current_chunk_id;
     uint64_t current_chunk_bytes;
+    uint64_t current_chunk_declared; /* size written in the current chunk's header */
     off_t    current_chunk_start;
+
+    dsdiff_patch_t *patches;
+    uint32_t        patch_count;
+
+    /* Sound data written behind, when possible */
+    dsd_write_queue_t *queue;
+    uint8_t           *queue_buffer;
+    size_t             queue_fill;
+    uint64_t           write_offset;
+
+    /* Frames written into the DST sound data chunk, for FRTE and the DSTI chunk */
+    dst_frame_index_t *frame_index;
+    uint32_t           frame_count;
+    uint32_t           frame_index_size;
+    uint32_t           frames_declared; /* number written in the FRTE chunk */
 } dsdiff_write_context_t;
 
+static void dsdiff_write_out(dsdiff_write_context_t *context, const void *data, size_t len, dsd_writer_t *writer)
+{
+    context->position += fwrite(data, 1, len, writer->output);
+}
+
+/* Remember to write size bytes of data at offset when closing */
+static void dsdiff_write_patch(dsdiff_write_context_t *context, uint64_t offset, const void *data, size_t size)
+{
+    context->patches = (dsdiff_patch_t*) realloc(context->patches, (context->patch_count + 1) * sizeof(dsdiff_patch_t));
+    context->patches[context->patch_count].offset = offset;
+    memcpy(context->patches[context->patch_count].data, data, size);
+    context->patches[context->patch_count].size = size;
+    context->patch_count++;
+}
+
+/* The header is written for the sound data we're expecting, and the chunks after it we've been
+   told about. Anything that turns out otherwise is put right at close. */
 static void dsdiff_write_open(dsd_writer_t *writer)
 {
+    dsdiff_write_context_t *context = (dsdiff_write_context_t*) malloc(sizeof(dsdiff_write_context_t));
+    uint32_t i;
+    uint64_t prop_size = PROPERTY_CHUNK_SIZE - CHUNK_HEADER_SIZE + SAMPLE_RATE_CHUNK_SIZE + CHANNELS_CHUNK_SIZE
+        + writer->channel_count * sizeof(uint32_t)
+        + CEIL_ODD_NUMBER(COMPRESSION_TYPE_CHUNK_SIZE + (writer->compressed ? 11 /* "DST Encoded" */ : 14 /* "not compressed" */))
+        + LOADSPEAKER_CONFIG_CHUNK_SIZE;
+
+    context->position = 0;
+    context->patches = NULL;
+    context->patch_count = 0;
+    context->frame_index = NULL;
+    context->frame_count = 0;
+    context->frame_index_size = 0;
+    context->frames_declared = 0;
+    context->queue = NULL;
+    context->queue_buffer = NULL;
+    context->queue_fill = 0;
+    writer->private = context;
+
+    if (writer->compressed) {
+        /* Only the number of frames is known, not their size */
+        uint64_t frame_bytes = writer->sample_rate / writer->frame_rate / 8 * writer->channel_count;
+        context->frames_declared = (uint32_t) ((writer->expected_length + frame_bytes - 1) / frame_bytes);
+        context->current_chunk_declared = DST_FRAME_INFORMATION_CHUNK_SIZE;
+    } else {
+        context->current_chunk_declared = CEIL_ODD_NUMBER(writer->expected_length);
+    }
+    context->form_declared = FORM_DSD_CHUNK_SIZE - CHUNK_HEADER_SIZE + FORMAT_VERSION_CHUNK_SIZE
+        + CHUNK_HEADER_SIZE + prop_size + CHUNK_HEADER_SIZE + context->current_chunk_declared;
+    for (i = 0; i < writer->trailer_count; i++) {
+        context->form_declared += CHUNK_HEADER_SIZE + CEIL_ODD_NUMBER(writer->trailer[i].length);
+    }
+
     {
         form_dsd_chunk_t frm8;
         frm8.chunk_id = FRM8_MARKER;
+        frm8.chunk_data_size = hton64(context->form_declared);
         frm8.form_type = DSD_MARKER;
-        fwrite(&frm8, FORM_DSD_CHUNK_SIZE, 1, writer->output);
+        dsdiff_write_out(context, &frm8, FORM_DSD_CHUNK_SIZE, writer);
     }
 
     {
@@ -328,19 +1460,16 @@ static void dsdiff_write_open(dsd_writer_t *writer)
         fver.chunk_id = FVER_MARKER;
         fver.chunk_data_size = CALC_CHUNK_SIZE(FORMAT_VERSION_CHUNK_SIZE - CHUNK_HEADER_SIZE);
         fver.version = hton32(DSDIFF_VERSION);
-        fwrite(&fver, FORMAT_VERSION_CHUNK_SIZE, 1, writer->output);
+        dsdiff_write_out(context, &fver, FORMAT_VERSION_CHUNK_SIZE, writer);
     }
 
     {
         property_chunk_t prop;
 
         prop.chunk_id = PROP_MARKER;
-        prop.chunk_data_size = CALC_CHUNK_SIZE(PROPERTY_CHUNK_SIZE - CHUNK_HEADER_SIZE
-            + SAMPLE_RATE_CHUNK_SIZE + CHANNELS_CHUNK_SIZE + writer->channel_count * sizeof(uint32_t)
-            + COMPRESSION_TYPE_CHUNK_SIZE + 14 /* "not compressed" */
-            + LOADSPEAKER_CONFIG_CHUNK_SIZE);
+        prop.chunk_data_size = CALC_CHUNK_SIZE(prop_size);
         prop.property_type = SND_MARKER;
-        fwrite(&prop, PROPERTY_CHUNK_SIZE, 1, writer->output);
+        dsdiff_write_out(context, &prop, PROPERTY_CHUNK_SIZE, writer);
     }
 
     {
@@ -349,7 +1478,7 @@ static void dsdiff_write_open(dsd_writer_t *writer)
         fs.chunk_id = FS_MARKER;
         fs.chunk_data_size = CALC_CHUNK_SIZE(SAMPLE_RATE_CHUNK_SIZE - CHUNK_HEADER_SIZE);
         fs.sample_rate = hton32(writer->sample_rate);
-        fwrite(&fs, SAMPLE_RATE_CHUNK_SIZE, 1, writer->output);
+        dsdiff_write_out(context, &fs, SAMPLE_RATE_CHUNK_SIZE, writer);
     }
 
     {
@@ -384,18 +1513,21 @@ static void dsdiff_write_open(dsd_writer_t *writer)
                 sprintf((char*) &chnl.channel_ids[i], "C%03i", i);
             }
         }
-        fwrite(&chnl, CHANNELS_CHUNK_SIZE + writer->channel_count * sizeof(uint32_t), 1, writer->output);
+        dsdiff_write_out(context, &chnl, CHANNELS_CHUNK_SIZE + writer->channel_count * sizeof(uint32_t), writer);
     }
 
     {
         compression_type_chunk_t cmpr;
+        const char *name = writer->compressed ? "DST Encoded" : "not compressed";
+        uint8_t count = (uint8_t) strlen(name);
 
+        memset(&cmpr, 0, sizeof(cmpr));
         cmpr.chunk_id = CMPR_MARKER;
-        cmpr.chunk_data_size = CALC_CHUNK_SIZE(COMPRESSION_TYPE_CHUNK_SIZE - CHUNK_HEADER_SIZE + 14);
-        cmpr.compression_type = DSD_MARKER;
-        cmpr.count = 14;
-        strcpy(cmpr.compression_name, "not compressed");
-        fwrite(&cmpr, CEIL_ODD_NUMBER(COMPRESSION_TYPE_CHUNK_SIZE + 14), 1, writer->output);
+        cmpr.chunk_data_size = CALC_CHUNK_SIZE(COMPRESSION_TYPE_CHUNK_SIZE - CHUNK_HEADER_SIZE + count);
+        cmpr.compression_type = writer->compressed ? DST_MARKER : DSD_MARKER;
+        cmpr.count = count;
+        strcpy(cmpr.compression_name, name);
+        dsdiff_write_out(context, &cmpr, CEIL_ODD_NUMBER(COMPRESSION_TYPE_CHUNK_SIZE + count), writer);
     }
 
     {
@@ -416,57 +1548,248 @@ static void dsdiff_write_open(dsd_writer_t *writer)
         default:
             lsco.loudspeaker_config = hton16(LS_CONFIG_UNDEFINED);
         }
-        fwrite(&lsco, LOADSPEAKER_CONFIG_CHUNK_SIZE, 1, writer->output);
+        dsdiff_write_out(context, &lsco, LOADSPEAKER_CONFIG_CHUNK_SIZE, writer);
     }
 
     {
         dsd_sound_data_chunk_t dsd;
-        dsdiff_write_context_t *context = (dsdiff_write_context_t*) malloc(sizeof(dsdiff_write_context_t));
 
-        fflush(writer->output);
-        context->current_chunk_start = ftello(writer->output);
+        context->current_chunk_id = writer->compressed ? DST_MARKER : DSD_MARKER;
+        context->current_chunk_start = (off_t) context->position;
         context->current_chunk_bytes = 0;
-        writer->private = context;
+        dsd.chunk_data_size = hton64(context->current_chunk_declared);
 
-        dsd.chunk_id = DSD_MARKER;
-        fwrite(&dsd, DSD_SOUND_DATA_CHUNK_SIZE, 1, writer->output);
+        if (writer->compressed) {
+            dst_frame_information_chunk_t frte;
+
+            dsd.chunk_id = DST_MARKER;
+            dsdiff_write_out(context, &dsd, DST_SOUND_DATA_CHUNK_SIZE, writer);
+
+            frte.chunk_id = FRTE_MARKER;
+            frte.chunk_data_size = CALC_CHUNK_SIZE(DST_FRAME_INFORMATION_CHUNK_SIZE - CHUNK_HEADER_SIZE);
+            frte.num_frames = hton32(context->frames_declared);
+            frte.frame_rate = hton16(writer->frame_rate);
+            dsdiff_write_out(context, &frte, DST_FRAME_INFORMATION_CHUNK_SIZE, writer);
+            context->current_chunk_bytes = DST_FRAME_INFORMATION_CHUNK_SIZE;
+
+            context->frame_index_size = 1024;
+            context->frame_index = (dst_frame_index_t*) malloc(context->frame_index_size * sizeof(dst_frame_index_t));
+        } else {
+            dsd.chunk_id = DSD_MARKER;
+            dsdiff_write_out(context, &dsd, DSD_SOUND_DATA_CHUNK_SIZE, writer);
+
+            context->queue = dsd_write_queue_create(writer->output, DSDIFF_WRITE_QUEUE_DEPTH, DSDIFF_WRITE_BUFFER_SIZE);
+            if (context->queue) {
+                context->queue_buffer = dsd_write_queue_buffer(context->queue);
+                context->write_offset = context->position;
+            }
+        }
+    }
+}
+
+/* Wait for the sound data written behind and go back to writing through the stream, from
+   the end of it */
+static void dsdiff_write_settle(dsdiff_write_context_t *context, dsd_writer_t *writer)
+{
+    if (context->queue) {
+        if (context->queue_fill) {
+            dsd_write_queue_submit(context->queue, context->queue_buffer, context->queue_fill, context->write_offset);
+            context->write_offset += context->queue_fill;
+            context->queue_fill = 0;
+        }
+        if (!dsd_write_queue_finish(context->queue)) {
+            fprintf(stderr, "error writing the sound data\n");
+        }
+        dsd_write_queue_destroy(context->queue);
+        context->queue = NULL;
+        context->queue_buffer = NULL;
+        fseeko(writer->output, (off_t) context->write_offset, SEEK_SET);
     }
 }
 
 static void dsdiff_write_samples(const char *buf, size_t len, dsd_writer_t *writer)
 {
     dsdiff_write_context_t *context = (dsdiff_write_context_t*) writer->private;
-    size_t written = fwrite(buf, 1, len, writer->output);
+    size_t written;
+
+    if (context->queue) {
+        for (written = 0; written < len; ) {
+            size_t count = len - written;
+            if (count > DSDIFF_WRITE_BUFFER_SIZE - context->queue_fill) {
+                count = DSDIFF_WRITE_BUFFER_SIZE - context->queue_fill;
+            }
+            memcpy(context->queue_buffer + context->queue_fill, buf + written, count);
+            context->queue_fill += count;
+            written += count;
+
+            if (context->queue_fill == DSDIFF_WRITE_BUFFER_SIZE) {
+                dsd_write_queue_submit(context->queue, context->queue_buffer, DSDIFF_WRITE_BUFFER_SIZE, context->write_offset);
+                context->write_offset += DSDIFF_WRITE_BUFFER_SIZE;
+                context->queue_fill = 0;
+                context->queue_buffer = dsd_write_queue_buffer(context->queue);
+            }
+        }
+    } else {
+        written = fwrite(buf, 1, len, writer->output);
+    }
+    context->position += written;
+    context->current_chunk_bytes += written;
+    writer->data_length += written;
+    dsd_writer_drop_behind(writer, context->position);
+}
+
+static uint64_t dsdiff_write_raw(FILE *input, uint64_t offset, uint64_t len, dsd_writer_t *writer)
+{
+    dsdiff_write_context_t *context = (dsdiff_write_context_t*) writer->private;
+    uint64_t written;
+
+    dsdiff_write_settle(context, writer);
+    written = dsd_copy_file_range(input, offset, writer->output, len);
+    context->position += written;
     context->current_chunk_bytes += written;
     writer->data_length += written;
+    return written;
+}
+
+/* Set aside room for len bytes of uncompressed sound data, which the caller fills in itself */
+static int dsdiff_write_extent(uint64_t len, dsd_extent_t *extent, dsd_writer_t *writer)
+{
+    dsdiff_write_context_t *context = (dsdiff_write_context_t*) writer->private;
+
+    if (context->current_chunk_id != DSD_MARKER) {
+        return 0;
+    }
+    extent->block_size = 0;
+    extent->lsb_first = 0;
+    if (len == 0) {
+        return 1;
+    }
+
+    dsdiff_write_settle(context, writer);
+    if (fseeko(writer->output, (off_t) (context->position + len), SEEK_SET) != 0) {
+        return 0;
+    }
+    extent->offset = context->position;
+    context->position += len;
+    context->current_chunk_bytes += len;
+    writer->data_length += len;
+    return 1;
+}
+
+/* Uncompressed sound data only, DST frames would need their index to carry on from */
+static uint64_t dsdiff_write_sync(dsd_writer_t *writer)
+{
+    dsdiff_write_context_t *context = (dsdiff_write_context_t*) writer->private;
+
+    if (context->current_chunk_id != DSD_MARKER) {
+        return 0;
+    }
+    if (context->queue) {
+        if (context->queue_fill) {
+            dsd_write_queue_submit(context->queue, context->queue_buffer, context->queue_fill, context->write_offset);
+            context->write_offset += context->queue_fill;
+            context->queue_fill = 0;
+            context->queue_buffer = dsd_write_queue_buffer(context->queue);
+        }
+        if (!dsd_write_queue_finish(context->queue)) {
+            return 0;
+        }
+    }
+    return context->current_chunk_bytes / writer->channel_count * writer->channel_count;
+}
+
+static void dsdiff_write_frame(const dsd_frame_t *frame, dsd_writer_t *writer)
+{
+    dsdiff_write_context_t *context = (dsdiff_write_context_t*) writer->private;
+    chunk_header_t header;
+
+    if (context->frame_count == context->frame_index_size) {
+        context->frame_index_size *= 2;
+        context->frame_index = (dst_frame_index_t*) realloc(context->frame_index, context->frame_index_size * sizeof(dst_frame_index_t));
+    }
+    context->frame_index[context->frame_count].offset = context->current_chunk_start + CHUNK_HEADER_SIZE
+        + context->current_chunk_bytes + DST_FRAME_DATA_CHUNK_SIZE;
+    context->frame_index[context->frame_count].length = (uint32_t) frame->size;
+    context->frame_count++;
+
+    header.chunk_id = DSTF_MARKER;
+    header.chunk_data_size = hton64(frame->size);
+    dsdiff_write_out(context, &header, DST_FRAME_DATA_CHUNK_SIZE, writer);
+    dsdiff_write_out(context, frame->data, frame->size, writer);
+    if (frame->size & 1) {
+        uint8_t padding = 0;
+        dsdiff_write_out(context, &padding, 1, writer);
+    }
+    context->current_chunk_bytes += DST_FRAME_DATA_CHUNK_SIZE + CEIL_ODD_NUMBER(frame->size);
+
+    if (frame->has_crc) {
+        header.chunk_id = DSTC_MARKER;
+        header.chunk_data_size = CALC_CHUNK_SIZE(sizeof(frame->crc));
+        dsdiff_write_out(context, &header, CHUNK_HEADER_SIZE, writer);
+        dsdiff_write_out(context, frame->crc, sizeof(frame->crc), writer);
+        context->current_chunk_bytes += CHUNK_HEADER_SIZE + sizeof(frame->crc);
+    }
+    dsd_writer_drop_behind(writer, context->position);
+
+    writer->data_length += writer->sample_rate / writer->frame_rate / 8 * writer->channel_count;
+}
+
+/* Write a DSTI chunk (after the DST sound data chunk) for the frames we've written */
+static void dsdiff_write_index(dsdiff_write_context_t *context, dsd_writer_t *writer)
+{
+    chunk_header_t header;
+    dst_frame_index_t entry;
+    uint32_t i;
+
+    header.chunk_id = DSTI_MARKER;
+    header.chunk_data_size = CALC_CHUNK_SIZE((uint64_t) context->frame_count * DST_FRAME_INDEX_SIZE);
+    dsdiff_write_out(context, &header, CHUNK_HEADER_SIZE, writer);
+    for (i = 0; i < context->frame_count; i++) {
+        entry.offset = hton64(context->frame_index[i].offset);
+        entry.length = hton32(context->frame_index[i].length);
+        dsdiff_write_out(context, &entry, DST_FRAME_INDEX_SIZE, writer);
+    }
 }
 
 static void dsdiff_write_finish_chunk(dsdiff_write_context_t *context, dsd_writer_t *writer)
 {
+    dsdiff_write_settle(context, writer);
     if (context->current_chunk_bytes & 1) {
         uint8_t padding = 0;
-        fwrite(&padding, 1, 1, writer->output);
+        dsdiff_write_out(context, &padding, 1, writer);
     }
 
-    fflush(writer->output);
-    fseeko(writer->output, context->current_chunk_start + 4, SEEK_SET);
-    context->current_chunk_bytes = CALC_CHUNK_SIZE(context->current_chunk_bytes);
-    fwrite(&context->current_chunk_bytes, sizeof(uint64_t), 1, writer->output);
-    fflush(writer->output);
-    fseeko(writer->output, 0, SEEK_END);
+    if (CEIL_ODD_NUMBER(context->current_chunk_bytes) != context->current_chunk_declared) {
+        uint64_t size = CALC_CHUNK_SIZE(context->current_chunk_bytes);
+        dsdiff_write_patch(context, context->current_chunk_start + 4, &size, sizeof(uint64_t));
+    }
+    if (context->frame_index) {
+        /* Number of frames in the FRTE chunk right at the start of the DST chunk */
+        if (context->frame_count != context->frames_declared) {
+            uint32_t num_frames = hton32(context->frame_count);
+            dsdiff_write_patch(context, context->current_chunk_start + DST_SOUND_DATA_CHUNK_SIZE + CHUNK_HEADER_SIZE,
+                &num_frames, sizeof(uint32_t));
+        }
+        dsdiff_write_index(context, writer);
+        free(context->frame_index);
+        context->frame_index = NULL;
+    }
 }
 
-static int dsdiff_write_next_chunk(uint32_t chunk, dsd_writer_t *writer)
+static int dsdiff_write_next_chunk(uint32_t chunk, uint64_t length, dsd_writer_t *writer)
 {
     dsdiff_write_context_t *context = (dsdiff_write_context_t*) writer->private;
     chunk_header_t header;
 
     dsdiff_write_finish_chunk(context, writer);
-    context->current_chunk_start = ftello(writer->output);
+    context->current_chunk_id = chunk;
+    context->current_chunk_start = (off_t) context->position;
     context->current_chunk_bytes = 0;
+    context->current_chunk_declared = CEIL_ODD_NUMBER(length);
 
     header.chunk_id = chunk;
-    fwrite(&header, CHUNK_HEADER_SIZE, 1, writer->output);
+    header.chunk_data_size = hton64(context->current_chunk_declared);
+    dsdiff_write_out(context, &header, CHUNK_HEADER_SIZE, writer);
 
     return 1;
 }
@@ -474,13 +1797,27 @@ static int dsdiff_write_next_chunk(uint32_t chunk, dsd_writer_t *writer)
 static void dsdiff_write_close(dsd_writer_t *writer)
 {
     dsdiff_write_context_t *context = (dsdiff_write_context_t*) writer->private;
-    uint64_t file_end;
+    uint32_t i;
 
     dsdiff_write_finish_chunk(context, writer);
-    file_end = hton64(ftello(writer->output) - CHUNK_HEADER_SIZE);
-    /* Write the length of the FRM8 chunk */
-    fseeko(writer->output, 4, SEEK_SET);
-    fwrite(&file_end, sizeof(uint64_t), 1, writer->output);
+    if (context->position - CHUNK_HEADER_SIZE != context->form_declared) {
+        uint64_t form_size = hton64(context->position - CHUNK_HEADER_SIZE);
+        dsdiff_write_patch(context, 4, &form_size, sizeof(uint64_t));
+    }
+
+    /* Sizes that weren't known up front go in with positional writes, without moving the stream */
+    if (context->patch_count) {
+        fflush(writer->output);
+        for (i = 0; i < context->patch_count; i++) {
+            dsdiff_patch_t *patch = &context->patches[i];
+            if (dsd_pwrite(writer->output, patch->data, patch->size, patch->offset) != patch->size) {
+                fprintf(stderr, "could not finish the header of the output\n");
+                break;
+            }
+        }
+        free(context->patches);
+        context->patches = NULL;
+    }
 }
 
 dsd_writer_funcs_t *dsdiff_writer_funcs()
@@ -489,7 +1826,122 @@ dsd_writer_funcs_t *dsdiff_writer_funcs()
         dsdiff_write_open,
         dsdiff_write_samples,
         dsdiff_write_next_chunk,
-        dsdiff_write_close
+        dsdiff_write_close,
+        dsdiff_write_frame,
+        dsdiff_write_raw,
+        NULL,
+        dsdiff_write_extent,
+        dsdiff_write_sync
     };
     return &funcs;
 }
+
+/* Check the property chunk the file position is at for an ID3 tag, which some versions of
+   sacd-ripper put there */
+static int dsdiff_prop_has_id3(FILE *fp, uint64_t chunk_size)
+{
+    char *props = malloc((size_t) chunk_size);
+    char *cur_prop = props + 4;
+    int found = 0;
+
+    if (fread(props, 1, (size_t) chunk_size, fp) == chunk_size) {
+        while (!found && cur_prop + CHUNK_HEADER_SIZE <= props + chunk_size) {
+            chunk_header_t *prop_head = (chunk_header_t*) cur_prop;
+            found = prop_head->chunk_id == MAKE_MARKER('I', 'D', '3', ' ');
+            cur_prop += CEIL_ODD_NUMBER(hton64(prop_head->chunk_data_size)) + CHUNK_HEADER_SIZE;
+        }
+    }
+    free(props);
+    return found;
+}
+
+/* Replace the ID3 tag by rewriting only what comes after the sound data: the ID3 chunks there
+   are dropped, any other chunks after the first of them are moved up, and the new tag goes
+   last. A tag before the sound data can't be replaced without moving the sound data. */
+int dsdiff_retag(FILE *fp, const uint8_t *tag, size_t tag_len)
+{
+    form_dsd_chunk_t frm8;
+    chunk_header_t header;
+    uint8_t *tail = NULL;
+    size_t tail_len = 0;
+    off_t pos = FORM_DSD_CHUNK_SIZE;
+    off_t file_end, tag_start = 0;
+    uint64_t form_size;
+    int sound_data = 0;
+
+    if (fread(&frm8, FORM_DSD_CHUNK_SIZE, 1, fp) != 1 || frm8.chunk_id != FRM8_MARKER || frm8.form_type != DSD_MARKER) {
+        return 0;
+    }
+    file_end = CHUNK_HEADER_SIZE + (off_t) hton64(frm8.chunk_data_size);
+
+    while (pos + (off_t) CHUNK_HEADER_SIZE <= file_end) {
+        uint64_t chunk_size;
+
+        fseeko(fp, pos, SEEK_SET);
+        if (fread(&header, CHUNK_HEADER_SIZE, 1, fp) != 1) {
+            break;
+        }
+        chunk_size = hton64(header.chunk_data_size);
+
+        if (header.chunk_id == DSD_MARKER || header.chunk_id == DST_MARKER) {
+            sound_data = 1;
+        } else if (header.chunk_id == PROP_MARKER && dsdiff_prop_has_id3(fp, chunk_size)) {
+            free(tail);
+            return 0;
+        } else if (header.chunk_id == MAKE_MARKER('I', 'D', '3', ' ')) {
+            if (!sound_data) {
+                free(tail);
+                return 0;
+            } else if (!tag_start) {
+                tag_start = pos;
+            }
+        } else if (tag_start) {
+            /* Keep this one, it gets moved up over the old tag */
+            size_t size = (size_t) (CHUNK_HEADER_SIZE + CEIL_ODD_NUMBER(chunk_size));
+            tail = realloc(tail, tail_len + size);
+            memcpy(tail + tail_len, &header, CHUNK_HEADER_SIZE);
+            if (fread(tail + tail_len + CHUNK_HEADER_SIZE, 1, size - CHUNK_HEADER_SIZE, fp) != size - CHUNK_HEADER_SIZE) {
+                free(tail);
+                return -1;
+            }
+            tail_len += size;
+        }
+        pos += (off_t) (CHUNK_HEADER_SIZE + CEIL_ODD_NUMBER(chunk_size));
+    }
+    if (!sound_data) {
+        free(tail);
+        return 0;
+    }
+    if (!tag_start) {
+        tag_start = file_end;
+    }
+
+    fseeko(fp, tag_start, SEEK_SET);
+    if (tail_len) {
+        fwrite(tail, 1, tail_len, fp);
+        free(tail);
+    }
+    if (tag_len) {
+        header.chunk_id = MAKE_MARKER('I', 'D', '3', ' ');
+        header.chunk_data_size = hton64((uint64_t) tag_len);
+        fwrite(&header, CHUNK_HEADER_SIZE, 1, fp);
+        fwrite(tag, 1, tag_len, fp);
+        if (tag_len & 1) {
+            uint8_t padding = 0;
+            fwrite(&padding, 1, 1, fp);
+        }
+    }
+    fflush(fp);
+    file_end = ftello(fp);
+    if (ferror(fp) || !dsd_truncate(fp, (uint64_t) file_end)) {
+        return -1;
+    }
+
+    /* Write the new length of the FRM8 chunk */
+    form_size = hton64(file_end - CHUNK_HEADER_SIZE);
+    fseeko(fp, 4, SEEK_SET);
+    if (fwrite(&form_size, sizeof(uint64_t), 1, fp) != 1) {
+        return -1;
+    }
+    return 1;
+}
@@ -589,6 +589,24 @@ struct dst_sound_index_chunk_t
 typedef struct dst_sound_index_chunk_t   dst_sound_index_chunk_t;
 #define DST_SOUND_INDEX_CHUNK_SIZE    12U
 
+// Not part of the DSDIFF specification: a DST frame index kept in a sidecar file next to a
+// DSDIFF file that has no DST Sound Index Chunk. The header is followed by frame_count
+// dst_frame_index_t structs. All values are big endian, like the rest of DSDIFF.
+#define DSTX_MARKER                            (MAKE_MARKER('D', 'S', 'T', 'X'))
+#define DST_INDEX_FILE_VERSION                 1
+#define DST_INDEX_FILE_CRC                     1     // every DST Frame Data Chunk is followed by a CRC chunk
+struct dst_index_file_header_t
+{
+    uint32_t chunk_id;                    // 'DSTX'
+    uint32_t version;                     // DST_INDEX_FILE_VERSION
+    uint64_t file_size;                   // size of the indexed DSDIFF file in bytes
+    int64_t  file_mtime;                  // modification time of the indexed DSDIFF file
+    uint32_t frame_count;                 // number of index structs that follow
+    uint32_t flags;                       // DST_INDEX_FILE_CRC
+} ATTRIBUTE_PACKED;
+typedef struct dst_index_file_header_t   dst_index_file_header_t;
+#define DST_INDEX_FILE_HEADER_SIZE    32U
+
 // The format for describing each of the comments.
 //
 // Applications and or machines without a real time clock must use a time stamp according to
@@ -19,12 +19,80 @@
 *
 */
 
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_FALLOCATE) || defined(HAVE_SYNC_FILE_RANGE) || defined(HAVE_READAHEAD)
+#define _GNU_SOURCE /* for copy_file_range, fallocate, sync_file_range and readahead */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(HAVE_POSIX_FADVISE) || defined(HAVE_FALLOCATE) || defined(HAVE_SYNC_FILE_RANGE) || defined(HAVE_READAHEAD)
+#include <fcntl.h>
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/sysctl.h>
+#endif
+#if defined(HAVE_MMAP) || defined(HAVE_IO_URING)
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "dsdio.h"
 
+/* Large file seeking on MSVC using the same syntax as GCC */
+#ifdef _MSC_VER
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+/* SSE2 is always there (we build with it), SSSE3 and AVX2 are picked at run time */
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define DSD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define DSD_TARGET(x)
+#else
+#define DSD_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+enum { DSD_CPU_PLAIN, DSD_CPU_SSSE3, DSD_CPU_AVX2 };
+
+static const uint8_t bit_reverse_table[] = {
+    0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+    0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+    0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+    0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+    0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+    0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+    0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+    0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+    0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+    0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+    0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+    0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+    0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+    0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+    0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+    0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff
+};
+
+
 /* Forward declarations of format-specific read functions */
 extern dsd_reader_funcs_t *dsdiff_reader_funcs();
 extern dsd_reader_funcs_t *dsf_reader_funcs();
@@ -32,10 +100,270 @@ extern dsd_reader_funcs_t *dsf_reader_funcs();
 extern dsd_writer_funcs_t *dsdiff_writer_funcs();
 extern dsd_writer_funcs_t *dsf_writer_funcs();
 
+extern int dsdiff_retag(FILE *fp, const uint8_t *tag, size_t tag_len);
+extern int dsf_retag(FILE *fp, const uint8_t *tag, size_t tag_len);
+
+
+/* Page cache */
+
+/* Files are let go of from the page cache in windows of this size, a window behind the position
+   they've got to, so that what's still being worked on stays put */
+#define DSD_DROP_WINDOW (8 * 1024 * 1024)
+
+/* Move *dropped up to a window behind position, returning the range it passed over (or 0
+   when there's no whole window to let go of yet) */
+static int dsd_drop_window(uint64_t *dropped, uint64_t position, uint64_t *offset, uint64_t *len)
+{
+    uint64_t end;
+
+    if (position < *dropped) {
+        /* Gone back (seeking), start again from there */
+        *dropped = position & ~(uint64_t) 4095;
+        return 0;
+    }
+    if (position - *dropped < 2 * DSD_DROP_WINDOW) {
+        return 0;
+    }
+    end = (position - DSD_DROP_WINDOW) & ~(uint64_t) 4095;
+    *offset = *dropped;
+    *len = end - *dropped;
+    *dropped = end;
+    return 1;
+}
+
+/* Let the page cache go of len bytes of a file from offset (len 0 to the end), with the
+   mapping of it, if any. Output (written) is put on the disk first, page cache only lets go of
+   clean pages. */
+static void dsd_drop_range(FILE *fp, const uint8_t *map, uint64_t offset, uint64_t len, int written)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (written) {
+        sync_file_range(fileno(fp), (off_t) offset, (off_t) len,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#endif
+#ifdef HAVE_MMAP
+    /* Pages still mapped stay in the page cache */
+    if (map && len) {
+        madvise((void*) (map + offset), (size_t) len, MADV_DONTNEED);
+    }
+#endif
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(fileno(fp), (off_t) offset, (off_t) len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* Inputs read through DSD_READER_SHARE_DEVICE are read ahead this much at a time, while holding the
+   gate of the device they're on */
+#define DSD_READ_AHEAD_WINDOW (16 * 1024 * 1024)
+
+/* ... and waited for a page of this much at a time */
+#define DSD_READ_AHEAD_PAGE   4096
+
+/* One of these for each device inputs are read from, so only one of them at a time reads */
+typedef struct dsd_device_gate_t {
+    dev_t                     device;
+    unsigned                  users;
+    pthread_mutex_t           mutex;
+    struct dsd_device_gate_t *next;
+} dsd_device_gate_t;
+
+static pthread_mutex_t dsd_gates_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dsd_device_gate_t *dsd_gates = NULL;
+
+static void dsd_reader_join_gate(dsd_reader_t *reader)
+{
+    struct stat st;
+    dsd_device_gate_t *gate;
+
+    if (fstat(fileno(reader->input), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    pthread_mutex_lock(&dsd_gates_mutex);
+    for (gate = dsd_gates; gate && gate->device != st.st_dev; gate = gate->next) {
+    }
+    if (!gate && (gate = (dsd_device_gate_t*) malloc(sizeof(dsd_device_gate_t))) != NULL) {
+        gate->device = st.st_dev;
+        gate->users = 0;
+        pthread_mutex_init(&gate->mutex, NULL);
+        gate->next = dsd_gates;
+        dsd_gates = gate;
+    }
+    if (gate) {
+        gate->users++;
+        reader->gate = gate;
+        reader->read_ahead = 0;
+        reader->read_ahead_end = (uint64_t) st.st_size;
+    }
+    pthread_mutex_unlock(&dsd_gates_mutex);
+}
+
+static void dsd_reader_leave_gate(dsd_reader_t *reader)
+{
+    dsd_device_gate_t **link;
+
+    if (!reader->gate) {
+        return;
+    }
+    pthread_mutex_lock(&dsd_gates_mutex);
+    if (--reader->gate->users == 0) {
+        for (link = &dsd_gates; *link != reader->gate; link = &(*link)->next) {
+        }
+        *link = reader->gate->next;
+        pthread_mutex_destroy(&reader->gate->mutex);
+        free(reader->gate);
+    }
+    pthread_mutex_unlock(&dsd_gates_mutex);
+    reader->gate = NULL;
+}
+
+/* Work out the next window of the input to read ahead of position, if it's time to, counting it as
+   read ahead already. Doesn't read anything, so it's quick to call under a lock where the reader
+   is shared between threads. */
+static int dsd_reader_claim_read_ahead(dsd_reader_t *reader, uint64_t position, uint64_t *offset, uint64_t *len)
+{
+    uint64_t end;
+
+    if (!reader->gate) {
+        return 0;
+    }
+    if (position > reader->read_ahead || reader->read_ahead - position > 2 * DSD_READ_AHEAD_WINDOW) {
+        /* Seeked somewhere else, start again from there */
+        reader->read_ahead = position & ~(uint64_t) 4095;
+    }
+    if (reader->read_ahead >= reader->read_ahead_end
+        || (reader->read_ahead > position && reader->read_ahead - position >= DSD_READ_AHEAD_WINDOW / 2)) {
+        return 0;
+    }
+    end = reader->read_ahead + DSD_READ_AHEAD_WINDOW;
+    if (end > reader->read_ahead_end) {
+        end = reader->read_ahead_end;
+    }
+    *offset = reader->read_ahead;
+    *len = end - reader->read_ahead;
+    reader->read_ahead = end;
+    return 1;
+}
+
+/* Have the kernel read a window of the input into the page cache while no other input on the same
+   device is being read, so several conversions from one disk don't turn its reads into seeks.
+   readahead and WILLNEED only start the reads, so the gate is held until a byte of every page of
+   the window has been read back, which waits for any page still on its way in (and does the
+   reading where neither is available). Only those bytes are copied out, the formats (and the DST
+   decoder) take the rest from the page cache, by way of the mapping or copy_file_range where they
+   can. */
+static void dsd_reader_fetch_ahead(dsd_reader_t *reader, uint64_t offset, uint64_t len)
+{
+    uint64_t page;
+    uint8_t byte;
+
+    pthread_mutex_lock(&reader->gate->mutex);
+#if defined(HAVE_READAHEAD)
+    readahead(fileno(reader->input), (off_t) offset, (size_t) len);
+#elif defined(HAVE_POSIX_FADVISE)
+    posix_fadvise(fileno(reader->input), (off_t) offset, (off_t) len, POSIX_FADV_WILLNEED);
+#endif
+    for (page = offset; page < offset + len; page = (page | (DSD_READ_AHEAD_PAGE - 1)) + 1) {
+        if (dsd_pread(reader->input, &byte, 1, page) != 1) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reader->gate->mutex);
+}
+
+/* Keep the input read into the page cache a window ahead of position */
+static void dsd_reader_read_ahead(dsd_reader_t *reader, uint64_t position)
+{
+    uint64_t offset, len;
+
+    if (dsd_reader_claim_read_ahead(reader, position, &offset, &len)) {
+        dsd_reader_fetch_ahead(reader, offset, len);
+    }
+}
+
+void dsd_reader_advance(dsd_reader_t *reader, uint64_t position)
+{
+    uint64_t offset, len;
+
+    if ((reader->flags & DSD_READER_DROP_BEHIND) && dsd_drop_window(&reader->dropped, position, &offset, &len)) {
+        dsd_drop_range(reader->input, reader->map, offset, len, 0);
+    }
+    dsd_reader_read_ahead(reader, position);
+}
+
+void dsd_writer_drop_behind(dsd_writer_t *writer, uint64_t position)
+{
+    uint64_t offset, len;
+
+    if ((writer->flags & DSD_WRITER_DROP_BEHIND) && dsd_drop_window(&writer->dropped, position, &offset, &len)) {
+#ifdef HAVE_SYNC_FILE_RANGE
+        /* Get the window still held on to going to the disk, it's let go of next time */
+        sync_file_range(fileno(writer->output), (off_t) (offset + len), (off_t) (position - offset - len),
+            SYNC_FILE_RANGE_WRITE);
+#endif
+        dsd_drop_range(writer->output, NULL, offset, len, 1);
+    }
+}
+
+void dsd_writer_set_io_policy(dsd_writer_t *writer, int flags)
+{
+    writer->flags = flags;
+#ifdef HAVE_FALLOCATE
+    if (writer->expected_length) {
+        /* The header written so far, the sound data in whole DSF block groups, and a little
+           for the chunks after it. The file size is left alone, so it can't end up too long. */
+        uint64_t group_size = (uint64_t) 4096 * writer->channel_count;
+        uint64_t size;
+
+        fflush(writer->output);
+        size = (uint64_t) ftello(writer->output) + (writer->expected_length + group_size - 1) / group_size * group_size + 4096;
+        fallocate(fileno(writer->output), FALLOC_FL_KEEP_SIZE, 0, (off_t) size);
+    }
+#endif
+}
+
 
 /* Reading */
 
-int dsd_reader_open(FILE *fp, dsd_reader_t *reader)
+/* Map a regular file into memory for reading it sequentially, pipes and anything else
+   that can't be mapped are read through stdio instead */
+static void dsd_reader_map(FILE *fp, dsd_reader_t *reader)
+{
+#ifdef HAVE_MMAP
+    struct stat st;
+    void *map;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || (uint64_t) st.st_size > (size_t) -1) {
+        return;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+    madvise(map, (size_t) st.st_size, MADV_HUGEPAGE);
+#endif
+    reader->map = (const uint8_t*) map;
+    reader->map_size = (uint64_t) st.st_size;
+#endif
+}
+
+static void dsd_reader_unmap(dsd_reader_t *reader)
+{
+#ifdef HAVE_MMAP
+    if (reader->map) {
+        munmap((void*) reader->map, (size_t) reader->map_size);
+    }
+#endif
+    reader->map = NULL;
+    reader->map_size = 0;
+}
+
+static int dsd_reader_open_stream(FILE *fp, dsd_reader_t *reader)
 {
     int result = 0;
 
@@ -54,27 +382,225 @@ int dsd_reader_open(FILE *fp, dsd_reader_t *reader)
             reader->impl = NULL;
         }
 
-        if (reader->impl && (result = reader->impl->open(fp, reader)) == 1) {
-            reader->input = fp;
+        /* The format's open may already want to look at the file through the reader */
+        reader->input = fp;
+        reader->seek_shifter = NULL;
+        reader->tracks = NULL;
+        reader->track_count = 0;
+        reader->chunks = NULL;
+        reader->chunk_count = 0;
+        reader->frame_rate = 0;
+        reader->frame_capacity = 0;
+        reader->read_start = 0;
+        reader->read_remain = UINT64_MAX;
+        reader->map = NULL;
+        reader->map_size = 0;
+        reader->dropped = 0;
+        reader->chunk_length = 0;
+        reader->gate = NULL;
+        reader->frame_errors = 0;
+        if (reader->impl) {
+#ifdef HAVE_POSIX_FADVISE
+            posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            dsd_reader_map(fp, reader);
+            if (reader->flags & DSD_READER_SHARE_DEVICE) {
+                dsd_reader_join_gate(reader);
+            }
+        }
+        if (!reader->impl || (result = reader->impl->open(fp, reader)) != 1) {
+            dsd_reader_leave_gate(reader);
+            dsd_reader_unmap(reader);
+            reader->input = NULL;
         }
     }
 
     return result;
 }
 
+int dsd_reader_open(FILE *fp, int flags, dsd_reader_t *reader)
+{
+    reader->filename = NULL;
+    reader->flags = flags;
+    return dsd_reader_open_stream(fp, reader);
+}
+
+/* Returns 1 on success, 0 if the file is not a supported format, or -1 if it can't be opened */
+int dsd_reader_open_file(const char *filename, int flags, dsd_reader_t *reader)
+{
+    FILE *fp;
+    int result;
+
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        return -1;
+    }
+
+    reader->filename = filename;
+    reader->flags = flags;
+    if ((result = dsd_reader_open_stream(fp, reader)) != 1) {
+        fclose(fp);
+    }
+    return result;
+}
+
+/* Forget about any sub-byte seek position */
+static void dsd_reader_clear_shift(dsd_reader_t *reader)
+{
+    if (reader->seek_shifter) {
+        free(reader->seek_shifter);
+        reader->seek_shifter = NULL;
+    }
+}
+
+/* Read sound data through the seek position's bit shifter */
+static size_t dsd_reader_read_shifted(char *buf, size_t len, dsd_reader_t *reader)
+{
+    size_t amount = reader->impl->read(buf, len, reader);
+
+    if (amount == 0) {
+        return dsd_bit_shifter_flush(reader->seek_shifter, buf, len);
+    }
+    return dsd_bit_shifter_process(reader->seek_shifter, buf, amount);
+}
+
 size_t dsd_reader_read(char *buf, size_t len, dsd_reader_t *reader)
 {
-    return reader->impl->read(buf, len, reader);
+    size_t amount;
+
+    if (len > reader->read_remain) {
+        len = (size_t) reader->read_remain;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (reader->seek_shifter) {
+        amount = dsd_reader_read_shifted(buf, len, reader);
+    } else {
+        amount = reader->impl->read(buf, len, reader);
+    }
+
+    if (reader->read_remain != UINT64_MAX) {
+        reader->read_remain -= amount;
+    }
+    return amount;
 }
 
 uint32_t dsd_reader_next_chunk(dsd_reader_t *reader)
 {
+    dsd_reader_clear_shift(reader);
+    reader->read_remain = UINT64_MAX;
     return reader->impl->next_chunk(reader);
 }
 
+int dsd_reader_seek(dsd_reader_t *reader, uint64_t sample_offset)
+{
+    uint64_t offset = sample_offset / 8 * reader->channel_count;
+    char first[255];
+    size_t primed = 0;
+
+    dsd_reader_clear_shift(reader);
+    if (!reader->impl->seek || !reader->impl->seek(offset, reader)) {
+        return 0;
+    }
+    reader->read_start = sample_offset;
+    reader->read_remain = UINT64_MAX;
+
+    /* The formats only seek to whole bytes, anything finer is done while reading */
+    if (sample_offset % 8) {
+        reader->seek_shifter = (dsd_bit_shifter_t*) malloc(sizeof(dsd_bit_shifter_t));
+        dsd_bit_shifter_init(reader->seek_shifter, (int) (sample_offset % 8), reader->channel_count);
+        while (primed < reader->channel_count) {
+            size_t amount = reader->impl->read(first + primed, reader->channel_count - primed, reader);
+            if (amount == 0) {
+                break;
+            }
+            primed += amount;
+        }
+        if (primed == reader->channel_count) {
+            dsd_bit_shifter_process(reader->seek_shifter, first, primed);
+        } else {
+            dsd_reader_clear_shift(reader);
+        }
+    }
+
+    return 1;
+}
+
+void dsd_reader_set_end(dsd_reader_t *reader, uint64_t sample_offset)
+{
+    uint64_t samples = (sample_offset > reader->read_start) ? sample_offset - reader->read_start : 0;
+
+    reader->read_remain = (samples + 7) / 8 * reader->channel_count;
+
+    /* Let the format know too, so it doesn't read ahead past the end */
+    if (reader->impl->set_end) {
+        reader->impl->set_end((reader->read_start + samples + 7) / 8 * reader->channel_count, reader);
+    }
+}
+
+size_t dsd_reader_read_planar(char *buf, size_t stride, size_t len, int lsb_first, dsd_reader_t *reader)
+{
+    size_t channel_count = reader->channel_count;
+    size_t amount = len;
+    char *interleaved;
+    size_t i;
+
+    if (amount > reader->read_remain / channel_count) {
+        amount = (size_t) (reader->read_remain / channel_count);
+    }
+    if (amount == 0) {
+        return 0;
+    }
+
+    if (!reader->seek_shifter && reader->impl->read_planar
+        && reader->impl->read_planar(buf, stride, &amount, lsb_first, reader)) {
+        if (reader->read_remain != UINT64_MAX) {
+            reader->read_remain -= amount * channel_count;
+        }
+        return amount;
+    }
+
+    /* Read it interleaved and take it apart */
+    interleaved = malloc(amount * channel_count);
+    amount = dsd_reader_read(interleaved, amount * channel_count, reader) / channel_count;
+    dsd_deinterleave((uint8_t*) buf, stride, (const uint8_t*) interleaved, amount, (int) channel_count);
+    if (lsb_first) {
+        for (i = 0; i < channel_count; i++) {
+            dsd_reverse_bits((uint8_t*) buf + i * stride, amount);
+        }
+    }
+    free(interleaved);
+    return amount;
+}
+
+int dsd_reader_read_frame(dsd_reader_t *reader, dsd_frame_t *frame)
+{
+    if (!reader->impl->read_frame) {
+        return 0;
+    }
+    return reader->impl->read_frame(frame, reader);
+}
+
 void dsd_reader_close(dsd_reader_t *reader)
 {
+    dsd_reader_clear_shift(reader);
     reader->impl->close(reader);
+    dsd_reader_unmap(reader);
+    dsd_reader_leave_gate(reader);
+    if (reader->input && (reader->flags & DSD_READER_DROP_BEHIND)) {
+        dsd_drop_range(reader->input, NULL, 0, 0, 0);
+    }
+    if (reader->tracks) {
+        free(reader->tracks);
+        reader->tracks = NULL;
+        reader->track_count = 0;
+    }
+    if (reader->chunks) {
+        free(reader->chunks);
+        reader->chunks = NULL;
+        reader->chunk_count = 0;
+    }
     if (reader->private) {
         free(reader->private);
         reader->private = NULL;
@@ -85,48 +611,1310 @@ void dsd_reader_close(dsd_reader_t *reader)
     }
 }
 
-int dsd_writer_open(FILE *fp, uint32_t format, uint32_t sample_rate, uint8_t channel_count, dsd_writer_t *writer)
+size_t dsd_pread(FILE *fp, void *buf, size_t len, uint64_t offset)
 {
-    switch (format) {
-    case DSD_FORMAT_DSDIFF:
-        writer->impl = dsdiff_writer_funcs();
-        break;
-    case DSD_FORMAT_DSF:
-        writer->impl = dsf_writer_funcs();
-        break;
-    default:
+#ifdef _WIN32
+    HANDLE handle = (HANDLE) _get_osfhandle(_fileno(fp));
+    OVERLAPPED overlapped;
+    DWORD bytes_read = 0;
+
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD) offset;
+    overlapped.OffsetHigh = (DWORD) (offset >> 32);
+    if (!ReadFile(handle, buf, (DWORD) len, &bytes_read, &overlapped)) {
         return 0;
     }
+    return bytes_read;
+#else
+    size_t done = 0;
 
-    writer->channel_count = channel_count;
-    writer->sample_rate = sample_rate;
-    writer->output = fp;
-    writer->data_length = 0;
+    while (done < len) {
+        ssize_t result = pread(fileno(fp), (char*) buf + done, len - done, (off_t) (offset + done));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result <= 0) {
+            break;
+        }
+        done += result;
+    }
+    return done;
+#endif
+}
 
-    writer->impl->open(writer);
+size_t dsd_pwrite(FILE *fp, const void *buf, size_t len, uint64_t offset)
+{
+#ifdef _WIN32
+    HANDLE handle = (HANDLE) _get_osfhandle(_fileno(fp));
+    OVERLAPPED overlapped;
+    DWORD bytes_written = 0;
 
-    return 1;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD) offset;
+    overlapped.OffsetHigh = (DWORD) (offset >> 32);
+    if (!WriteFile(handle, buf, (DWORD) len, &bytes_written, &overlapped)) {
+        return 0;
+    }
+    return bytes_written;
+#else
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t result = pwrite(fileno(fp), (const char*) buf + done, len - done, (off_t) (offset + done));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result <= 0) {
+            break;
+        }
+        done += result;
+    }
+    return done;
+#endif
 }
 
-void dsd_writer_write(const char *buf, size_t len, dsd_writer_t *writer)
+void dsd_bit_shifter_init(dsd_bit_shifter_t *shifter, int shift, uint8_t channel_count)
 {
-    writer->impl->write(buf, len, writer);
+    shifter->shift = (uint8_t) shift;
+    shifter->channel_count = channel_count;
+    shifter->channel = 0;
+    shifter->held = 0;
+}
+
+/* Each output byte combines the byte held back for its channel with the top bits of the next
+   byte of the same channel, so the first byte of every channel only fills the carry */
+size_t dsd_bit_shifter_process(dsd_bit_shifter_t *shifter, char *buf, size_t len)
+{
+    int shift = shifter->shift;
+    int channel = shifter->channel;
+    size_t amount = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        uint8_t next = (uint8_t) buf[i];
+
+        if (shifter->held < shifter->channel_count) {
+            shifter->carry[shifter->held++] = next;
+            continue;
+        }
+        buf[amount++] = (char) ((shifter->carry[channel] << shift) | (next >> (8 - shift)));
+        shifter->carry[channel] = next;
+        if (++channel == shifter->channel_count) {
+            channel = 0;
+        }
+    }
+
+    shifter->channel = (uint8_t) channel;
+    return amount;
 }
 
-int dsd_writer_next_chunk(uint32_t chunk, dsd_writer_t *writer)
+/* At the end of the data, pass on what's still held back, padded with zero bits */
+size_t dsd_bit_shifter_flush(dsd_bit_shifter_t *shifter, char *buf, size_t len)
 {
-    return writer->impl->next_chunk(chunk, writer);
+    size_t amount = 0;
+
+    if (shifter->held < shifter->channel_count) {
+        return 0;
+    }
+    while (amount < len && shifter->channel < shifter->channel_count) {
+        buf[amount++] = (char) (shifter->carry[shifter->channel++] << shifter->shift);
+    }
+    if (shifter->channel == shifter->channel_count) {
+        shifter->channel = 0;
+        shifter->held = 0;
+    }
+    return amount;
 }
 
-void dsd_writer_close(dsd_writer_t *writer)
+static int dsd_detect_cpu_level(void)
 {
-    writer->impl->close(writer);
-    if (writer->private) {
-        free(writer->private);
-        writer->private = NULL;
+#if defined(DSD_X86) && defined(_MSC_VER)
+    int info[4];
+    int max_leaf;
+
+    __cpuid(info, 0);
+    max_leaf = info[0];
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 9))) {
+        return DSD_CPU_PLAIN;
     }
-    if (writer->output) {
-        fclose(writer->output);
-        writer->output = NULL;
+    /* AVX2 also needs the OS to save the YMM registers */
+    if (max_leaf >= 7 && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5)) {
+            return DSD_CPU_AVX2;
+        }
+    }
+    return DSD_CPU_SSSE3;
+#elif defined(DSD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return DSD_CPU_AVX2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        return DSD_CPU_SSSE3;
+    }
+    return DSD_CPU_PLAIN;
+#else
+    return DSD_CPU_PLAIN;
+#endif
+}
+
+/* Worked out on first use, every thread finds the same answer */
+static int dsd_cpu_level(void)
+{
+    static int cpu_level = -1;
+
+    if (cpu_level < 0) {
+        cpu_level = dsd_detect_cpu_level();
+    }
+    return cpu_level;
+}
+
+#ifdef DSD_X86
+/* Bit reversal a nibble at a time: each nibble looks up its reverse in a 16-byte table, with the
+   low nibble's reverse landing in the high nibble and vice versa */
+#define DSD_REVERSE_LOW_NIBBLES  0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0
+#define DSD_REVERSE_HIGH_NIBBLES 0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e, 0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f
+
+DSD_TARGET("ssse3") static size_t dsd_reverse_bits_ssse3(uint8_t *buf, size_t len)
+{
+    const __m128i low_table = _mm_setr_epi8(DSD_REVERSE_LOW_NIBBLES);
+    const __m128i high_table = _mm_setr_epi8(DSD_REVERSE_HIGH_NIBBLES);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (buf + i));
+        __m128i low = _mm_shuffle_epi8(low_table, _mm_and_si128(v, nibble));
+        __m128i high = _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        _mm_storeu_si128((__m128i*) (buf + i), _mm_or_si128(low, high));
+    }
+    return i;
+}
+
+DSD_TARGET("avx2") static size_t dsd_reverse_bits_avx2(uint8_t *buf, size_t len)
+{
+    const __m256i low_table = _mm256_setr_epi8(DSD_REVERSE_LOW_NIBBLES, DSD_REVERSE_LOW_NIBBLES);
+    const __m256i high_table = _mm256_setr_epi8(DSD_REVERSE_HIGH_NIBBLES, DSD_REVERSE_HIGH_NIBBLES);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (buf + i));
+        __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(v, nibble));
+        __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        _mm256_storeu_si256((__m256i*) (buf + i), _mm256_or_si256(low, high));
+    }
+    return i;
+}
+
+/* Interleave 16 bytes from each of 3 to 6 channels at a time. Each output vector gathers its
+   bytes from every channel's vector with a shuffle, the masks send the bytes belonging to other
+   channels to zero. */
+DSD_TARGET("ssse3") static size_t dsd_interleave_ssse3(uint8_t *dest, const uint8_t *src, size_t stride, size_t count, int channel_count)
+{
+    uint8_t mask_bytes[6 * 6 * 16];
+    __m128i masks[6 * 6];
+    __m128i in[6];
+    size_t i;
+    int c, r, j;
+
+    for (r = 0; r < channel_count; r++) {
+        for (c = 0; c < channel_count; c++) {
+            for (j = 0; j < 16; j++) {
+                int byte = r * 16 + j;
+                mask_bytes[(r * 6 + c) * 16 + j] = (uint8_t) ((byte % channel_count == c) ? byte / channel_count : 0x80);
+            }
+            masks[r * 6 + c] = _mm_loadu_si128((const __m128i*) &mask_bytes[(r * 6 + c) * 16]);
+        }
+    }
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        for (c = 0; c < channel_count; c++) {
+            in[c] = _mm_loadu_si128((const __m128i*) (src + (size_t) c * stride + i));
+        }
+        for (r = 0; r < channel_count; r++) {
+            __m128i out = _mm_shuffle_epi8(in[0], masks[r * 6]);
+            for (c = 1; c < channel_count; c++) {
+                out = _mm_or_si128(out, _mm_shuffle_epi8(in[c], masks[r * 6 + c]));
+            }
+            _mm_storeu_si128((__m128i*) (dest + i * channel_count + r * 16), out);
+        }
+    }
+    return i;
+}
+
+/* The reverse: each channel's output vector gathers its bytes from all the input vectors */
+DSD_TARGET("ssse3") static size_t dsd_deinterleave_ssse3(uint8_t *dest, size_t stride, const uint8_t *src, size_t count, int channel_count)
+{
+    uint8_t mask_bytes[6 * 6 * 16];
+    __m128i masks[6 * 6];
+    __m128i in[6];
+    size_t i;
+    int c, r, j;
+
+    for (c = 0; c < channel_count; c++) {
+        for (r = 0; r < channel_count; r++) {
+            for (j = 0; j < 16; j++) {
+                int byte = j * channel_count + c;
+                mask_bytes[(c * 6 + r) * 16 + j] = (uint8_t) ((byte / 16 == r) ? byte % 16 : 0x80);
+            }
+            masks[c * 6 + r] = _mm_loadu_si128((const __m128i*) &mask_bytes[(c * 6 + r) * 16]);
+        }
+    }
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        for (r = 0; r < channel_count; r++) {
+            in[r] = _mm_loadu_si128((const __m128i*) (src + i * channel_count + r * 16));
+        }
+        for (c = 0; c < channel_count; c++) {
+            __m128i out = _mm_shuffle_epi8(in[0], masks[c * 6]);
+            for (r = 1; r < channel_count; r++) {
+                out = _mm_or_si128(out, _mm_shuffle_epi8(in[r], masks[c * 6 + r]));
+            }
+            _mm_storeu_si128((__m128i*) (dest + (size_t) c * stride + i), out);
+        }
     }
+    return i;
+}
+#endif
+
+void dsd_reverse_bits(uint8_t *buf, size_t len)
+{
+    int cpu_level = dsd_cpu_level();
+    size_t i = 0;
+
+#ifdef DSD_X86
+    if (cpu_level >= DSD_CPU_AVX2) {
+        i = dsd_reverse_bits_avx2(buf, len);
+    } else if (cpu_level >= DSD_CPU_SSSE3) {
+        i = dsd_reverse_bits_ssse3(buf, len);
+    }
+#endif
+    for (; i < len; i++) {
+        buf[i] = bit_reverse_table[buf[i]];
+    }
+}
+
+void dsd_deinterleave(uint8_t *dest, size_t stride, const uint8_t *src, size_t count, int channel_count)
+{
+    int cpu_level = dsd_cpu_level();
+    size_t i = 0;
+    int c;
+
+#ifdef DSD_X86
+    if (channel_count == 2) {
+        const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+        for (; i + 16 <= count; i += 16) {
+            __m128i first = _mm_loadu_si128((const __m128i*) (src + 2 * i));
+            __m128i second = _mm_loadu_si128((const __m128i*) (src + 2 * i + 16));
+            _mm_storeu_si128((__m128i*) (dest + i),
+                _mm_packus_epi16(_mm_and_si128(first, low_bytes), _mm_and_si128(second, low_bytes)));
+            _mm_storeu_si128((__m128i*) (dest + stride + i),
+                _mm_packus_epi16(_mm_srli_epi16(first, 8), _mm_srli_epi16(second, 8)));
+        }
+    } else if (channel_count > 2 && channel_count <= 6 && cpu_level >= DSD_CPU_SSSE3) {
+        i = dsd_deinterleave_ssse3(dest, stride, src, count, channel_count);
+    }
+#endif
+
+    switch (channel_count) {
+    case 1:
+        memcpy(dest, src, count);
+        break;
+    case 2:
+        for (; i < count; i++) {
+            dest[i] = src[2 * i];
+            dest[stride + i] = src[2 * i + 1];
+        }
+        break;
+    case 5:
+        for (; i < count; i++) {
+            dest[i] = src[5 * i];
+            dest[stride + i] = src[5 * i + 1];
+            dest[2 * stride + i] = src[5 * i + 2];
+            dest[3 * stride + i] = src[5 * i + 3];
+            dest[4 * stride + i] = src[5 * i + 4];
+        }
+        break;
+    case 6:
+        for (; i < count; i++) {
+            dest[i] = src[6 * i];
+            dest[stride + i] = src[6 * i + 1];
+            dest[2 * stride + i] = src[6 * i + 2];
+            dest[3 * stride + i] = src[6 * i + 3];
+            dest[4 * stride + i] = src[6 * i + 4];
+            dest[5 * stride + i] = src[6 * i + 5];
+        }
+        break;
+    default:
+        for (; i < count; i++) {
+            for (c = 0; c < channel_count; c++) {
+                dest[(size_t) c * stride + i] = src[i * channel_count + c];
+            }
+        }
+    }
+}
+
+void dsd_interleave(uint8_t *dest, const uint8_t *src, size_t stride, size_t count, int channel_count)
+{
+    int cpu_level = dsd_cpu_level();
+    size_t i = 0;
+    int c;
+
+#ifdef DSD_X86
+    if (channel_count == 2) {
+        for (; i + 16 <= count; i += 16) {
+            __m128i left = _mm_loadu_si128((const __m128i*) (src + i));
+            __m128i right = _mm_loadu_si128((const __m128i*) (src + stride + i));
+            _mm_storeu_si128((__m128i*) (dest + 2 * i), _mm_unpacklo_epi8(left, right));
+            _mm_storeu_si128((__m128i*) (dest + 2 * i + 16), _mm_unpackhi_epi8(left, right));
+        }
+    } else if (channel_count > 2 && channel_count <= 6 && cpu_level >= DSD_CPU_SSSE3) {
+        i = dsd_interleave_ssse3(dest, src, stride, count, channel_count);
+    }
+#endif
+
+    /* Whatever is left over, or all of it without SIMD */
+    switch (channel_count) {
+    case 1:
+        memcpy(dest, src, count);
+        break;
+    case 2:
+        for (; i < count; i++) {
+            dest[2 * i] = src[i];
+            dest[2 * i + 1] = src[stride + i];
+        }
+        break;
+    case 5:
+        for (; i < count; i++) {
+            dest[5 * i] = src[i];
+            dest[5 * i + 1] = src[stride + i];
+            dest[5 * i + 2] = src[2 * stride + i];
+            dest[5 * i + 3] = src[3 * stride + i];
+            dest[5 * i + 4] = src[4 * stride + i];
+        }
+        break;
+    case 6:
+        for (; i < count; i++) {
+            dest[6 * i] = src[i];
+            dest[6 * i + 1] = src[stride + i];
+            dest[6 * i + 2] = src[2 * stride + i];
+            dest[6 * i + 3] = src[3 * stride + i];
+            dest[6 * i + 4] = src[4 * stride + i];
+            dest[6 * i + 5] = src[5 * stride + i];
+        }
+        break;
+    default:
+        for (; i < count; i++) {
+            for (c = 0; c < channel_count; c++) {
+                dest[i * channel_count + c] = src[(size_t) c * stride + i];
+            }
+        }
+    }
+}
+
+uint64_t dsd_copy_file_range(FILE *input, uint64_t offset, FILE *output, uint64_t len)
+{
+    uint64_t out_start, done = 0;
+    char *buffer;
+
+    fflush(output);
+    out_start = (uint64_t) ftello(output);
+
+#ifdef HAVE_COPY_FILE_RANGE
+    {
+        loff_t in_pos = (loff_t) offset;
+        loff_t out_pos = (loff_t) out_start;
+
+        while (done < len) {
+            ssize_t result = copy_file_range(fileno(input), &in_pos, fileno(output), &out_pos, (size_t) (len - done), 0);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            } else if (result <= 0) {
+                break; /* not supported between these files, so fall back to copying it ourselves */
+            }
+            done += result;
+        }
+        fseeko(output, (off_t) (out_start + done), SEEK_SET);
+    }
+#endif
+
+    if (done < len) {
+        buffer = malloc(1 << 20);
+        while (done < len) {
+            size_t chunk = (len - done > (1 << 20)) ? (1 << 20) : (size_t) (len - done);
+            size_t amount = dsd_pread(input, buffer, chunk, offset + done);
+            if (amount == 0 || fwrite(buffer, 1, amount, output) != amount) {
+                break;
+            }
+            done += amount;
+        }
+        free(buffer);
+    }
+
+    return done;
+}
+
+size_t dsd_copy_planar(dsd_reader_t *reader, dsd_writer_t *writer, char *buf, size_t len)
+{
+    size_t channel_count = reader->channel_count;
+    size_t stride = len / channel_count;
+    size_t amount = stride;
+
+    if (!reader->impl->read_planar || !writer->impl->write_planar || reader->seek_shifter) {
+        return 0;
+    }
+    if (amount > reader->read_remain / channel_count) {
+        amount = (size_t) (reader->read_remain / channel_count);
+    }
+    if (amount == 0 || !reader->impl->read_planar(buf, stride, &amount, writer->lsb_first, reader) || amount == 0) {
+        return 0;
+    }
+
+    if (reader->read_remain != UINT64_MAX) {
+        reader->read_remain -= amount * channel_count;
+    }
+    writer->impl->write_planar(buf, stride, amount, writer->lsb_first, writer);
+    return amount * channel_count;
+}
+
+/* Bytes of each channel converted at a time by dsd_copy_parallel, a whole number of DSF blocks */
+#define DSD_PARALLEL_STRETCH (32 * 4096)
+
+/* Threads dsd_copy_parallel has running, counted across every conversion in the process so that
+   converting several files at once doesn't start more of them than there are processors */
+static pthread_mutex_t dsd_parallel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned dsd_parallel_busy = 0;
+
+typedef struct dsd_parallel_t {
+    dsd_reader_t   *reader;
+    dsd_writer_t   *writer;
+    FILE           *input;
+    const uint8_t  *map;            /* the input, when it is mapped */
+    FILE           *output;
+    unsigned        thread_count;
+    dsd_extent_t    from;
+    dsd_extent_t    to;
+    int             channel_count;
+    uint64_t        start;          /* where the input starts, in bytes of each channel */
+    uint64_t        length;         /* bytes of each channel to convert */
+    uint64_t        next;           /* the next stretch to be taken */
+    int             failed;
+    pthread_mutex_t mutex;
+} dsd_parallel_t;
+
+unsigned dsd_processor_count(void)
+{
+#if defined(_WIN32)
+    return pthread_num_processors_np();
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+    int count;
+    size_t size = sizeof(count);
+    return sysctlbyname("hw.ncpu", &count, &size, NULL, 0) ? 1 : count;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (unsigned) count : 1;
+#endif
+}
+
+/* Bytes a stretch of count bytes per channel takes up in a file, whole blocks if it has them */
+static size_t dsd_extent_size(const dsd_extent_t *extent, uint64_t count, int channel_count)
+{
+    if (extent->block_size) {
+        count = (count + extent->block_size - 1) / extent->block_size * extent->block_size;
+    }
+    return (size_t) count * channel_count;
+}
+
+static void *dsd_parallel_thread(void *userdata)
+{
+    dsd_parallel_t *job = (dsd_parallel_t*) userdata;
+    int channel_count = job->channel_count;
+    int reverse = job->from.lsb_first != job->to.lsb_first;
+    uint8_t *in = malloc((size_t) DSD_PARALLEL_STRETCH * channel_count);
+    uint8_t *out = malloc((size_t) DSD_PARALLEL_STRETCH * channel_count);
+
+    uint64_t stretch;
+
+    for (;;) {
+        size_t count, in_size, out_size, block;
+        const uint8_t *src;
+        uint8_t *result = in;
+        uint64_t in_offset, in_len, out_offset, out_len, ahead_offset, ahead_len;
+        int drop_in = 0, drop_out = 0, ahead = 0;
+
+        pthread_mutex_lock(&job->mutex);
+        stretch = job->failed ? job->length : job->next;
+        job->next += DSD_PARALLEL_STRETCH;
+        if (stretch < job->length && stretch >= (uint64_t) job->thread_count * DSD_PARALLEL_STRETCH) {
+            /* The other threads may still be on any of the stretches just before this one */
+            uint64_t done = stretch - (uint64_t) job->thread_count * DSD_PARALLEL_STRETCH;
+            drop_in = (job->reader->flags & DSD_READER_DROP_BEHIND)
+                && dsd_drop_window(&job->reader->dropped, job->from.offset + (job->start + done) * channel_count,
+                    &in_offset, &in_len);
+            drop_out = (job->writer->flags & DSD_WRITER_DROP_BEHIND)
+                && dsd_drop_window(&job->writer->dropped, job->to.offset + done * channel_count, &out_offset, &out_len);
+        }
+        if (stretch < job->length) {
+            /* The stretches are taken in order, so this keeps the reading ahead in order too */
+            ahead = dsd_reader_claim_read_ahead(job->reader, job->from.offset + (job->start + stretch) * channel_count,
+                &ahead_offset, &ahead_len);
+        }
+        pthread_mutex_unlock(&job->mutex);
+        if (stretch >= job->length) {
+            break;
+        }
+        if (ahead) {
+            dsd_reader_fetch_ahead(job->reader, ahead_offset, ahead_len);
+        }
+        if (drop_in) {
+            dsd_drop_range(job->input, job->map, in_offset, in_len, 0);
+        }
+        if (drop_out) {
+            dsd_drop_range(job->output, NULL, out_offset, out_len, 1);
+        }
+
+        count = (size_t) (job->length - stretch < DSD_PARALLEL_STRETCH ? job->length - stretch : DSD_PARALLEL_STRETCH);
+        in_size = dsd_extent_size(&job->from, count, channel_count);
+        out_size = dsd_extent_size(&job->to, count, channel_count);
+        if (job->map) {
+            src = job->map + job->from.offset + (job->start + stretch) * channel_count;
+        } else if (dsd_pread(job->input, in, in_size, job->from.offset + (job->start + stretch) * channel_count) == in_size) {
+            src = in;
+        } else {
+            break;
+        }
+
+        if (job->from.block_size == job->to.block_size) {
+            /* Same layout, only the bit order may differ. Anything past the end of the last
+               block (DSF to DSF) is silence. */
+            if (src != in) {
+                memcpy(in, src, in_size);
+            }
+            if (job->to.block_size && count % job->to.block_size) {
+                size_t tail = count % job->to.block_size;
+                uint8_t *group = in + in_size - (size_t) job->to.block_size * channel_count;
+                int c;
+
+                for (c = 0; c < channel_count; c++) {
+                    memset(group + (size_t) c * job->to.block_size + tail, 0, job->to.block_size - tail);
+                }
+            }
+            if (reverse) {
+                dsd_reverse_bits(in, in_size);
+            }
+        } else if (job->to.block_size) {
+            /* Interleaved into blocks */
+            size_t block_size = job->to.block_size;
+
+            memset(out, 0, out_size);
+            for (block = 0; block * block_size < count; block++) {
+                size_t amount = count - block * block_size < block_size ? count - block * block_size : block_size;
+                uint8_t *group = out + block * block_size * channel_count;
+
+                dsd_deinterleave(group, block_size, src + block * block_size * channel_count, amount, channel_count);
+                if (reverse) {
+                    dsd_reverse_bits(group, block_size * channel_count);
+                }
+            }
+            result = out;
+        } else {
+            /* Blocks into interleaved */
+            size_t block_size = job->from.block_size;
+
+            for (block = 0; block * block_size < count; block++) {
+                size_t amount = count - block * block_size < block_size ? count - block * block_size : block_size;
+                uint8_t *dest = out + block * block_size * channel_count;
+
+                dsd_interleave(dest, src + block * block_size * channel_count, block_size, amount, channel_count);
+                if (reverse) {
+                    dsd_reverse_bits(dest, amount * channel_count);
+                }
+            }
+            result = out;
+        }
+
+        if (dsd_pwrite(job->output, result, out_size, job->to.offset + stretch * channel_count) != out_size) {
+            break;
+        }
+    }
+
+    if (stretch < job->length) {
+        pthread_mutex_lock(&job->mutex);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->mutex);
+    }
+    free(in);
+    free(out);
+    return NULL;
+}
+
+uint64_t dsd_copy_parallel(dsd_reader_t *reader, dsd_writer_t *writer)
+{
+    dsd_parallel_t job;
+    pthread_t *threads;
+    uint64_t len, input_size;
+    int64_t mtime;
+    unsigned thread_count, started, i;
+
+    /* Setting the sound data aside and filling it in out of order takes an output that can be seeked */
+    if (!reader->impl->read_extent || !writer->impl->write_extent || writer->compressed || writer->streaming
+        || reader->seek_shifter) {
+        return 0;
+    }
+    job.from.compressed = 0;
+    if (!reader->impl->read_extent(&job.from, reader)) {
+        return 0;
+    }
+
+    len = job.from.length - job.from.position;
+    if (len > reader->read_remain) {
+        len = reader->read_remain;
+    }
+
+    /* The DST decoder does the work itself, so long as the output is the way it decodes */
+    if (job.from.compressed) {
+        uint64_t decoded;
+
+        if (len == 0 || !reader->impl->decode_extent || !writer->impl->write_extent(0, &job.to, writer)
+            || job.to.block_size || job.to.lsb_first || !writer->impl->write_extent(len, &job.to, writer)) {
+            return 0;
+        }
+        fflush(writer->output);
+
+        decoded = reader->impl->decode_extent(len, writer, &job.to, reader);
+        if (reader->read_remain != UINT64_MAX) {
+            reader->read_remain -= len;
+        }
+        if (decoded != len) {
+            fprintf(stderr, "error converting the sound data\n");
+            return DSD_COPY_FAILED;
+        }
+        return len;
+    }
+    job.channel_count = reader->channel_count;
+    job.start = job.from.position / job.channel_count;
+    job.length = len / job.channel_count;
+
+    /* Stretches have to start on block boundaries in the input, and the input has to be all there */
+    if (job.length == 0 || job.from.position % job.channel_count
+        || (job.from.block_size && (job.start % job.from.block_size || DSD_PARALLEL_STRETCH % job.from.block_size))
+        || !dsd_file_identity(reader->input, &input_size, &mtime)
+        || input_size < job.from.offset + dsd_extent_size(&job.from, job.start + job.length, job.channel_count)) {
+        return 0;
+    }
+
+    /* Find out how the output is laid out before setting any of it aside. Interleaved to
+       interleaved as it is is left to dsd_copy_raw. */
+    if (!writer->impl->write_extent(0, &job.to, writer)
+        || (job.to.block_size && DSD_PARALLEL_STRETCH % job.to.block_size)
+        || (job.from.block_size && job.to.block_size && job.from.block_size != job.to.block_size)
+        || (!job.from.block_size && !job.to.block_size && job.from.lsb_first == job.to.lsb_first)
+        || !writer->impl->write_extent(len, &job.to, writer)) {
+        return 0;
+    }
+    fflush(writer->output);
+
+    job.reader = reader;
+    job.writer = writer;
+    job.input = reader->input;
+    job.map = reader->map;
+    job.output = writer->output;
+    job.next = 0;
+    job.failed = 0;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    pthread_mutex_lock(&dsd_parallel_mutex);
+    thread_count = dsd_processor_count();
+    thread_count = (thread_count > dsd_parallel_busy + 1) ? thread_count - dsd_parallel_busy : 1;
+    if (thread_count > (job.length + DSD_PARALLEL_STRETCH - 1) / DSD_PARALLEL_STRETCH) {
+        thread_count = (unsigned) ((job.length + DSD_PARALLEL_STRETCH - 1) / DSD_PARALLEL_STRETCH);
+    }
+    dsd_parallel_busy += thread_count;
+    pthread_mutex_unlock(&dsd_parallel_mutex);
+    job.thread_count = thread_count;
+    threads = malloc(thread_count * sizeof(pthread_t));
+    for (started = 0; started < thread_count; started++) {
+        if (pthread_create(&threads[started], NULL, dsd_parallel_thread, &job) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        dsd_parallel_thread(&job);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.mutex);
+    pthread_mutex_lock(&dsd_parallel_mutex);
+    dsd_parallel_busy -= thread_count;
+    pthread_mutex_unlock(&dsd_parallel_mutex);
+
+    /* Carry on reading after it */
+    reader->impl->seek(job.from.position + len, reader);
+    if (reader->read_remain != UINT64_MAX) {
+        reader->read_remain -= len;
+    }
+    if (job.failed) {
+        fprintf(stderr, "error converting the sound data\n");
+        return DSD_COPY_FAILED;
+    }
+    return len;
+}
+
+uint64_t dsd_copy_raw(dsd_reader_t *reader, dsd_writer_t *writer, uint64_t len)
+{
+    uint64_t offset, copied;
+
+    if (!reader->impl->read_raw || !writer->impl->write_raw || writer->compressed || writer->streaming
+        || reader->seek_shifter) {
+        return 0;
+    }
+    if (len > reader->read_remain) {
+        len = reader->read_remain;
+    }
+    if (reader->gate && len > DSD_READ_AHEAD_WINDOW) {
+        /* No more than is read ahead at a time, for the copy to take from the page cache */
+        len = DSD_READ_AHEAD_WINDOW;
+    }
+    if (len == 0 || (len = reader->impl->read_raw(len, &offset, reader)) == 0) {
+        return 0;
+    }
+
+    dsd_reader_read_ahead(reader, offset);
+    copied = writer->impl->write_raw(reader->input, offset, len, writer);
+    dsd_reader_advance(reader, offset + len);
+    dsd_writer_drop_behind(writer, (uint64_t) ftello(writer->output));
+    if (reader->read_remain != UINT64_MAX) {
+        reader->read_remain -= len;
+    }
+    return copied;
+}
+
+int dsd_file_identity(FILE *fp, uint64_t *size, int64_t *mtime)
+{
+#ifdef _MSC_VER
+    struct __stat64 st;
+    if (_fstat64(_fileno(fp), &st) != 0) {
+        return 0;
+    }
+#else
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) {
+        return 0;
+    }
+#endif
+    *size = (uint64_t) st.st_size;
+    *mtime = (int64_t) st.st_mtime;
+    return 1;
+}
+
+int dsd_truncate(FILE *fp, uint64_t length)
+{
+    fflush(fp);
+#ifdef _WIN32
+    return _chsize_s(_fileno(fp), (__int64) length) == 0;
+#else
+    return ftruncate(fileno(fp), (off_t) length) == 0;
+#endif
+}
+
+
+/* Writing */
+
+static int dsd_writer_start(FILE *fp, uint32_t format, uint32_t sample_rate, uint8_t channel_count, uint64_t data_length,
+    int streaming, const dsd_chunk_info_t *chunks, uint32_t chunk_count, dsd_writer_t *writer)
+{
+    switch (format) {
+    case DSD_FORMAT_DSDIFF:
+        writer->impl = dsdiff_writer_funcs();
+        break;
+    case DSD_FORMAT_DSF:
+        writer->impl = dsf_writer_funcs();
+        break;
+    default:
+        return 0;
+    }
+
+    writer->channel_count = channel_count;
+    writer->sample_rate = sample_rate;
+    writer->output = fp;
+    writer->data_length = 0;
+    writer->compressed = 0;
+    writer->frame_rate = 0;
+    writer->lsb_first = (format == DSD_FORMAT_DSF);
+    writer->expected_length = data_length;
+    writer->flags = 0;
+    writer->dropped = 0;
+    writer->streaming = streaming;
+    writer->trailer = chunks;
+    writer->trailer_count = chunk_count;
+
+    writer->impl->open(writer);
+
+    return 1;
+}
+
+int dsd_writer_open(FILE *fp, uint32_t format, uint32_t sample_rate, uint8_t channel_count, uint64_t data_length, dsd_writer_t *writer)
+{
+    return dsd_writer_start(fp, format, sample_rate, channel_count, data_length, 0, NULL, 0, writer);
+}
+
+int dsd_writer_open_stream(FILE *fp, uint32_t format, uint32_t sample_rate, uint8_t channel_count, uint64_t data_length,
+    const dsd_chunk_info_t *chunks, uint32_t chunk_count, dsd_writer_t *writer)
+{
+    return dsd_writer_start(fp, format, sample_rate, channel_count, data_length, 1, chunks, chunk_count, writer);
+}
+
+int dsd_writer_open_dst(FILE *fp, uint32_t sample_rate, uint8_t channel_count, uint16_t frame_rate, uint64_t data_length, dsd_writer_t *writer)
+{
+    writer->impl = dsdiff_writer_funcs();
+    writer->channel_count = channel_count;
+    writer->sample_rate = sample_rate;
+    writer->output = fp;
+    writer->data_length = 0;
+    writer->compressed = 1;
+    writer->frame_rate = frame_rate;
+    writer->lsb_first = 0;
+    writer->expected_length = data_length;
+    writer->flags = 0;
+    writer->dropped = 0;
+    writer->streaming = 0;
+    writer->trailer = NULL;
+    writer->trailer_count = 0;
+
+    writer->impl->open(writer);
+
+    return 1;
+}
+
+void dsd_writer_write(const char *buf, size_t len, dsd_writer_t *writer)
+{
+    writer->impl->write(buf, len, writer);
+}
+
+void dsd_writer_write_planar(const char *buf, size_t stride, size_t len, int lsb_first, dsd_writer_t *writer)
+{
+    size_t channel_count = writer->channel_count;
+    uint8_t *interleaved;
+
+    if (writer->impl->write_planar) {
+        writer->impl->write_planar(buf, stride, len, lsb_first, writer);
+        return;
+    }
+
+    /* Put it back together and write it as usual */
+    interleaved = malloc(len * channel_count);
+    dsd_interleave(interleaved, (const uint8_t*) buf, stride, len, (int) channel_count);
+    if (lsb_first) {
+        dsd_reverse_bits(interleaved, len * channel_count);
+    }
+    writer->impl->write((const char*) interleaved, len * channel_count, writer);
+    free(interleaved);
+}
+
+void dsd_writer_write_frame(const dsd_frame_t *frame, dsd_writer_t *writer)
+{
+    writer->impl->write_frame(frame, writer);
+}
+
+int dsd_writer_next_chunk(uint32_t chunk, uint64_t length, dsd_writer_t *writer)
+{
+    return writer->impl->next_chunk(chunk, length, writer);
+}
+
+uint64_t dsd_writer_sync(dsd_writer_t *writer)
+{
+    uint64_t length;
+
+    if (!writer->impl->sync || writer->streaming) {
+        return 0;
+    }
+    length = writer->impl->sync(writer);
+    if (fflush(writer->output) != 0) {
+        return 0;
+    }
+#ifdef _WIN32
+    _commit(_fileno(writer->output));
+#else
+    fsync(fileno(writer->output));
+#endif
+    return length;
+}
+
+/* The sound data already there is set aside like the room dsd_copy_parallel fills in */
+int dsd_writer_resume(uint64_t length, dsd_writer_t *writer)
+{
+    dsd_extent_t extent;
+
+    if (!writer->impl->write_extent || writer->streaming || !writer->impl->write_extent(length, &extent, writer)) {
+        return 0;
+    }
+    fflush(writer->output);
+    return dsd_truncate(writer->output, (uint64_t) ftello(writer->output));
+}
+
+void dsd_writer_close(dsd_writer_t *writer)
+{
+    writer->impl->close(writer);
+    if (writer->output && (writer->flags & DSD_WRITER_DROP_BEHIND)) {
+        fflush(writer->output);
+        dsd_drop_range(writer->output, NULL, 0, 0, 1);
+    }
+    if (writer->private) {
+        free(writer->private);
+        writer->private = NULL;
+    }
+    if (writer->output) {
+        fclose(writer->output);
+        writer->output = NULL;
+    }
+}
+
+
+/* Writing behind */
+
+#ifdef HAVE_IO_URING
+
+/* Buffers are aligned to pages so the kernel can pin them once for the whole conversion */
+#define DSD_WRITE_QUEUE_ALIGN 4096
+
+struct dsd_write_queue_t {
+    FILE          *output;
+    unsigned       depth;
+    size_t         buffer_size;
+    uint8_t       *buffers;       /* depth buffers of buffer_size bytes each */
+    struct iovec  *iovecs;        /* one per buffer, registered with the ring if allowed */
+    unsigned      *free_slots;    /* buffers not being written, as a stack */
+    unsigned       free_count;
+    size_t        *lengths;       /* of the write each buffer is in */
+    uint64_t      *offsets;
+    uint8_t       *writing;       /* whether each buffer is with the kernel */
+    unsigned       in_flight;
+    int            fixed;         /* buffers are registered, so IORING_OP_WRITE_FIXED works */
+    int            failed;
+
+    int            ring_fd;       /* -1 once the ring stopped working, writes are then done there and then */
+    void          *sq_ring;
+    size_t         sq_ring_size;
+    void          *cq_ring;
+    size_t         cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t         sqes_size;
+    unsigned      *sq_tail;
+    unsigned      *sq_mask;
+    unsigned      *sq_array;
+    unsigned      *cq_head;
+    unsigned      *cq_tail;
+    unsigned      *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int dsd_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int dsd_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int dsd_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void dsd_write_queue_unmap(dsd_write_queue_t *queue)
+{
+    if (queue->sqes) {
+        munmap(queue->sqes, queue->sqes_size);
+    }
+    if (queue->cq_ring) {
+        munmap(queue->cq_ring, queue->cq_ring_size);
+    }
+    if (queue->sq_ring) {
+        munmap(queue->sq_ring, queue->sq_ring_size);
+    }
+    if (queue->ring_fd >= 0) {
+        close(queue->ring_fd);
+    }
+    queue->sqes = NULL;
+    queue->cq_ring = NULL;
+    queue->sq_ring = NULL;
+    queue->ring_fd = -1;
+}
+
+static int dsd_write_queue_map(dsd_write_queue_t *queue)
+{
+    struct io_uring_params params;
+    void *map;
+
+    memset(&params, 0, sizeof(params));
+    queue->ring_fd = dsd_io_uring_setup(queue->depth, &params);
+    if (queue->ring_fd < 0) {
+        return 0;
+    }
+
+    queue->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    map = mmap(NULL, queue->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        queue->ring_fd, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    queue->sq_ring = map;
+    queue->sq_tail = (unsigned*) ((char*) map + params.sq_off.tail);
+    queue->sq_mask = (unsigned*) ((char*) map + params.sq_off.ring_mask);
+    queue->sq_array = (unsigned*) ((char*) map + params.sq_off.array);
+
+    queue->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    map = mmap(NULL, queue->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        queue->ring_fd, IORING_OFF_CQ_RING);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    queue->cq_ring = map;
+    queue->cq_head = (unsigned*) ((char*) map + params.cq_off.head);
+    queue->cq_tail = (unsigned*) ((char*) map + params.cq_off.tail);
+    queue->cq_mask = (unsigned*) ((char*) map + params.cq_off.ring_mask);
+    queue->cqes = (struct io_uring_cqe*) ((char*) map + params.cq_off.cqes);
+
+    queue->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, queue->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        queue->ring_fd, IORING_OFF_SQES);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    queue->sqes = (struct io_uring_sqe*) map;
+    return 1;
+}
+
+/* Hand back the buffers of the writes that have finished, writing out whatever the kernel
+   left short ourselves */
+static void dsd_write_queue_reap(dsd_write_queue_t *queue)
+{
+    unsigned head = *queue->cq_head;
+    unsigned tail = __atomic_load_n(queue->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &queue->cqes[head & *queue->cq_mask];
+        unsigned slot = (unsigned) cqe->user_data;
+        size_t done = cqe->res > 0 ? (size_t) cqe->res : 0;
+
+        if (done < queue->lengths[slot]) {
+            size_t remain = queue->lengths[slot] - done;
+            if (dsd_pwrite(queue->output, queue->buffers + slot * queue->buffer_size + done, remain,
+                    queue->offsets[slot] + done) != remain) {
+                queue->failed = 1;
+            }
+        }
+        queue->free_slots[queue->free_count++] = slot;
+        queue->writing[slot] = 0;
+        queue->in_flight--;
+        head++;
+    }
+    __atomic_store_n(queue->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait until a buffer is free, or until everything has been written */
+static void dsd_write_queue_wait(dsd_write_queue_t *queue, int all)
+{
+    while (queue->in_flight > 0 && (all || queue->free_count == 0)) {
+        dsd_write_queue_reap(queue);
+        if (queue->in_flight > 0 && (all || queue->free_count == 0)
+            && dsd_io_uring_enter(queue->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            /* Nothing more can be known about the writes still out, so give up on them */
+            unsigned i;
+            for (i = 0; i < queue->depth; i++) {
+                if (queue->writing[i]) {
+                    queue->writing[i] = 0;
+                    queue->free_slots[queue->free_count++] = i;
+                }
+            }
+            queue->in_flight = 0;
+            queue->failed = 1;
+            dsd_write_queue_unmap(queue);
+        }
+    }
+}
+
+dsd_write_queue_t *dsd_write_queue_create(FILE *fp, unsigned depth, size_t buffer_size)
+{
+    struct stat st;
+    dsd_write_queue_t *queue;
+    void *buffers;
+    unsigned i;
+
+    /* Writes go to absolute positions, which pipes don't have */
+    fflush(fp);
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+
+    queue = (dsd_write_queue_t*) calloc(1, sizeof(dsd_write_queue_t));
+    queue->output = fp;
+    queue->depth = depth;
+    queue->buffer_size = buffer_size;
+    queue->ring_fd = -1;
+    if (!dsd_write_queue_map(queue)
+        || posix_memalign(&buffers, DSD_WRITE_QUEUE_ALIGN, (size_t) depth * buffer_size) != 0) {
+        /* No io_uring here (an old kernel, or it's been turned off) */
+        dsd_write_queue_unmap(queue);
+        free(queue);
+        return NULL;
+    }
+    queue->buffers = (uint8_t*) buffers;
+    queue->iovecs = (struct iovec*) malloc(depth * sizeof(struct iovec));
+    queue->free_slots = (unsigned*) malloc(depth * sizeof(unsigned));
+    queue->lengths = (size_t*) malloc(depth * sizeof(size_t));
+    queue->offsets = (uint64_t*) malloc(depth * sizeof(uint64_t));
+    queue->writing = (uint8_t*) calloc(depth, 1);
+    for (i = 0; i < depth; i++) {
+        queue->iovecs[i].iov_base = queue->buffers + i * buffer_size;
+        queue->iovecs[i].iov_len = buffer_size;
+        queue->free_slots[i] = depth - 1 - i;
+    }
+    queue->free_count = depth;
+
+    /* Registering needs locked memory, without it every write maps its buffer instead */
+    queue->fixed = dsd_io_uring_register(queue->ring_fd, IORING_REGISTER_BUFFERS, queue->iovecs, depth) == 0;
+    return queue;
+}
+
+uint8_t *dsd_write_queue_buffer(dsd_write_queue_t *queue)
+{
+    dsd_write_queue_wait(queue, 0);
+    return queue->buffers + queue->free_slots[--queue->free_count] * queue->buffer_size;
+}
+
+void dsd_write_queue_submit(dsd_write_queue_t *queue, uint8_t *buffer, size_t len, uint64_t offset)
+{
+    unsigned slot = (unsigned) ((buffer - queue->buffers) / queue->buffer_size);
+
+    queue->lengths[slot] = len;
+    queue->offsets[slot] = offset;
+    if (queue->ring_fd >= 0) {
+        unsigned tail = *queue->sq_tail;
+        unsigned index = tail & *queue->sq_mask;
+        struct io_uring_sqe *sqe = &queue->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = fileno(queue->output);
+        sqe->off = offset;
+        sqe->user_data = slot;
+        if (queue->fixed) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->addr = (uint64_t) (uintptr_t) buffer;
+            sqe->len = (uint32_t) len;
+            sqe->buf_index = (uint16_t) slot;
+        } else {
+            queue->iovecs[slot].iov_len = len;
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->addr = (uint64_t) (uintptr_t) &queue->iovecs[slot];
+            sqe->len = 1;
+        }
+        queue->sq_array[index] = index;
+        __atomic_store_n(queue->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        for (;;) {
+            if (dsd_io_uring_enter(queue->ring_fd, 1, 0, 0) >= 0) {
+                queue->writing[slot] = 1;
+                queue->in_flight++;
+                return;
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+        /* The kernel wouldn't take it, so write this one and everything after it directly */
+        dsd_write_queue_wait(queue, 1);
+        dsd_write_queue_unmap(queue);
+    }
+
+    if (dsd_pwrite(queue->output, buffer, len, offset) != len) {
+        queue->failed = 1;
+    }
+    queue->free_slots[queue->free_count++] = slot;
+}
+
+int dsd_write_queue_finish(dsd_write_queue_t *queue)
+{
+    if (queue->ring_fd >= 0) {
+        dsd_write_queue_wait(queue, 1);
+    }
+    return !queue->failed;
+}
+
+void dsd_write_queue_destroy(dsd_write_queue_t *queue)
+{
+    dsd_write_queue_finish(queue);
+    dsd_write_queue_unmap(queue);
+    free(queue->buffers);
+    free(queue->iovecs);
+    free(queue->free_slots);
+    free(queue->lengths);
+    free(queue->offsets);
+    free(queue->writing);
+    free(queue);
+}
+
+#else
+
+/* Without io_uring the writers write everything there and then */
+dsd_write_queue_t *dsd_write_queue_create(FILE *fp, unsigned depth, size_t buffer_size)
+{
+    return NULL;
+}
+
+uint8_t *dsd_write_queue_buffer(dsd_write_queue_t *queue)
+{
+    return NULL;
+}
+
+void dsd_write_queue_submit(dsd_write_queue_t *queue, uint8_t *buffer, size_t len, uint64_t offset)
+{
+}
+
+int dsd_write_queue_finish(dsd_write_queue_t *queue)
+{
+    return 1;
+}
+
+void dsd_write_queue_destroy(dsd_write_queue_t *queue)
+{
+}
+
+#endif
+
+
+/* Retagging */
+
+/* Returns 1 on success, 0 if the file is not a supported format or its tag can't be replaced
+   in place, or -1 if it can't be opened or written */
+int dsd_retag_file(const char *filename, const uint8_t *tag, size_t tag_len)
+{
+    FILE *fp;
+    uint32_t format;
+    int result = 0;
+
+    if ((fp = fopen(filename, "r+b")) == NULL) {
+        return -1;
+    }
+
+    if (fread(&format, 4, 1, fp) == 1) {
+        rewind(fp);
+
+        switch (format) {
+        case DSD_FORMAT_DSDIFF:
+            result = dsdiff_retag(fp, tag, tag_len);
+            break;
+        case DSD_FORMAT_DSF:
+            result = dsf_retag(fp, tag, tag_len);
+            break;
+        }
+    }
+
+    if (fclose(fp) != 0 && result == 1) {
+        result = -1;
+    }
+    return result;
 }
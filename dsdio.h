@@ -35,40 +35,193 @@
 /* Reading */
 struct dsd_reader_t;
 
+/* Moves interleaved sound data earlier by 1 to 7 samples per channel, for starting at a sample that
+   isn't on a byte boundary. The first byte of each channel is held back, the data must start with
+   the first channel. */
+typedef struct dsd_bit_shifter_t {
+    uint8_t             shift;
+    uint8_t             channel_count;
+    uint8_t             channel;
+    uint8_t             held;
+    uint8_t             carry[255];
+} dsd_bit_shifter_t;
+
+/* A track within the sound data, as sample positions (per channel) */
+typedef struct dsd_track_t {
+    uint64_t            start;
+    uint64_t            end;
+} dsd_track_t;
+
+/* A chunk after the sound data, as dsd_reader_next_chunk will return it */
+typedef struct dsd_chunk_info_t {
+    uint32_t            chunk_id;
+    uint64_t            length;
+} dsd_chunk_info_t;
+
+/* A DST frame as it is stored in the file, for copying compressed sound data without decoding it */
+typedef struct dsd_frame_t {
+    uint8_t            *data;     /* buffer of at least frame_capacity bytes, provided by the caller */
+    size_t              size;
+    uint8_t             crc[4];
+    int                 has_crc;
+} dsd_frame_t;
+
+/* Where and how uncompressed sound data is stored in a file, see dsd_copy_parallel */
+typedef struct dsd_extent_t {
+    uint64_t            offset;     /* file position of the first byte of sound data */
+    uint64_t            length;     /* bytes of sound data, interleaved (reading only) */
+    uint64_t            position;   /* bytes of it already read (reading only) */
+    uint32_t            block_size; /* bytes in each channel's blocks (DSF), 0 when the channels are interleaved */
+    uint8_t             lsb_first;
+    uint8_t             compressed; /* DST, which only the reader can get out (decode_extent) */
+} dsd_extent_t;
+
+/* Flags for dsd_reader_open and dsd_reader_open_file */
+#define DSD_READER_BUILD_INDEX 0x01 /* index DST files without a DSTI chunk and keep the index in a sidecar file */
+#define DSD_READER_DROP_BEHIND 0x02 /* let the page cache go of the input once it's been read */
+#define DSD_READER_SHARE_DEVICE 0x04 /* read the input ahead in long stretches, taking turns with the other
+                                        inputs read from the same device, see dsd_reader_advance */
+#define DSD_READER_VERIFY 0x08 /* check the decoded DST frames against their CRCs (DSTC chunks), counting
+                                  the frames that fail in frame_errors */
+
+struct dsd_writer_t;
+
 typedef struct dsd_reader_funcs_t {
     int      (*open)      (FILE *fp, struct dsd_reader_t *reader);
     size_t   (*read)      (char *buf, size_t len, struct dsd_reader_t *reader);
     uint32_t (*next_chunk)(struct dsd_reader_t *reader);
     void     (*close)     (struct dsd_reader_t *reader);
+    int      (*seek)      (uint64_t offset, struct dsd_reader_t *reader); /* byte offset into the sound data */
+    void     (*set_end)   (uint64_t offset, struct dsd_reader_t *reader); /* optional, a hint not to read past offset */
+    int      (*read_frame)(dsd_frame_t *frame, struct dsd_reader_t *reader); /* optional, DST input only */
+    uint64_t (*read_raw)  (uint64_t len, uint64_t *offset, struct dsd_reader_t *reader); /* optional, see dsd_copy_raw */
+    int      (*read_planar)(char *buf, size_t stride, size_t *len, int lsb_first, struct dsd_reader_t *reader); /* optional, returns 0 when read has to be used instead */
+    int      (*read_extent)(dsd_extent_t *extent, struct dsd_reader_t *reader); /* optional, see dsd_copy_parallel */
+    uint64_t (*decode_extent)(uint64_t len, struct dsd_writer_t *writer, const dsd_extent_t *extent, struct dsd_reader_t *reader); /* optional, DST input only */
 } dsd_reader_funcs_t;
 
 typedef struct dsd_reader_t {
     FILE               *input;
+    const char         *filename;
+    int                 flags;
 
     uint8_t             channel_count;
     uint32_t            sample_rate;
     uint64_t            data_length;
     uint8_t             compressed;
+    uint16_t            frame_rate;     /* DST frames per second, when compressed */
+    uint32_t            frame_capacity; /* largest DST frame, when compressed */
+
+    /* Tracks marked in the file (DSDIFF edited masters), in order */
+    dsd_track_t        *tracks;
+    uint32_t            track_count;
+
+    /* Chunks after the sound data, in the order dsd_reader_next_chunk returns them */
+    dsd_chunk_info_t   *chunks;
+    uint32_t            chunk_count;
 
     uint32_t            container_format;
+    uint64_t            chunk_length;   /* bytes in the chunk dsd_reader_next_chunk last returned */
     void               *private;
     dsd_reader_funcs_t *impl;
+
+    /* The whole input mapped into memory, or NULL when it can't be (pipes), for the formats to
+       take sound data straight from instead of reading it */
+    const uint8_t      *map;
+    uint64_t            map_size;
+
+    /* Set while reading from a seek position that isn't on a byte boundary */
+    dsd_bit_shifter_t  *seek_shifter;
+
+    /* Where the sound data read next starts (in samples per channel), and how many more bytes of it
+       may be read, see dsd_reader_set_end */
+    uint64_t            read_start;
+    uint64_t            read_remain;
+
+    /* How much of the input the page cache has been told to let go of, see DSD_READER_DROP_BEHIND */
+    uint64_t            dropped;
+
+    /* The device's turn taking, how far the input has been read ahead and its size, see
+       DSD_READER_SHARE_DEVICE */
+    struct dsd_device_gate_t *gate;
+    uint64_t            read_ahead;
+    uint64_t            read_ahead_end;
+
+    /* DST frames that couldn't be decoded or didn't match their CRC, only final once the reader
+       is closed (frames still being decoded can add to it until then) */
+    uint32_t            frame_errors;
 } dsd_reader_t;
 
-extern int      dsd_reader_open(FILE *fp, dsd_reader_t *reader);
+extern int      dsd_reader_open(FILE *fp, int flags, dsd_reader_t *reader);
+extern int      dsd_reader_open_file(const char *filename, int flags, dsd_reader_t *reader);
 extern size_t   dsd_reader_read(char *buf, size_t len, dsd_reader_t *reader);
 extern uint32_t dsd_reader_next_chunk(dsd_reader_t *reader);
 extern void     dsd_reader_close(dsd_reader_t *reader);
 
+/* Continue reading the sound data from a sample position (per channel), returns 0 if that
+   isn't possible, e.g. once the reader has moved on to the chunks after the sound data */
+extern int      dsd_reader_seek(dsd_reader_t *reader, uint64_t sample_offset);
+
+/* Stop reading the sound data at a sample position (per channel), call after seeking but before
+   reading, the last byte read for each channel may hold up to 7 samples past the end */
+extern void     dsd_reader_set_end(dsd_reader_t *reader, uint64_t sample_offset);
+
+/* Read up to len bytes of each channel's sound data, channel n going to buf + n * stride, with the
+   bits of each byte MSB first or, if lsb_first, LSB first. Returns the number of bytes read for
+   each channel. Don't mix with dsd_reader_read part way through the channels. */
+extern size_t   dsd_reader_read_planar(char *buf, size_t stride, size_t len, int lsb_first, dsd_reader_t *reader);
+
+/* Read the next DST frame of compressed input as it is (instead of dsd_reader_read), starting at the
+   frame holding the seek position and stopping at the frame holding the end, returns 0 at the end */
+extern int      dsd_reader_read_frame(dsd_reader_t *reader, dsd_frame_t *frame);
+
+/* Read from or write to an absolute file position without using or moving the stream position,
+   so several threads may use the same file at once */
+extern size_t   dsd_pread(FILE *fp, void *buf, size_t len, uint64_t offset);
+extern size_t   dsd_pwrite(FILE *fp, const void *buf, size_t len, uint64_t offset);
+
+/* Shift sound data in place, returning the number of bytes ready, and get the held back bytes out
+   at the end of the data */
+extern void     dsd_bit_shifter_init(dsd_bit_shifter_t *shifter, int shift, uint8_t channel_count);
+extern size_t   dsd_bit_shifter_process(dsd_bit_shifter_t *shifter, char *buf, size_t len);
+extern size_t   dsd_bit_shifter_flush(dsd_bit_shifter_t *shifter, char *buf, size_t len);
+
+/* Reverse the bits of every byte, between MSB first (DSDIFF) and LSB first (DSF) */
+extern void     dsd_reverse_bits(uint8_t *buf, size_t len);
+
+/* Interleave count bytes of each channel, channel n's starting at src + n * stride, or take
+   interleaved data apart again, using SSE2/SSSE3 where the CPU has them */
+extern void     dsd_interleave(uint8_t *dest, const uint8_t *src, size_t stride, size_t count, int channel_count);
+extern void     dsd_deinterleave(uint8_t *dest, size_t stride, const uint8_t *src, size_t count, int channel_count);
+
+/* For the formats: the input before position has been read, or the output before it written,
+   for letting the page cache go of it when asked to (DSD_READER_DROP_BEHIND and
+   DSD_WRITER_DROP_BEHIND), and for reading the input on ahead of it (DSD_READER_SHARE_DEVICE) */
+extern void     dsd_reader_advance(dsd_reader_t *reader, uint64_t position);
+extern void     dsd_writer_drop_behind(struct dsd_writer_t *writer, uint64_t position);
+
+/* Number of processors, which the threads started for converting are kept within */
+extern unsigned dsd_processor_count(void);
+
+/* Size and modification time of an open file, used to tell whether derived data is stale */
+extern int      dsd_file_identity(FILE *fp, uint64_t *size, int64_t *mtime);
+
+/* Cut off or extend an open file at length, returns 0 on failure */
+extern int      dsd_truncate(FILE *fp, uint64_t length);
+
 
 /* Writing */
-struct dsd_writer_t;
 
 typedef struct dsd_writer_funcs_t {
     void (*open)      (struct dsd_writer_t *writer);
     void (*write)     (const char *buf, size_t len, struct dsd_writer_t *writer);
-    int  (*next_chunk)(uint32_t chunk, struct dsd_writer_t *writer);
+    int  (*next_chunk)(uint32_t chunk, uint64_t length, struct dsd_writer_t *writer);
     void (*close)     (struct dsd_writer_t *writer);
+    void (*write_frame)(const dsd_frame_t *frame, struct dsd_writer_t *writer); /* optional, DST output only */
+    uint64_t (*write_raw)(FILE *input, uint64_t offset, uint64_t len, struct dsd_writer_t *writer); /* optional, see dsd_copy_raw */
+    void (*write_planar)(const char *buf, size_t stride, size_t len, int lsb_first, struct dsd_writer_t *writer); /* optional, sound data only */
+    int  (*write_extent)(uint64_t len, dsd_extent_t *extent, struct dsd_writer_t *writer); /* optional, sets aside len bytes (0 to only ask), see dsd_copy_parallel */
+    uint64_t (*sync)(struct dsd_writer_t *writer); /* optional, see dsd_writer_sync */
 } dsd_writer_funcs_t;
 
 typedef struct dsd_writer_t {
@@ -77,14 +230,118 @@ typedef struct dsd_writer_t {
     uint8_t             channel_count;
     uint32_t            sample_rate;
     uint64_t            data_length;
+    uint8_t             compressed;
+    uint16_t            frame_rate;
+    uint8_t             lsb_first;      /* the format stores sound data LSB first */
+    uint64_t            expected_length; /* bytes of sound data given when opening */
+    int                 flags;          /* see dsd_writer_set_io_policy */
+    uint64_t            dropped;
+
+    /* Set by dsd_writer_open_stream: the output is written strictly from start to end, with the
+       chunks after the sound data known up front */
+    int                 streaming;
+    const dsd_chunk_info_t *trailer;
+    uint32_t            trailer_count;
 
     void               *private;
     dsd_writer_funcs_t *impl;
 } dsd_writer_t;
 
-extern int  dsd_writer_open(FILE *fp, uint32_t format, uint32_t sample_rate, uint8_t channel_count, dsd_writer_t *writer);
+/* Flags for dsd_writer_set_io_policy */
+#define DSD_WRITER_DROP_BEHIND 0x01 /* put the output on the disk and let the page cache go of it as it's written */
+
+/* The writers put headers for data_length bytes of sound data (0 if not known) at the start of the file
+   and track where they are themselves, so that nothing has to be changed afterwards unless it turns out
+   otherwise. Any sizes that do are put right at close with positional writes. */
+extern int  dsd_writer_open(FILE *fp, uint32_t format, uint32_t sample_rate, uint8_t channel_count, uint64_t data_length, dsd_writer_t *writer);
 extern void dsd_writer_write(const char *buf, size_t len, dsd_writer_t *writer);
-extern int  dsd_writer_next_chunk(uint32_t chunk, dsd_writer_t *writer);
+
+/* Open a writer for output that can't be gone back over, such as a pipe. The chunks that will be
+   written after the sound data (those of dsd_reader_t.chunks that are going to be copied) are given
+   up front, and have to stay around until the writer is closed, so that every header can be written
+   with its final size the first time. data_length has to be exact. */
+extern int  dsd_writer_open_stream(FILE *fp, uint32_t format, uint32_t sample_rate, uint8_t channel_count, uint64_t data_length,
+    const dsd_chunk_info_t *chunks, uint32_t chunk_count, dsd_writer_t *writer);
+
+/* Write len bytes of each channel's sound data, laid out as for dsd_reader_read_planar */
+extern void dsd_writer_write_planar(const char *buf, size_t stride, size_t len, int lsb_first, dsd_writer_t *writer);
+
+/* Write DST frames as they are into a DSDIFF file, with dsd_writer_write_frame instead of dsd_writer_write */
+extern int  dsd_writer_open_dst(FILE *fp, uint32_t sample_rate, uint8_t channel_count, uint16_t frame_rate, uint64_t data_length, dsd_writer_t *writer);
+extern void dsd_writer_write_frame(const dsd_frame_t *frame, dsd_writer_t *writer);
+
+/* Start writing a chunk of length bytes (as read with dsd_reader_next_chunk) after the sound data,
+   returns 0 if the format has no place for it */
+extern int  dsd_writer_next_chunk(uint32_t chunk, uint64_t length, dsd_writer_t *writer);
 extern void dsd_writer_close(dsd_writer_t *writer);
 
+/* Get the sound data written so far into the file and onto the disk, as far as the format can
+   without padding it out. Returns how many bytes of it are there, a whole number of bytes of each
+   channel to carry on from with dsd_writer_resume, or 0 if the writer can't tell. */
+extern uint64_t dsd_writer_sync(dsd_writer_t *writer);
+
+/* Carry on writing a file that already has length bytes of sound data (as returned by
+   dsd_writer_sync) after the header the writer has just written, cutting off anything after
+   them. Returns 0 if the format can't. */
+extern int  dsd_writer_resume(uint64_t length, dsd_writer_t *writer);
+
+/* Set how the writer uses the file system, right after opening it: flags as above. The disk space
+   for the sound data given when opening is reserved up front. */
+extern void dsd_writer_set_io_policy(dsd_writer_t *writer, int flags);
+
+/* Sound data written behind, for the writers: each buffer is handed to the kernel (io_uring on
+   Linux) and filling the next one carries on while it's being written. Creating a queue returns
+   NULL where that isn't possible (other systems, or output that isn't a regular file), in which
+   case the writer writes through the stream as usual. The queue writes to absolute positions,
+   so the stream position has to be moved past the data afterwards. */
+typedef struct dsd_write_queue_t dsd_write_queue_t;
+
+extern dsd_write_queue_t *dsd_write_queue_create(FILE *fp, unsigned depth, size_t buffer_size);
+
+/* A buffer to fill, waiting for an earlier write to finish if they're all taken */
+extern uint8_t *dsd_write_queue_buffer(dsd_write_queue_t *queue);
+
+/* Write len bytes of a buffer from dsd_write_queue_buffer at offset, the buffer goes back to the queue */
+extern void dsd_write_queue_submit(dsd_write_queue_t *queue, uint8_t *buffer, size_t len, uint64_t offset);
+
+/* Wait for everything submitted to be written, returns 0 if any of it couldn't be */
+extern int  dsd_write_queue_finish(dsd_write_queue_t *queue);
+extern void dsd_write_queue_destroy(dsd_write_queue_t *queue);
+
+
+/* Copying */
+
+/* Move up to len bytes of the current chunk from the reader to the writer without passing them
+   through user space, when the input stores them exactly as the output wants them (uncompressed
+   DSDIFF to DSDIFF). Returns the number of bytes moved, or 0 when the caller has to read and
+   write them as usual. */
+extern uint64_t dsd_copy_raw(dsd_reader_t *reader, dsd_writer_t *writer, uint64_t len);
+
+/* Move up to len bytes of sound data from the reader to the writer through buf, one channel after
+   another, when both can handle it that way (DST decoding into DSF), so that it never has to be
+   interleaved in between. Returns the number of bytes moved, or 0 when the caller has to read
+   and write them as usual. */
+extern size_t   dsd_copy_planar(dsd_reader_t *reader, dsd_writer_t *writer, char *buf, size_t len);
+
+/* Convert the rest of the sound data on a thread per processor when it's stored uncompressed
+   (DSF to DSDIFF and back). The writer sets aside room for all of it and the threads each take
+   a stretch of whole blocks, read it, rearrange it and write it straight to where it belongs.
+   DST going into uncompressed DSDIFF works the same way, each decoding thread writing its frame
+   where it belongs. Returns the number of bytes converted, 0 when the caller has to read and
+   write them as usual, or DSD_COPY_FAILED when some of them couldn't be (the output then has
+   holes in it). */
+#define DSD_COPY_FAILED UINT64_MAX
+extern uint64_t dsd_copy_parallel(dsd_reader_t *reader, dsd_writer_t *writer);
+
+/* Copy a range of one file to the current position of another, inside the kernel where possible
+   (and as a reflink on filesystems that can), returns the number of bytes copied */
+extern uint64_t dsd_copy_file_range(FILE *input, uint64_t offset, FILE *output, uint64_t len);
+
+
+/* Retagging */
+
+/* Replace the ID3 tag of a DSF or DSDIFF file in place, rewriting only the end of the file and
+   never the sound data. A tag_len of 0 removes the tag. */
+extern int dsd_retag_file(const char *filename, const uint8_t *tag, size_t tag_len);
+
 #endif /* DSDIO_H_INCLUDED */
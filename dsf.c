@@ -33,36 +33,20 @@
 #define off_t int64_t
 #endif
 
-
-static const uint8_t bit_reverse_table[] = {
-    0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
-    0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8, 0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
-    0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4, 0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
-    0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec, 0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
-    0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2, 0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
-    0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea, 0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
-    0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6, 0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
-    0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee, 0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
-    0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1, 0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
-    0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
-    0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5, 0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
-    0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed, 0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
-    0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3, 0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
-    0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb, 0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
-    0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7, 0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
-    0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef, 0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff
-};
-
-
 typedef struct dsf_read_context_t {
     uint32_t block_size;
-    uint8_t *buffer[6];
-    uint8_t *buffer_ptr[6];
+    uint8_t *group;           /* a block of each channel, read from the file in one go */
+    const uint8_t *group_data; /* the group, either that or straight out of the mapped file */
+    int      group_lsb;       /* group_data is still LSB first */
+    uint64_t group_offset;    /* file position of the next group */
+    uint32_t group_pos;       /* where the next byte is in each block */
     int      current_channel;
     int      is_lsb;
     uint64_t id3_start;
     uint64_t id3_size;
     uint64_t bytes_remain;
+    off_t    data_start;
+    uint64_t data_length;
 } dsf_read_context_t;
 
 static int dsf_read_open(FILE *fp, dsd_reader_t *reader)
@@ -71,7 +55,6 @@ static int dsf_read_open(FILE *fp, dsd_reader_t *reader)
     fmt_chunk_t fmt;
     data_chunk_t data;
     dsf_read_context_t *context;
-    int i;
 
     fread(&dsd, DSD_CHUNK_HEADER_SIZE, 1, fp);
     if (dsd.chunk_id != DSD_MARKER) {
@@ -100,22 +83,57 @@ static int dsf_read_open(FILE *fp, dsd_reader_t *reader)
 
     context = (dsf_read_context_t*) malloc(sizeof(dsf_read_context_t));
     context->bytes_remain = reader->data_length;
+    context->data_start = ftello(fp);
+    context->data_length = reader->data_length;
     context->block_size = htole32(fmt.block_size_per_channel);
     context->current_channel = 0;
-    for (i = 0; i < reader->channel_count; i++) {
-        context->buffer[i] = malloc(context->block_size);
-        context->buffer_ptr[i] = context->buffer[i] + context->block_size;
-    }
+    context->group = malloc((size_t) context->block_size * reader->channel_count);
+    context->group_data = context->group;
+    context->group_lsb = 0;
+    context->group_offset = context->data_start;
+    context->group_pos = context->block_size;
     context->is_lsb = htole32(fmt.bits_per_sample) == 1;
     context->id3_start = htole64(dsd.metadata_offset);
     if (context->id3_start > 0) {
         context->id3_size = htole64(dsd.total_file_size) - context->id3_start;
+        reader->chunks = (dsd_chunk_info_t*) malloc(sizeof(dsd_chunk_info_t));
+        reader->chunks[0].chunk_id = MAKE_MARKER('I', 'D', '3', ' ');
+        reader->chunks[0].length = context->id3_size;
+        reader->chunk_count = 1;
     }
 
     reader->private = context;
     return 1;
 }
 
+/* Read the next block group and get it into MSB-first order, or when the file is mapped just
+   point at it there and leave the bits to be reversed as they're copied out */
+static int dsf_read_group(dsf_read_context_t *context, dsd_reader_t *reader)
+{
+    size_t group_size = (size_t) context->block_size * reader->channel_count;
+
+    dsd_reader_advance(reader, context->group_offset);
+    if (reader->map) {
+        if (context->group_offset + group_size > reader->map_size) {
+            return 0;
+        }
+        context->group_data = reader->map + context->group_offset;
+        context->group_lsb = context->is_lsb;
+    } else {
+        if (fread(context->group, 1, group_size, reader->input) != group_size) {
+            return 0;
+        }
+        if (context->is_lsb) {
+            dsd_reverse_bits(context->group, group_size);
+        }
+        context->group_data = context->group;
+        context->group_lsb = 0;
+    }
+    context->group_offset += group_size;
+    context->group_pos = 0;
+    return 1;
+}
+
 static size_t dsf_read_samples(char *buf, size_t len, dsd_reader_t *reader)
 {
     dsf_read_context_t *context = (dsf_read_context_t*) reader->private;
@@ -126,42 +144,41 @@ static size_t dsf_read_samples(char *buf, size_t len, dsd_reader_t *reader)
     }
 
     if (context->block_size) {
-        char *dest_buf = buf;
-        char *dest_buf_end = dest_buf + len;
-        int i = context->current_channel;
+        uint8_t *dest_buf = (uint8_t*) buf;
+        int channel_count = reader->channel_count;
 
         bytes_read = 0;
-        if (context->is_lsb) {
-            while (dest_buf < dest_buf_end) {
-                if (context->buffer_ptr[i] == context->buffer[i] + context->block_size) {
-                    if (fread(context->buffer[i], 1, context->block_size, reader->input) != context->block_size) {
-                        break;
-                    }
-                    context->buffer_ptr[i] = context->buffer[i];
-                }
-                *dest_buf++ = (char) bit_reverse_table[*context->buffer_ptr[i]++];
+        while (bytes_read < len) {
+            if (context->group_pos == context->block_size && !dsf_read_group(context, reader)) {
+                break;
+            }
 
-                if (++i == reader->channel_count) {
-                    i = 0;
+            if (context->current_channel == 0 && len - bytes_read >= (size_t) channel_count) {
+                /* Whole bytes of every channel, as many as the group and buffer allow */
+                size_t count = (len - bytes_read) / channel_count;
+                if (count > context->block_size - context->group_pos) {
+                    count = context->block_size - context->group_pos;
                 }
-            }
-        } else {
-            while (dest_buf < dest_buf_end) {
-                if (context->buffer_ptr[i] == context->buffer[i] + context->block_size) {
-                    if (fread(context->buffer[i], 1, context->block_size, reader->input) != context->block_size) {
-                        break;
-                    }
-                    context->buffer_ptr[i] = context->buffer[i];
+                dsd_interleave(dest_buf + bytes_read, context->group_data + context->group_pos, context->block_size,
+                    count, channel_count);
+                if (context->group_lsb) {
+                    dsd_reverse_bits(dest_buf + bytes_read, count * channel_count);
                 }
-                *dest_buf++ = (char) *context->buffer_ptr[i]++;
-
-                if (++i == reader->channel_count) {
-                    i = 0;
+                bytes_read += count * channel_count;
+                context->group_pos += (uint32_t) count;
+            } else {
+                /* Reading stopped part way through the channels */
+                dest_buf[bytes_read] = context->group_data[(size_t) context->current_channel * context->block_size + context->group_pos];
+                if (context->group_lsb) {
+                    dsd_reverse_bits(dest_buf + bytes_read, 1);
+                }
+                bytes_read++;
+                if (++context->current_channel == channel_count) {
+                    context->current_channel = 0;
+                    context->group_pos++;
                 }
             }
         }
-        bytes_read = dest_buf - buf;
-        context->current_channel = i;
     } else {
         bytes_read = fread(buf, 1, len, reader->input);
     }
@@ -174,11 +191,9 @@ static void dsf_read_close(dsd_reader_t *reader)
 {
     dsf_read_context_t *context = (dsf_read_context_t*) reader->private;
     if (context->block_size) {
-        int i;
-        for (i = 0; i < reader->channel_count; i++) {
-            free(context->buffer[i]);
-        }
-        context->block_size = 0;
+        free(context->group);
+        context->group = NULL;
+        context->block_size = 0; /* from now on, read the tag as it is */
     }
 }
 
@@ -188,116 +203,384 @@ static uint32_t dsf_read_next_chunk(dsd_reader_t *reader)
 
     if (context->id3_start) {
         fseeko(reader->input, context->id3_start, SEEK_SET);
-        dsf_read_close(reader); /* free the per-channel buffers */
+        dsf_read_close(reader); /* free the block group */
         context->id3_start = 0; /* prevent returning the same tag again */
+        context->data_start = 0; /* no more seeking in the sound data */
         context->bytes_remain = context->id3_size;
+        reader->chunk_length = context->id3_size;
         return MAKE_MARKER('I', 'D', '3', ' ');
     }
 
     return 0;
 }
 
+static int dsf_read_seek(uint64_t offset, dsd_reader_t *reader)
+{
+    dsf_read_context_t *context = (dsf_read_context_t*) reader->private;
+
+    if (context->data_start == 0) {
+        return 0;
+    }
+    if (offset > context->data_length) {
+        offset = context->data_length;
+    }
+    context->bytes_remain = context->data_length - offset;
+
+    if (context->block_size) {
+        /* Load the whole block group holding the offset, the following groups are then
+           read in file order */
+        uint64_t channel_offset = offset / reader->channel_count;
+        uint64_t group = channel_offset / context->block_size;
+
+        context->group_offset = context->data_start + group * context->block_size * reader->channel_count;
+        fseeko(reader->input, (off_t) context->group_offset, SEEK_SET);
+        if (context->bytes_remain && !dsf_read_group(context, reader)) {
+            context->bytes_remain = 0;
+        }
+        context->group_pos = (uint32_t) (channel_offset % context->block_size);
+        context->current_channel = (int) (offset % reader->channel_count);
+    } else {
+        fseeko(reader->input, context->data_start + (off_t) offset, SEEK_SET);
+    }
+
+    return 1;
+}
+
+/* The sound data is all in the file as it is, for converting it in parallel */
+static int dsf_read_extent(dsd_extent_t *extent, dsd_reader_t *reader)
+{
+    dsf_read_context_t *context = (dsf_read_context_t*) reader->private;
+
+    if (context->data_start == 0 || context->block_size == 0 || context->current_channel != 0) {
+        return 0;
+    }
+    extent->offset = context->data_start;
+    extent->length = context->data_length;
+    extent->position = context->data_length - context->bytes_remain;
+    extent->block_size = context->block_size;
+    extent->lsb_first = (uint8_t) context->is_lsb;
+    return 1;
+}
+
 dsd_reader_funcs_t *dsf_reader_funcs()
 {
     static dsd_reader_funcs_t funcs = {
         dsf_read_open,
         dsf_read_samples,
         dsf_read_next_chunk,
-        dsf_read_close
+        dsf_read_close,
+        dsf_read_seek,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        dsf_read_extent,
+        NULL
     };
     return &funcs;
 }
 
+/* Number of block groups gathered before writing them out together */
+#define DSF_WRITE_GROUPS 16
+
+/* Number of those writes that can be in progress at once */
+#define DSF_WRITE_QUEUE_DEPTH 8
+
+/* Size of the header, which is all there is before the sound data */
+#define DSF_HEADER_SIZE (DSD_CHUNK_HEADER_SIZE + FMT_CHUNK_SIZE + DATA_CHUNK_SIZE)
+
 typedef struct dsf_write_context_t {
-    uint8_t  buffer[6][SACD_BLOCK_SIZE_PER_CHANNEL];
-    uint8_t *buffer_ptr[6];
+    dsd_write_queue_t *queue; /* the groups are written behind through this, when possible */
+    uint64_t write_offset;    /* where the next byte goes */
+    uint8_t  header[DSF_HEADER_SIZE]; /* as written at the start of the file */
+    uint8_t *groups;          /* DSF_WRITE_GROUPS block groups, each a block of every channel */
+    uint32_t group_count;     /* complete groups waiting to be written */
+    uint32_t group_pos;       /* where the next byte goes in each block of the current group */
     int      current_channel;
     uint64_t sample_count;
     uint64_t data_length;
     off_t    id3_start;
 } dsf_write_context_t;
 
+/* Fill in the header for a file with sample_count samples per channel in data_length bytes
+   of block groups, and the ID3 tag (if any) at id3_start up to file_end */
+static void dsf_write_header(uint8_t *header, uint64_t sample_count, uint64_t data_length, uint64_t id3_start,
+    uint64_t file_end, dsd_writer_t *writer)
+{
+    dsd_chunk_header_t dsd;
+    fmt_chunk_t fmt;
+    data_chunk_t data;
+
+    dsd.chunk_id = DSD_MARKER;
+    dsd.chunk_data_size = htole64(DSD_CHUNK_HEADER_SIZE);
+    dsd.total_file_size = htole64(file_end);
+    dsd.metadata_offset = htole64(id3_start);
+    memcpy(header, &dsd, DSD_CHUNK_HEADER_SIZE);
+
+    fmt.chunk_id = FMT_MARKER;
+    fmt.chunk_data_size = htole64(FMT_CHUNK_SIZE);
+    fmt.version = htole32(DSF_VERSION);
+    fmt.format_id = htole32(FORMAT_ID_DSD);
+    fmt.channel_type = htole32((writer->channel_count > 4) ? writer->channel_count + 1 : writer->channel_count);
+    fmt.channel_count = htole32(writer->channel_count);
+    fmt.sample_frequency = htole32(writer->sample_rate);
+    fmt.bits_per_sample = htole32(SACD_BITS_PER_SAMPLE);
+    fmt.sample_count = htole64(sample_count);
+    fmt.block_size_per_channel = htole32(SACD_BLOCK_SIZE_PER_CHANNEL);
+    fmt.reserved = 0;
+    memcpy(header + DSD_CHUNK_HEADER_SIZE, &fmt, FMT_CHUNK_SIZE);
+
+    /* Like the other chunk sizes, the data chunk's includes its header */
+    data.chunk_id = DATA_MARKER;
+    data.chunk_data_size = htole64(DATA_CHUNK_SIZE + data_length);
+    memcpy(header + DSD_CHUNK_HEADER_SIZE + FMT_CHUNK_SIZE, &data, DATA_CHUNK_SIZE);
+}
+
 static void dsf_write_open(dsd_writer_t *writer)
 {
     dsf_write_context_t *context = (dsf_write_context_t*) malloc(sizeof(dsf_write_context_t));
-    int i;
-    char buffer[DSD_CHUNK_HEADER_SIZE + FMT_CHUNK_SIZE + DATA_CHUNK_SIZE];
+    uint64_t group_size = (uint64_t) SACD_BLOCK_SIZE_PER_CHANNEL * writer->channel_count;
+    uint64_t data_length = (writer->expected_length + group_size - 1) / group_size * group_size;
+    uint64_t id3_start = 0, id3_length = 0;
+    uint32_t i;
+
+    /* A tag known to be coming goes right after the sound data, as dsf_write_next_chunk takes it */
+    for (i = 0; i < writer->trailer_count; i++) {
+        if (writer->trailer[i].chunk_id == MAKE_MARKER('I', 'D', '3', ' ')) {
+            id3_start = DSF_HEADER_SIZE + data_length;
+            id3_length = writer->trailer[i].length;
+            break;
+        }
+    }
 
-    /* Write out a dummy header, we'll fill it in during close once we know all the true file positions */
-    memset(buffer, 0, DSD_CHUNK_HEADER_SIZE + FMT_CHUNK_SIZE + DATA_CHUNK_SIZE);
-    fwrite(buffer, 1, DSD_CHUNK_HEADER_SIZE + FMT_CHUNK_SIZE + DATA_CHUNK_SIZE, writer->output);
+    /* Write the header for the sound data we're expecting, close puts it right if it turns out
+       otherwise (or there's a tag we weren't told about) */
+    dsf_write_header(context->header, writer->expected_length * 8 / writer->channel_count, data_length, id3_start,
+        DSF_HEADER_SIZE + data_length + id3_length, writer);
+    fwrite(context->header, 1, DSF_HEADER_SIZE, writer->output);
 
     context->id3_start = 0;
-    for (i = 0; i < 6; i++) {
-        context->buffer_ptr[i] = context->buffer[i];
+    context->write_offset = DSF_HEADER_SIZE;
+    context->queue = dsd_write_queue_create(writer->output, DSF_WRITE_QUEUE_DEPTH,
+        (size_t) DSF_WRITE_GROUPS * SACD_BLOCK_SIZE_PER_CHANNEL * writer->channel_count);
+    if (context->queue) {
+        context->groups = dsd_write_queue_buffer(context->queue);
+    } else {
+        context->groups = malloc((size_t) DSF_WRITE_GROUPS * SACD_BLOCK_SIZE_PER_CHANNEL * writer->channel_count);
     }
+    context->group_count = 0;
+    context->group_pos = 0;
     context->sample_count = 0;
     context->data_length = 0;
     context->current_channel = 0;
     writer->private = context;
 }
 
+/* Write out the groups gathered so far with a single write */
+static void dsf_write_groups(dsf_write_context_t *context, dsd_writer_t *writer)
+{
+    size_t length = (size_t) context->group_count * SACD_BLOCK_SIZE_PER_CHANNEL * writer->channel_count;
+
+    if (length) {
+        if (context->queue) {
+            dsd_write_queue_submit(context->queue, context->groups, length, context->write_offset);
+            context->groups = dsd_write_queue_buffer(context->queue);
+        } else {
+            fwrite(context->groups, 1, length, writer->output);
+        }
+        context->write_offset += length;
+        context->data_length += length;
+        context->group_count = 0;
+        dsd_writer_drop_behind(writer, context->write_offset);
+    }
+}
+
+/* Wait for the groups written behind and go back to writing through the stream, from the
+   end of them. Call with no groups waiting. */
+static void dsf_write_settle(dsf_write_context_t *context, dsd_writer_t *writer)
+{
+    if (context->queue) {
+        if (!dsd_write_queue_finish(context->queue)) {
+            fprintf(stderr, "error writing the sound data\n");
+        }
+        dsd_write_queue_destroy(context->queue);
+        context->queue = NULL;
+        context->groups = malloc((size_t) DSF_WRITE_GROUPS * SACD_BLOCK_SIZE_PER_CHANNEL * writer->channel_count);
+        fseeko(writer->output, (off_t) context->write_offset, SEEK_SET);
+    }
+}
+
+/* The current group is full (or padded out), so move on to the next one */
+static void dsf_write_end_group(dsf_write_context_t *context, dsd_writer_t *writer)
+{
+    context->group_pos = 0;
+    if (++context->group_count == DSF_WRITE_GROUPS) {
+        dsf_write_groups(context, writer);
+    }
+}
+
 static void dsf_write_samples(const char *buf, size_t len, dsd_writer_t *writer)
 {
     dsf_write_context_t *context = (dsf_write_context_t*) writer->private;
 
     if (context->id3_start == 0) {
         const uint8_t *src_buf = (const uint8_t*) buf;
-        const uint8_t *src_buf_end = src_buf + len;
-        int i = context->current_channel;
-
-        while (src_buf < src_buf_end) {
-            *context->buffer_ptr[i]++ = bit_reverse_table[*src_buf++];
-            if (context->buffer_ptr[i] == context->buffer[i] + SACD_BLOCK_SIZE_PER_CHANNEL) {
-                fwrite(context->buffer[i], 1, SACD_BLOCK_SIZE_PER_CHANNEL, writer->output);
-                context->buffer_ptr[i] = context->buffer[i];
-
-                context->data_length += SACD_BLOCK_SIZE_PER_CHANNEL;
+        int channel_count = writer->channel_count;
+        size_t done = 0;
+        int c;
+
+        while (done < len) {
+            uint8_t *group = context->groups + (size_t) context->group_count * SACD_BLOCK_SIZE_PER_CHANNEL * channel_count;
+
+            if (context->current_channel == 0 && len - done >= (size_t) channel_count) {
+                /* Whole bytes of every channel, as many as fit in the group */
+                size_t count = (len - done) / channel_count;
+                if (count > SACD_BLOCK_SIZE_PER_CHANNEL - context->group_pos) {
+                    count = SACD_BLOCK_SIZE_PER_CHANNEL - context->group_pos;
+                }
+                dsd_deinterleave(group + context->group_pos, SACD_BLOCK_SIZE_PER_CHANNEL, src_buf + done,
+                    count, channel_count);
+                for (c = 0; c < channel_count; c++) {
+                    dsd_reverse_bits(group + (size_t) c * SACD_BLOCK_SIZE_PER_CHANNEL + context->group_pos, count);
+                }
+                done += count * channel_count;
+                context->group_pos += (uint32_t) count;
+            } else {
+                /* The data stops (or started) part way through the channels */
+                uint8_t *slot = group + (size_t) context->current_channel * SACD_BLOCK_SIZE_PER_CHANNEL + context->group_pos;
+                *slot = src_buf[done++];
+                dsd_reverse_bits(slot, 1);
+                if (++context->current_channel == channel_count) {
+                    context->current_channel = 0;
+                    context->group_pos++;
+                }
             }
-            
-            if (++i == writer->channel_count) {
-                i = 0;
+
+            if (context->group_pos == SACD_BLOCK_SIZE_PER_CHANNEL) {
+                dsf_write_end_group(context, writer);
             }
         }
-        context->current_channel = i;
         writer->data_length += len;
     } else {
         /* Just write ID3 tags raw */
         fwrite(buf, 1, len, writer->output);
+        context->write_offset += len;
     }
 }
 
+/* Sound data a channel at a time goes straight into the blocks, without interleaving it first */
+static void dsf_write_planar(const char *buf, size_t stride, size_t len, int lsb_first, dsd_writer_t *writer)
+{
+    dsf_write_context_t *context = (dsf_write_context_t*) writer->private;
+    int channel_count = writer->channel_count;
+    size_t done = 0;
+    int c;
+
+    while (done < len) {
+        uint8_t *group = context->groups + (size_t) context->group_count * SACD_BLOCK_SIZE_PER_CHANNEL * channel_count;
+        size_t count = len - done;
+
+        if (count > SACD_BLOCK_SIZE_PER_CHANNEL - context->group_pos) {
+            count = SACD_BLOCK_SIZE_PER_CHANNEL - context->group_pos;
+        }
+        for (c = 0; c < channel_count; c++) {
+            uint8_t *block = group + (size_t) c * SACD_BLOCK_SIZE_PER_CHANNEL + context->group_pos;
+            memcpy(block, buf + (size_t) c * stride + done, count);
+            if (!lsb_first) {
+                dsd_reverse_bits(block, count);
+            }
+        }
+        done += count;
+        context->group_pos += (uint32_t) count;
+
+        if (context->group_pos == SACD_BLOCK_SIZE_PER_CHANNEL) {
+            dsf_write_end_group(context, writer);
+        }
+    }
+    writer->data_length += len * channel_count;
+}
+
+/* Set aside whole block groups for len bytes of sound data, which the caller fills in itself */
+static int dsf_write_extent(uint64_t len, dsd_extent_t *extent, dsd_writer_t *writer)
+{
+    dsf_write_context_t *context = (dsf_write_context_t*) writer->private;
+    uint64_t group_size = (uint64_t) SACD_BLOCK_SIZE_PER_CHANNEL * writer->channel_count;
+    uint64_t groups = (len / writer->channel_count + SACD_BLOCK_SIZE_PER_CHANNEL - 1) / SACD_BLOCK_SIZE_PER_CHANNEL;
+
+    if (context->id3_start != 0 || context->current_channel != 0 || context->group_pos != 0) {
+        return 0;
+    }
+    extent->block_size = SACD_BLOCK_SIZE_PER_CHANNEL;
+    extent->lsb_first = 1;
+    if (len == 0) {
+        return 1;
+    }
+
+    dsf_write_groups(context, writer);
+    dsf_write_settle(context, writer);
+    if (fseeko(writer->output, (off_t) (context->write_offset + groups * group_size), SEEK_SET) != 0) {
+        return 0;
+    }
+    extent->offset = context->write_offset;
+    context->write_offset += groups * group_size;
+    context->data_length += groups * group_size;
+    writer->data_length += len;
+    return 1;
+}
+
 static void dsf_write_final_samples(dsf_write_context_t *context, dsd_writer_t *writer)
 {
     if (context->sample_count == 0) {
         context->sample_count = writer->data_length * 8 / writer->channel_count;
     }
 
-    /* We're assuming that context->current_channel == 0, which will be true as long
-       as the input wasn't truncated */
-    if (context->buffer_ptr[0] > context->buffer[0]) {
+    /* Pad the last blocks out with silence. We're assuming that context->current_channel == 0,
+       which will be true as long as the input wasn't truncated */
+    if (context->group_pos > 0) {
+        uint8_t *group = context->groups + (size_t) context->group_count * SACD_BLOCK_SIZE_PER_CHANNEL * writer->channel_count;
         int i;
-        size_t remain = context->buffer_ptr[0] - context->buffer[0];
-
-        context->sample_count += remain * 8;
 
         for (i = 0; i < writer->channel_count; i++) {
-            memset(context->buffer_ptr[i], 0, SACD_BLOCK_SIZE_PER_CHANNEL - remain);
-            fwrite(context->buffer[i], 1, SACD_BLOCK_SIZE_PER_CHANNEL, writer->output);
-            context->data_length += SACD_BLOCK_SIZE_PER_CHANNEL;
-            context->buffer_ptr[i] = context->buffer[i];
+            memset(group + (size_t) i * SACD_BLOCK_SIZE_PER_CHANNEL + context->group_pos, 0,
+                SACD_BLOCK_SIZE_PER_CHANNEL - context->group_pos);
         }
+        context->current_channel = 0;
+        dsf_write_end_group(context, writer);
     }
+    dsf_write_groups(context, writer);
 }
 
-static int dsf_write_next_chunk(uint32_t chunk, dsd_writer_t *writer)
+/* Only whole block groups can go into the file, the one being filled stays behind */
+static uint64_t dsf_write_sync(dsd_writer_t *writer)
+{
+    dsf_write_context_t *context = (dsf_write_context_t*) writer->private;
+    size_t group_size = (size_t) SACD_BLOCK_SIZE_PER_CHANNEL * writer->channel_count;
+    uint8_t *current = context->groups + (size_t) context->group_count * group_size;
+
+    if (context->id3_start != 0) {
+        return 0;
+    }
+    if (context->group_count) {
+        /* The buffer written behind is only read from until it's handed out again */
+        dsf_write_groups(context, writer);
+        if (context->group_pos || context->current_channel) {
+            memmove(context->groups, current, group_size);
+        }
+    }
+    if (context->queue && !dsd_write_queue_finish(context->queue)) {
+        return 0;
+    }
+    return context->data_length;
+}
+
+static int dsf_write_next_chunk(uint32_t chunk, uint64_t length, dsd_writer_t *writer)
 {
     dsf_write_context_t *context = (dsf_write_context_t*) writer->private;
     
     if (chunk == MAKE_MARKER('I', 'D', '3', ' ') && !context->id3_start) {
         dsf_write_final_samples(context, writer);
-        fflush(writer->output);
-        context->id3_start = ftello(writer->output);
+        dsf_write_settle(context, writer);
+        context->id3_start = (off_t) context->write_offset;
         return 1;
     }
 
@@ -306,41 +589,23 @@ static int dsf_write_next_chunk(uint32_t chunk, dsd_writer_t *writer)
 
 static void dsf_write_close(dsd_writer_t *writer)
 {
-    off_t file_end;
     dsf_write_context_t *context = (dsf_write_context_t*) writer->private;
-    dsd_chunk_header_t dsd;
-    fmt_chunk_t fmt;
-    data_chunk_t data;
+    uint8_t header[DSF_HEADER_SIZE];
 
     dsf_write_final_samples(context, writer);
-
-    fflush(writer->output);
-    file_end = ftello(writer->output);
-    fseeko(writer->output, 0, SEEK_SET);
-
-    /* Now write the actual header */
-    dsd.chunk_id = DSD_MARKER;
-    dsd.chunk_data_size = htole64(DSD_CHUNK_HEADER_SIZE);
-    dsd.total_file_size = htole64(file_end);
-    dsd.metadata_offset = htole64(context->id3_start);
-    fwrite(&dsd, DSD_CHUNK_HEADER_SIZE, 1, writer->output);
-
-    fmt.chunk_id = FMT_MARKER;
-    fmt.chunk_data_size = htole64(FMT_CHUNK_SIZE);
-    fmt.version = htole32(DSF_VERSION);
-    fmt.format_id = htole32(FORMAT_ID_DSD);
-    fmt.channel_type = htole32((writer->channel_count > 4) ? writer->channel_count + 1 : writer->channel_count);
-    fmt.channel_count = htole32(writer->channel_count);
-    fmt.sample_frequency = htole32(writer->sample_rate);
-    fmt.bits_per_sample = htole32(SACD_BITS_PER_SAMPLE);
-    fmt.sample_count = htole64(context->sample_count);
-    fmt.block_size_per_channel = htole32(SACD_BLOCK_SIZE_PER_CHANNEL);
-    fmt.reserved = 0;
-    fwrite(&fmt, FMT_CHUNK_SIZE, 1, writer->output);
-
-    data.chunk_id = DATA_MARKER;
-    data.chunk_data_size = htole64(context->data_length);
-    fwrite(&data, DATA_CHUNK_SIZE, 1, writer->output);
+    dsf_write_settle(context, writer);
+    free(context->groups);
+    context->groups = NULL;
+
+    /* Put the header right, with a positional write, if it's not what was written at the start */
+    dsf_write_header(header, context->sample_count, context->data_length, (uint64_t) context->id3_start,
+        context->write_offset, writer);
+    if (memcmp(header, context->header, DSF_HEADER_SIZE) != 0) {
+        fflush(writer->output);
+        if (dsd_pwrite(writer->output, header, DSF_HEADER_SIZE, 0) != DSF_HEADER_SIZE) {
+            fprintf(stderr, "could not finish the header of the output\n");
+        }
+    }
 }
 
 dsd_writer_funcs_t *dsf_writer_funcs()
@@ -349,7 +614,50 @@ dsd_writer_funcs_t *dsf_writer_funcs()
         dsf_write_open,
         dsf_write_samples,
         dsf_write_next_chunk,
-        dsf_write_close
+        dsf_write_close,
+        NULL,
+        NULL,
+        dsf_write_planar,
+        dsf_write_extent,
+        dsf_write_sync
     };
     return &funcs;
 }
+
+/* The ID3 tag is the last thing in a DSF file, so it can be replaced by writing the new one over
+   it and cutting the file off after that, without touching the sound data */
+int dsf_retag(FILE *fp, const uint8_t *tag, size_t tag_len)
+{
+    dsd_chunk_header_t dsd;
+    uint64_t tag_start, file_size;
+    int64_t mtime;
+
+    if (fread(&dsd, DSD_CHUNK_HEADER_SIZE, 1, fp) != 1 || dsd.chunk_id != DSD_MARKER) {
+        return 0;
+    }
+
+    /* Without a tag the file ends with the sound data */
+    tag_start = htole64(dsd.metadata_offset);
+    if (tag_start == 0) {
+        tag_start = htole64(dsd.total_file_size);
+    }
+    if (!dsd_file_identity(fp, &file_size, &mtime)) {
+        return -1;
+    }
+    if (tag_start < DSD_CHUNK_HEADER_SIZE + FMT_CHUNK_SIZE + DATA_CHUNK_SIZE || tag_start > file_size) {
+        return 0;
+    }
+
+    fseeko(fp, (off_t) tag_start, SEEK_SET);
+    if ((tag_len && fwrite(tag, 1, tag_len, fp) != tag_len) || !dsd_truncate(fp, tag_start + tag_len)) {
+        return -1;
+    }
+
+    dsd.total_file_size = htole64(tag_start + tag_len);
+    dsd.metadata_offset = htole64(tag_len ? tag_start : 0);
+    fseeko(fp, 0, SEEK_SET);
+    if (fwrite(&dsd, DSD_CHUNK_HEADER_SIZE, 1, fp) != 1) {
+        return -1;
+    }
+    return 1;
+}
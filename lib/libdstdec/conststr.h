@@ -164,6 +164,8 @@ enum DST_ErrorCodes
     DSTErr_InvalidStuffingPattern,
     DSTErr_InvalidArithmeticCode,
     DSTErr_ArithmeticDecoder,
+    DSTErr_FrameFetch,
+    DSTErr_FrameCRC,
     DSTErr_MaxError,
 };
 
@@ -77,9 +77,16 @@
    this is the last chunk, which after writing tells write_thread to return */
 typedef struct job_t
 {
+    struct dst_decoder_s *dst_decoder;        /* decoder the job was queued on */
     long seq;                                 /* sequence number */
+    long frame_number;                        /* number the caller gave the frame, for errors */
     int error;                                /* an error code (eg. DST decoding error) */
     int more;                                 /* true if this is not the last chunk */
+    long frame_index;                         /* frame to fetch when in is NULL */
+    const uint8_t *data;                      /* or the caller's own copy of the input */
+    size_t data_len;
+    int has_crc;                              /* check the decoded data against crc */
+    uint32_t crc;
     buffer_pool_space_t *in;                  /* input DST data to decode */
     buffer_pool_space_t *out;                 /* resulting DSD decoded data */
     struct job_t *next;                       /* next job in the list (either list) */
@@ -88,7 +95,7 @@ job_t;
 
 struct dst_decoder_s
 {
-    int procs;            /* maximum number of compression threads (>= 1) */
+    int procs;            /* number of processors, for sizing the input pool */
     int channel_count;
 	int oversampling_rate;
 
@@ -98,23 +105,29 @@ struct dst_decoder_s
     buffer_pool_t in_pool;
     buffer_pool_t out_pool;
 
-    /* list of decode jobs (with tail for appending to list) */
-    lock *decode_have;   /* number of decode jobs waiting */
-    job_t *decode_head, **decode_tail;
-
     /* list of write jobs */
     lock *write_first;    /* lowest sequence number in list */
     job_t *write_head;
 
-    /* number of decoding threads running */
-    int cthreads;
-
     /* write thread if running */
     thread *writeth;
 
     frame_decoded_callback_t frame_decoded_callback;
     frame_error_callback_t frame_error_callback;
+    frame_fetch_callback_t frame_fetch_callback;
+    frame_placed_callback_t frame_placed_callback;
     void *userdata;
+
+    /* layout of the decoded frames */
+    int planar;
+    int lsb_first;
+
+    /* CRC of the next frame queued, see dst_decoder_expect_crc */
+    int next_has_crc;
+    uint32_t next_crc;
+
+    /* number of the next frame queued, see dst_decoder_set_frame_number */
+    long next_frame_number;
 };
 
 static unsigned processor_count(void)
@@ -130,17 +143,154 @@ static unsigned processor_count(void)
 #endif
 }
 
+/* The decode threads are shared by all the decoders in the process, taking jobs from a single
+   list, so that decoding several streams at once doesn't start more of them than there are
+   processors. They are started as jobs come in, and stopped once the last decoder is destroyed. */
+static struct
+{
+    pthread_mutex_t mutex;    /* held while counting users and starting or stopping threads */
+    int users;                /* decoders in existence */
+    int procs;                /* maximum number of decode threads (>= 1) */
+    int cthreads;             /* number of decode threads running */
+    thread **threads;
+
+    /* list of decode jobs (with tail for appending to list) */
+    lock *decode_have;        /* number of decode jobs waiting */
+    job_t *decode_head, **decode_tail;
+}
+workers = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, NULL, NULL, NULL, NULL };
+
+static void decode_thread(void *userdata);
+
+/* CRC-32 of a decoded frame as stored in DSTC chunks (polynomial 0x04C11DB7, MSB first, no
+   initial or final inversion) */
+static uint32_t crc_table[256];
+static uint8_t crc_reverse[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table(void)
+{
+    uint32_t i, k, crc;
+
+    for (i = 0; i < 256; i++)
+    {
+        crc = i << 24;
+        for (k = 0; k < 8; k++)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        crc_table[i] = crc;
+
+        crc_reverse[i] = 0;
+        for (k = 0; k < 8; k++)
+            crc_reverse[i] |= ((i >> k) & 1) << (7 - k);
+    }
+}
+
+/* The CRC is of the frame's bytes interleaved with their bits MSB first, so frames decoded into
+   another layout are taken in that order and turned around on the way */
+static uint32_t frame_crc(const uint8_t *data, size_t channel_bytes, int channel_count, int planar, int lsb_first)
+{
+    uint32_t crc = 0;
+    size_t len = channel_bytes * channel_count;
+    size_t i;
+    int ch;
+
+    pthread_once(&crc_table_once, make_crc_table);
+    if (!planar && !lsb_first)
+    {
+        while (len--)
+            crc = (crc << 8) ^ crc_table[(crc >> 24) ^ *data++];
+        return crc;
+    }
+    for (i = 0; i < channel_bytes; i++)
+    {
+        for (ch = 0; ch < channel_count; ch++)
+        {
+            uint8_t byte = planar ? data[ch * channel_bytes + i] : data[i * channel_count + ch];
+
+            if (lsb_first)
+                byte = crc_reverse[byte];
+            crc = (crc << 8) ^ crc_table[(crc >> 24) ^ byte];
+        }
+    }
+    return crc;
+}
+
+/* set up the shared job list for a new decoder */
+static void acquire_workers(void)
+{
+    pthread_mutex_lock(&workers.mutex);
+    if (workers.users++ == 0)
+    {
+        workers.procs = processor_count();
+        workers.cthreads = 0;
+        workers.threads = (thread **) malloc(workers.procs * sizeof(thread *));
+        workers.decode_have = new_lock(0);
+        workers.decode_head = NULL;
+        workers.decode_tail = &workers.decode_head;
+    }
+    pthread_mutex_unlock(&workers.mutex);
+}
+
+/* command the decode threads to all return once the last decoder is gone, then join them all
+   and free the list */
+static void release_workers(void)
+{
+    job_t job;
+    int i;
+
+    pthread_mutex_lock(&workers.mutex);
+    if (--workers.users == 0)
+    {
+        possess(workers.decode_have);
+        job.error = 0;
+        job.seq = -1;
+        job.next = NULL;
+        workers.decode_head = &job;
+        workers.decode_tail = &(job.next);
+        twist(workers.decode_have, BY, +1);       /* will wake them all up */
+
+        /* join each of them, other threads may still be running for the caller */
+        for (i = 0; i < workers.cthreads; i++)
+            join(workers.threads[i]);
+        LOG(lm_main, LOG_NOTICE, ("-- joined %d decode threads", workers.cthreads));
+        workers.cthreads = 0;
+        free(workers.threads);
+        workers.threads = NULL;
+        free_lock(workers.decode_have);
+        workers.decode_have = NULL;
+    }
+    pthread_mutex_unlock(&workers.mutex);
+}
+
+/* put a job at the end of the shared decode list, starting another decode thread if needed,
+   and let all the decoders know */
+static void put_decoding_job(dst_decoder_t *dst_decoder, job_t *job)
+{
+    job->dst_decoder = dst_decoder;
+
+    pthread_mutex_lock(&workers.mutex);
+    if (workers.cthreads < workers.procs)
+    {
+        workers.threads[workers.cthreads] = launch(decode_thread, NULL);
+        workers.cthreads++;
+    }
+    pthread_mutex_unlock(&workers.mutex);
+
+    possess(workers.decode_have);
+    job->next = NULL;
+    *workers.decode_tail = job;
+    workers.decode_tail = &(job->next);
+    twist(workers.decode_have, BY, +1);
+}
+
 /* setup job lists (call from main thread) */
 static void setup_decoding_jobs(dst_decoder_t *dst_decoder)
 {
     /* set up only if not already set up*/
-    if (dst_decoder->decode_have != NULL)
+    if (dst_decoder->write_first != NULL)
         return;
 
     /* allocate locks and initialize lists */
-    dst_decoder->decode_have = new_lock(0);
-    dst_decoder->decode_head = NULL;
-    dst_decoder->decode_tail = &dst_decoder->decode_head;
     dst_decoder->write_first = new_lock(-1);
     dst_decoder->write_head = NULL;
 
@@ -149,88 +299,114 @@ static void setup_decoding_jobs(dst_decoder_t *dst_decoder)
     buffer_pool_create(&dst_decoder->out_pool, dst_decoder->oversampling_rate * 1024, -1);
 }
 
-/* command the decode threads to all return, then join them all (call from
-   main thread), free all the thread-related resources */
+/* free the decoder's own job resources (call from main thread, once its write thread is done) */
 static void finish_decoding_jobs(dst_decoder_t *dst_decoder)
 {
-    job_t job;
-    int caught;
-
     /* only do this once */
-    if (dst_decoder->decode_have == NULL)
+    if (dst_decoder->write_first == NULL)
         return;
 
-    /* command all of the extant decode threads to return */
-    possess(dst_decoder->decode_have);
-    job.error = 0;
-    job.seq = -1;
-    job.next = NULL;
-    dst_decoder->decode_head = &job;
-    dst_decoder->decode_tail = &(job.next);
-    twist(dst_decoder->decode_have, BY, +1);       /* will wake them all up */
-
-    /* join all of the decode threads, verify they all came back */
-    caught = join_all();
-    LOG(lm_main, LOG_NOTICE, ("-- joined %d decode threads", caught));
-    assert(caught == dst_decoder->cthreads);
-    dst_decoder->cthreads = 0;
-
     /* free the resources */
-    caught = buffer_pool_free(&dst_decoder->out_pool);
-    LOG(lm_main, LOG_NOTICE, ("-- freed %d output buffers", caught));
-    caught = buffer_pool_free(&dst_decoder->in_pool);
-    LOG(lm_main, LOG_NOTICE, ("-- freed %d input buffers", caught));
+    buffer_pool_free(&dst_decoder->out_pool);
+    buffer_pool_free(&dst_decoder->in_pool);
     free_lock(dst_decoder->write_first);
-    free_lock(dst_decoder->decode_have);
-    dst_decoder->decode_have = NULL;
+    dst_decoder->write_first = NULL;
 }
 
-/* get the next decoding job from the head of the list, decode and compute
-   the check value on the input, and put a job in the write list with the
-   results -- keep looking for more jobs, returning when a job is found with a
-   sequence number of -1 (leave that job in the list for other incarnations to
-   find) */
+/* get the next decoding job from the head of the shared list, decode it
+   for the decoder it came from, and put a job in that decoder's write list
+   with the results -- keep looking for more jobs, returning when a job is
+   found with a sequence number of -1 (leave that job in the list for other
+   incarnations to find) */
 static void decode_thread(void *userdata)
 {
     job_t *job;                /* job pulled and working on */ 
     job_t *here, **prior;      /* pointers for inserting in write list */ 
     ebunch      D;
-    dst_decoder_t *dst_decoder = (dst_decoder_t *) userdata;
+    dst_decoder_t *dst_decoder;
+    int channel_count = 0;     /* what D is set up for, nothing yet */
+    int oversampling_rate = 0;
 
-    if (DST_InitDecoder(&D, dst_decoder->channel_count, dst_decoder->oversampling_rate) != 0)
-    {
-        pthread_exit(0);
-    }
+    (void) userdata;
 
     /* keep looking for work */
     for(;;)
     {
         /* get a job */
-        possess(dst_decoder->decode_have);
-        wait_for(dst_decoder->decode_have, NOT_TO_BE, 0);
-        job = dst_decoder->decode_head;
+        possess(workers.decode_have);
+        wait_for(workers.decode_have, NOT_TO_BE, 0);
+        job = workers.decode_head;
         assert(job != NULL);
         if (job->seq == -1)
             break;
-        dst_decoder->decode_head = job->next;
+        workers.decode_head = job->next;
         if (job->next == NULL)
-            dst_decoder->decode_tail = &dst_decoder->decode_head;
-        twist(dst_decoder->decode_have, BY, -1);
+            workers.decode_tail = &workers.decode_head;
+        twist(workers.decode_have, BY, -1);
 
         /* got a job */
         LOG(lm_main, LOG_NOTICE, ("-- decoding #%ld", job->seq));
+        dst_decoder = job->dst_decoder;
 
         if (job->more)
         {
+            /* set the DST decoder up again when the stream is of another kind than the last one */
+            if (dst_decoder->channel_count != channel_count || dst_decoder->oversampling_rate != oversampling_rate)
+            {
+                if (channel_count != 0)
+                    DST_CloseDecoder(&D);
+                channel_count = dst_decoder->channel_count;
+                oversampling_rate = dst_decoder->oversampling_rate;
+                if (DST_InitDecoder(&D, channel_count, oversampling_rate) != 0)
+                {
+                    pthread_exit(0);
+                }
+            }
+
             job->out = buffer_pool_get_space(&dst_decoder->out_pool);
 
+            /* fetch the input ourselves if the job only names a frame */
+            if (job->in == NULL && job->data == NULL)
+            {
+                job->in = buffer_pool_get_space(&dst_decoder->in_pool);
+                job->in->len = dst_decoder->frame_fetch_callback(job->in->buf, dst_decoder->in_pool.size, job->frame_index, dst_decoder->userdata);
+            }
+            if (job->in != NULL)
+            {
+                job->data = job->in->buf;
+                job->data_len = job->in->len;
+            }
+
             /* Save the error for later, so that the write_thread can output them in DST frame order */
-            job->error = DST_FramDSTDecode(job->in->buf, job->out->buf, job->in->len, job->seq, &D); 
+            if (job->data_len == 0)
+            {
+                memset(job->out->buf, 0, MAX_DSDBITS_INFRAME / 8 * dst_decoder->channel_count);
+                job->error = DSTErr_FrameFetch;
+            }
+            else
+            {
+                D.PlanarOutput = dst_decoder->planar;
+                D.LsbFirstOutput = dst_decoder->lsb_first;
+                job->error = DST_FramDSTDecode((uint8_t *)job->data, job->out->buf, (int)job->data_len, job->seq, &D); 
+            }
+            if (job->error == DSTErr_NoError && job->has_crc
+                && frame_crc(job->out->buf, MAX_DSDBITS_INFRAME / 8, dst_decoder->channel_count,
+                    dst_decoder->planar, dst_decoder->lsb_first) != job->crc)
+                job->error = DSTErr_FrameCRC;
             if (job->error != DSTErr_NoError)
                 LOG(lm_main, LOG_ERROR, ("ERROR: %s on frame: %d", DST_GetErrorMessage(job->error), D.FrameHdr.FrameNr));
 
             job->out->len = (size_t)(MAX_DSDBITS_INFRAME / 8 * dst_decoder->channel_count);
-            buffer_pool_drop_space(job->in);
+            if (job->in != NULL)
+                buffer_pool_drop_space(job->in);
+
+            /* hand the frame over right away if the order doesn't matter */
+            if (dst_decoder->frame_placed_callback)
+            {
+                dst_decoder->frame_placed_callback(job->out->buf, job->out->len, job->seq, job->error, dst_decoder->userdata);
+                buffer_pool_drop_space(job->out);
+                job->out = NULL;
+            }
 
             LOG(lm_main, LOG_NOTICE, ("-- decoded #%ld%s", job->seq, job->more ? "" : " (last)"));
         }
@@ -252,9 +428,9 @@ static void decode_thread(void *userdata)
     } 
 
     /* found job with seq == -1 -- free deflate memory and return to join */
-    release(dst_decoder->decode_have);
+    release(workers.decode_have);
 
-    if (DST_CloseDecoder(&D) != 0)
+    if (channel_count != 0 && DST_CloseDecoder(&D) != 0)
     {
         pthread_exit(0);
     }
@@ -286,11 +462,11 @@ static void write_thread(void *userdata)
 
         /* report any error */
         if (job->error != 0 && dst_decoder->frame_error_callback)
-            dst_decoder->frame_error_callback(job->seq, job->error, DST_GetErrorMessage(job->error), dst_decoder->userdata);
+            dst_decoder->frame_error_callback((int) job->frame_number, job->error, DST_GetErrorMessage(job->error), dst_decoder->userdata);
 
         more = job->more;
 
-        if (more)
+        if (more && job->out)
         {
             /* write the decoded data and drop the output buffer */
             dst_decoder->frame_decoded_callback(job->out->buf, job->out->len, dst_decoder->userdata);
@@ -304,10 +480,8 @@ static void write_thread(void *userdata)
     } 
     while (more);
 
-    /* verify no more jobs, prepare for next use */
-    possess(dst_decoder->decode_have);
-    assert(dst_decoder->decode_head == NULL && peek_lock(dst_decoder->decode_have) == 0);
-    release(dst_decoder->decode_have);
+    /* verify no more jobs, prepare for next use (the decode list is shared, so
+       other decoders' jobs may still be in it) */
     possess(dst_decoder->write_first);
     assert(dst_decoder->write_head == NULL);
     twist(dst_decoder->write_first, TO, -1);
@@ -323,25 +497,17 @@ static void finish_write_job(dst_decoder_t *dst_decoder)
         exit(1);
     job->error = 0;
     job->seq = dst_decoder->sequence;
+    job->frame_number = dst_decoder->next_frame_number;
+    job->frame_index = -1;
+    job->data = 0;
     job->in = 0;
     job->out = 0;
     job->more = 0;
 
     ++dst_decoder->sequence;
 
-    /* start another decode thread if needed */
-    if (dst_decoder->cthreads < dst_decoder->procs) 
-    {
-        (void)launch(decode_thread, dst_decoder);
-        dst_decoder->cthreads++;
-    }
-
     /* put job at end of decode list, let all the decoders know */
-    possess(dst_decoder->decode_have);
-    job->next = NULL;
-    *dst_decoder->decode_tail = job;
-    dst_decoder->decode_tail = &(job->next);
-    twist(dst_decoder->decode_have, BY, +1);
+    put_decoding_job(dst_decoder, job);
 
     join(dst_decoder->writeth);
     dst_decoder->writeth = NULL;
@@ -362,6 +528,7 @@ dst_decoder_t* dst_decoder_create(int channel_count, int oversampling_rate, fram
     dst_decoder->frame_decoded_callback = frame_decoded_callback;
     dst_decoder->frame_error_callback = frame_error_callback;
     dst_decoder->procs = processor_count();
+    acquire_workers();
 
     /* if first time or after an option change, setup the job lists */
     setup_decoding_jobs(dst_decoder);
@@ -376,10 +543,28 @@ void dst_decoder_destroy(dst_decoder_t *dst_decoder)
 {
     finish_write_job(dst_decoder);
     finish_decoding_jobs(dst_decoder);
+    release_workers();
 
     free(dst_decoder);
 }
 
+static void queue_decoding_job(dst_decoder_t *dst_decoder, job_t *job)
+{
+    job->error = 0;
+    job->seq = dst_decoder->sequence;
+    job->frame_number = dst_decoder->next_frame_number++;
+    job->out = NULL;
+    job->more = 1;
+    job->has_crc = dst_decoder->next_has_crc;
+    job->crc = dst_decoder->next_crc;
+    dst_decoder->next_has_crc = 0;
+
+    ++dst_decoder->sequence;
+
+    /* put job at end of decode list, let all the decoders know */
+    put_decoding_job(dst_decoder, job);
+}
+
 void dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t* frame_data, size_t frame_size)
 {
     job_t *job;                /* job for decode, then write */
@@ -388,27 +573,71 @@ void dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t* frame_data, size_t
     job = malloc(sizeof(job_t));
     if (job == NULL)
         exit(1);
-    job->error = 0;
-    job->seq = dst_decoder->sequence;
+    job->frame_index = -1;
+    job->data = NULL;
     job->in = buffer_pool_get_space(&dst_decoder->in_pool);
     memcpy(job->in->buf, frame_data, frame_size);
     job->in->len = frame_size;
-    job->out = NULL;
-    job->more = 1;
 
-    ++dst_decoder->sequence;
+    queue_decoding_job(dst_decoder, job);
+}
 
-    /* start another decode thread if needed */
-    if (dst_decoder->cthreads < dst_decoder->procs) 
-    {
-        (void)launch(decode_thread, dst_decoder);
-        dst_decoder->cthreads++;
-    }
+void dst_decoder_decode_mapped(dst_decoder_t *dst_decoder, const uint8_t* frame_data, size_t frame_size)
+{
+    job_t *job;                /* job for decode, then write */
 
-    /* put job at end of decode list, let all the decoders know */
-    possess(dst_decoder->decode_have);
-    job->next = NULL;
-    *dst_decoder->decode_tail = job;
-    dst_decoder->decode_tail = &(job->next);
-    twist(dst_decoder->decode_have, BY, +1);
+    /* create a new job, decoding straight from the caller's memory */
+    job = malloc(sizeof(job_t));
+    if (job == NULL)
+        exit(1);
+    job->frame_index = -1;
+    job->data = frame_data;
+    job->data_len = frame_size;
+    job->in = NULL;
+
+    queue_decoding_job(dst_decoder, job);
+}
+
+void dst_decoder_set_fetch_callback(dst_decoder_t *dst_decoder, frame_fetch_callback_t frame_fetch_callback)
+{
+    dst_decoder->frame_fetch_callback = frame_fetch_callback;
+}
+
+void dst_decoder_set_output_layout(dst_decoder_t *dst_decoder, int planar, int lsb_first)
+{
+    dst_decoder->planar = planar;
+    dst_decoder->lsb_first = lsb_first;
+}
+
+void dst_decoder_set_placed_callback(dst_decoder_t *dst_decoder, frame_placed_callback_t frame_placed_callback)
+{
+    dst_decoder->frame_placed_callback = frame_placed_callback;
+}
+
+void dst_decoder_expect_crc(dst_decoder_t *dst_decoder, uint32_t crc)
+{
+    dst_decoder->next_has_crc = 1;
+    dst_decoder->next_crc = crc;
+}
+
+void dst_decoder_set_frame_number(dst_decoder_t *dst_decoder, long frame_number)
+{
+    dst_decoder->next_frame_number = frame_number;
+}
+
+void dst_decoder_decode_indexed(dst_decoder_t *dst_decoder, long frame_index)
+{
+    job_t *job;                /* job for decode, then write */
+
+    assert(dst_decoder->frame_fetch_callback);
+
+    /* create a new job, the decode thread will fetch the input itself */
+    job = malloc(sizeof(job_t));
+    if (job == NULL)
+        exit(1);
+    job->frame_index = frame_index;
+    job->data = NULL;
+    job->in = NULL;
+
+    queue_decoding_job(dst_decoder, job);
 }
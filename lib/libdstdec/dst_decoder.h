@@ -27,10 +27,46 @@
 typedef struct dst_decoder_s dst_decoder_t;
 typedef void (*frame_decoded_callback_t)(uint8_t* frame_data, size_t frame_size, void *userdata);
 typedef void (*frame_error_callback_t)(int frame_count, int frame_error_code, const char *frame_error_message, void *userdata);
+typedef size_t (*frame_fetch_callback_t)(uint8_t* frame_data, size_t frame_capacity, long frame_index, void *userdata);
+typedef void (*frame_placed_callback_t)(uint8_t* frame_data, size_t frame_size, long frame_number, int frame_error_code, void *userdata);
 
 dst_decoder_t* dst_decoder_create(int channel_count, int oversampling_rate, frame_decoded_callback_t frame_decoded_callback, frame_error_callback_t frame_error_callback, void *userdata);
 void dst_decoder_destroy(dst_decoder_t *dst_decoder);
 void dst_decoder_decode(dst_decoder_t *dst_decoder, uint8_t* frame_data, size_t frame_size);
 
+/* Like dst_decoder_decode, but the frame is decoded where it is (e.g. in a memory mapped file)
+   instead of being copied first, so it has to stay there until the decoder is done with it */
+void dst_decoder_decode_mapped(dst_decoder_t *dst_decoder, const uint8_t* frame_data, size_t frame_size);
+
+/* Frames queued with dst_decoder_decode_indexed() are not copied in by the caller, instead the
+   decoding thread that picks up the job reads it itself through the fetch callback, which
+   returns the frame size or 0 on failure */
+void dst_decoder_set_fetch_callback(dst_decoder_t *dst_decoder, frame_fetch_callback_t frame_fetch_callback);
+void dst_decoder_decode_indexed(dst_decoder_t *dst_decoder, long frame_index);
+
+/* Decoded frames normally hold the channels' bytes interleaved with their bits MSB first. Planar
+   output keeps each channel's bytes together instead (channel n starting at n times the frame size
+   divided by the channel count), and lsb_first reverses the bits of every byte, as DSF stores
+   them. Only change this while no frames are queued. */
+void dst_decoder_set_output_layout(dst_decoder_t *dst_decoder, int planar, int lsb_first);
+
+/* With a placed callback, the decoding thread hands each frame over itself as soon as it is
+   decoded, in no particular order, numbering the frames in the order they were queued on this
+   decoder (from 0 when it was created), with the frame's error code (0 when it decoded fine).
+   The decoded callback isn't called for them, errors are still reported in order as well. Pass NULL to go back. Only change this while no frames are queued. */
+void dst_decoder_set_placed_callback(dst_decoder_t *dst_decoder, frame_placed_callback_t frame_placed_callback);
+
+/* Check the frame queued next, once decoded, against the CRC of its DSD data (as in a DSDIFF DSTC
+   chunk: CRC-32 with polynomial 0x04C11DB7, MSB first, over the interleaved MSB-first bytes of
+   the frame, whatever the output layout). The check is done on the decoding thread, a mismatch is
+   reported through the error callback as DSTErr_FrameCRC. */
+void dst_decoder_expect_crc(dst_decoder_t *dst_decoder, uint32_t crc);
+
+/* Errors are reported with the number of their frame, counting the frames in the order they are
+   queued from 0 when the decoder is created. This numbers the frame queued next frame_number
+   instead (and those after it on from there), e.g. after seeking. The number goes with the frame
+   when it is queued, so this can be called while other frames are still being decoded. */
+void dst_decoder_set_frame_number(dst_decoder_t *dst_decoder, long frame_number);
+
 
 #endif /* DST_DECODER_H */
@@ -329,6 +329,45 @@ static void LT_InitStatus(ebunch *D, uint8_t Status[MAX_CHANNELS][16])
         Predict = (Predict32 >> 16) + (Predict32 & 0xffff); \
     }
 
+/* Rearrange a frame of interleaved MSB-first DSD (as stored in frames without DST coding) into
+   the output layout asked for */
+static void ReorderDSDframe(uint8_t *DSDdata, int NrOfBytesPerCh, int NrOfChannels, int Planar, int LsbFirst)
+{
+    const int FrameBytes = NrOfBytesPerCh * NrOfChannels;
+    uint8_t   Reverse[256];
+    int       ByteNr;
+    int       ChNr;
+    int       i;
+
+    for (i = 0; i < 256; i++)
+    {
+        Reverse[i] = (uint8_t)(LsbFirst ? ((i & 0x01) << 7) | ((i & 0x02) << 5) | ((i & 0x04) << 3) | ((i & 0x08) << 1) |
+                                          ((i & 0x10) >> 1) | ((i & 0x20) >> 3) | ((i & 0x40) >> 5) | ((i & 0x80) >> 7)
+                                        : i);
+    }
+
+    if (Planar)
+    {
+        uint8_t *Muxed = (uint8_t *)malloc(FrameBytes);
+
+        memcpy(Muxed, DSDdata, FrameBytes);
+        for (ChNr = 0; ChNr < NrOfChannels; ChNr++)
+        {
+            const uint8_t *In = Muxed + ChNr;
+            uint8_t       *Out = DSDdata + ChNr * NrOfBytesPerCh;
+
+            for (ByteNr = 0; ByteNr < NrOfBytesPerCh; ByteNr++)
+                Out[ByteNr] = Reverse[In[ByteNr * NrOfChannels]];
+        }
+        free(Muxed);
+    }
+    else
+    {
+        for (i = 0; i < FrameBytes; i++)
+            DSDdata[i] = Reverse[DSDdata[i]];
+    }
+}
+
 int DST_FramDSTDecode(uint8_t *DSTdata, uint8_t *MuxedDSDdata, int FrameSizeInBytes, int FrameCnt, ebunch *D)
 {
     int       error;
@@ -338,6 +377,9 @@ int DST_FramDSTDecode(uint8_t *DSTdata, uint8_t *MuxedDSDdata, int FrameSizeInBy
     const int NrOfBitsPerCh = D->FrameHdr.NrOfBitsPerCh;
     const int NrOfChannels = D->FrameHdr.NrOfChannels;
     uint8_t   *MuxedDSD = MuxedDSDdata;
+    /* Distance between the bytes of one channel, and between the channels */
+    const int ByteStride = D->PlanarOutput ? 1 : NrOfChannels;
+    const int ChStride = D->PlanarOutput ? NrOfBitsPerCh / 8 : 1;
 
     D->FrameHdr.FrameNr       = FrameCnt;
     D->FrameHdr.CalcNrOfBytes = FrameSizeInBytes;
@@ -370,7 +412,8 @@ int DST_FramDSTDecode(uint8_t *DSTdata, uint8_t *MuxedDSDdata, int FrameSizeInBy
         memset(MuxedDSD, 0, NrOfBitsPerCh * NrOfChannels / 8); 
         for (BitNr = 0; BitNr < NrOfBitsPerCh; BitNr++)
         {
-            int ByteNr = BitNr / 8;
+            uint8_t *const Out = MuxedDSD + (BitNr / 8) * ByteStride;
+            const int BitShift = D->LsbFirstOutput ? BitNr % 8 : 7 - BitNr % 8;
 
             for (ChNr = 0; ChNr < NrOfChannels; ChNr++)
             {
@@ -402,7 +445,7 @@ int DST_FramDSTDecode(uint8_t *DSTdata, uint8_t *MuxedDSDdata, int FrameSizeInBy
                 BitVal = ((((uint16_t)Predict) >> 15) ^ Residual) & 1;
 
                 /* Shift the result into the correct bit position */ \
-                MuxedDSD[ByteNr * NrOfChannels + ChNr] |= (uint8_t)(BitVal << (7 - BitNr % 8));
+                Out[ChNr * ChStride] |= (uint8_t)(BitVal << BitShift);
 
                 /* Update filter */
                 {
@@ -422,10 +465,15 @@ int DST_FramDSTDecode(uint8_t *DSTdata, uint8_t *MuxedDSDdata, int FrameSizeInBy
             error = DSTErr_ArithmeticDecoder;
     }
 
+    else if (error == DSTErr_NoError && (D->PlanarOutput || D->LsbFirstOutput))
+    {
+        ReorderDSDframe(MuxedDSDdata, NrOfBitsPerCh / 8, NrOfChannels, D->PlanarOutput, D->LsbFirstOutput);
+    }
+
     if (error != DSTErr_NoError)
     {
         /* Clear the frame output - set to DSD silence */
-        memset(MuxedDSDdata, 0x55, (NrOfBitsPerCh * NrOfChannels) / 8);
+        memset(MuxedDSDdata, D->LsbFirstOutput ? 0xaa : 0x55, (NrOfBitsPerCh * NrOfChannels) / 8);
     }
 
     return error;
@@ -449,6 +497,8 @@ static const char *DST_ErrorMessages[] =
     "Illegal stuffing pattern",
     "Illegal arithmetic code",
     "Arithmetic decoding error",
+    "Could not fetch frame data",
+    "Decoded frame doesn't match its CRC",
 };
 
 const char *DST_GetErrorMessage(int error)
@@ -311,6 +311,9 @@ int DST_InitDecoder(ebunch * D, int NrOfChannels, int SampleRate)
     retval = CCP_CalcInit(&D->StrPtable);
   }
 
+  D->PlanarOutput = 0;
+  D->LsbFirstOutput = 0;
+
   D->SSE2 = 0;
 #if !defined(NO_SSE2) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
   {
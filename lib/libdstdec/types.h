@@ -169,6 +169,8 @@ typedef struct
     StrData      S;                                              /* DST data stream */
 
     int          SSE2;
+    int          PlanarOutput;                                   /* Each channel's bytes together, not interleaved */
+    int          LsbFirstOutput;                                 /* Output bits LSB first (as in DSF)            */
 } ebunch;
 
 #endif  /* __TYPES_H_INCLUDED */
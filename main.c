@@ -22,26 +22,99 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "getopt.h"
-#ifdef PTW32_STATIC_LIB
-#include <pthread.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <strings.h>
+#include <dirent.h>
+#define strnicmp strncasecmp
+#else
+#include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
 #endif
+#include <pthread.h>
 
 #include "dsdio.h"
+#include "manifest.h"
 
 #define BUFFER_SIZE 262144 /* Size of read buffer */
+#define COPY_SIZE   67108864 /* Most to copy at once when the data can be copied as it is */
+#define FANOUT_BUFFERS 8 /* Buffers of sound data that may be on their way to several outputs at once */
+#define RESUME_INTERVAL 30 /* Seconds between checkpoints with --resume */
 
 
 static struct opts_s {
     int         output_dsf;
     int         output_dsdiff;
     int         ignore_tags;
+    int         build_index;
+    int         split_tracks;
+    int         keep_dst;
+    int         retag;
+    int         no_cache;
+    int         batch;
+    int         jobs;
+    const char *manifest_file;
+    int         resume;
+    int         verify;
     int         verbose;
+    const char *start_time;
+    const char *end_time;
     const char *input_file;
     const char *output_file;
+    const char **output_files; /* all of them, output_file being the first */
+    int         output_count;
+    const char **input_files;  /* with --verify, all of them, input_file being the first */
+    int         input_count;
 } opts;
 
 
+/* Parse a time given as seconds or [hh:]mm:ss, with an optional fraction, into a sample position.
+   Returns 0 if the time isn't valid. */
+static int parse_time(const char *text, uint32_t sample_rate, uint64_t *sample_offset)
+{
+    double seconds = 0.0;
+    int parts = 0;
+
+    for (;;) {
+        char *end;
+        double value = strtod(text, &end);
+
+        if (end == text || value < 0.0 || ++parts > 3) {
+            return 0;
+        }
+        seconds = seconds * 60.0 + value;
+        if (*end == '\0') {
+            break;
+        } else if (*end != ':') {
+            return 0;
+        }
+        text = end + 1;
+    }
+
+    *sample_offset = (uint64_t) (seconds * sample_rate + 0.5);
+    return 1;
+}
+
+
+/* DSD_FORMAT_DSDIFF for a .dff file name, DSD_FORMAT_DSF for .dsf, otherwise 0 */
+static uint32_t format_from_name(const char *name)
+{
+    size_t length = strlen(name);
+
+    if (length > 4 && !strnicmp(name + length - 4, ".dff", 4)) {
+        return DSD_FORMAT_DSDIFF;
+    } else if (length > 4 && !strnicmp(name + length - 4, ".dsf", 4)) {
+        return DSD_FORMAT_DSF;
+    }
+    return 0;
+}
+
 /* Parse command-line options. */
 static int parse_options(int argc, char *argv[])
 {
@@ -49,14 +122,61 @@ static int parse_options(int argc, char *argv[])
     char *program_name;
 
     static const char help_text[] =
-        "Usage: %s [options] inputfile outputfile\n"
+        "Usage: %s [options] inputfile outputfile [outputfile...]\n"
         "  -p, --output-dsdiff             : output as Philips DSDIFF (.dff) file\n"
         "  -s, --output-dsf                : output as Sony DSF (.dsf) file\n"
         "  -t, --ignore-tags               : ignore (do not copy) ID3 tags\n"
+        "  -i, --index                     : index DST input without a DSTI chunk, keeping\n"
+        "                                    the index in inputfile.dsti for later runs\n"
+        "  -k, --keep-dst                  : copy DST frames without decoding them (DST\n"
+        "                                    input and DSDIFF output only, time ranges are\n"
+        "                                    rounded out to whole frames)\n"
+        "  --start=TIME                    : start converting at TIME into the input\n"
+        "  --end=TIME                      : stop converting at TIME into the input\n"
+        "                                    (TIME is seconds or [hh:]mm:ss[.fff])\n"
+        "  --split-tracks                  : write each track marked in a DSDIFF input to\n"
+        "                                    its own file, outputfile-01.ext and so on\n"
+        "  --retag                         : replace the ID3 tag of outputfile in place with\n"
+        "                                    the tag of inputfile (a DSF or DSDIFF file, or\n"
+        "                                    a bare ID3 tag), without rewriting the sound\n"
+        "                                    data; with -t, give outputfile alone to remove\n"
+        "                                    its tag\n"
+        "  --no-cache                      : keep the input and output out of the page cache\n"
+        "                                    (for converting a lot of files at once)\n"
+        "  --batch                         : convert many files: inputfile is a directory\n"
+        "                                    (every .dsf and .dff file in and below it) or a\n"
+        "                                    list of input files, one per line, each maybe\n"
+        "                                    followed by a tab and its output file, and\n"
+        "                                    outputfile is the directory to write to, where\n"
+        "                                    each input keeps its place in the tree and gets\n"
+        "                                    the extension of the output format (-p or -s)\n"
+        "  --jobs=N                        : convert N files at once in batch mode (default\n"
+        "                                    the number of processors), all sharing the\n"
+        "                                    same DST decoding threads, the files on each\n"
+        "                                    disk being read from one at a time\n"
+        "  --resume                        : keep checkpoints while converting, next to the\n"
+        "                                    output file, and carry on from the last one if\n"
+        "                                    there is one from converting the same input the\n"
+        "                                    same way before (slower: the sound data is\n"
+        "                                    then converted in order, a buffer at a time,\n"
+        "                                    rather than on a thread per processor or by\n"
+        "                                    copying inside the kernel; DST is still\n"
+        "                                    decoded on every processor)\n"
+        "  --manifest=FILE                 : remember the files converted in batch mode in\n"
+        "                                    FILE, and skip those whose input and output\n"
+        "                                    haven't changed since\n"
+        "  --verify                        : check inputfile and any more given after it,\n"
+        "                                    writing nothing: read all the sound data,\n"
+        "                                    decoding DST and checking each frame against\n"
+        "                                    its CRC; directories are checked file by file,\n"
+        "                                    several at once as with --jobs\n"
         "  -v, --verbose                   : print file info and progress\n"
-        "  inputfile                       : source file\n"
-        "  outputfile                      : target file\n"
+        "  inputfile                       : source file, - for standard input\n"
+        "  outputfile                      : target file, - for standard output (written\n"
+        "                                    from start to end, so it can be a pipe)\n"
         " If no output format is specified, it is detected from output file name.\n"
+        " Several output files (each named .dff or .dsf) are all written from a single\n"
+        " pass over the input.\n"
         "\n"
         "Help options:\n"
         "  -?, --help                      : Show this help message\n"
@@ -64,13 +184,29 @@ static int parse_options(int argc, char *argv[])
 
     static const char usage_text[] =
         "Usage: %s [-p|--output-dsdiff] [-s|--output-dsf] [-t|--ignore-tags]\n"
-        "  [-v|--verbose] [-?|--help] [--usage] inputfile outputfile\n";
+        "  [-i|--index] [-k|--keep-dst] [--start=TIME] [--end=TIME] [--split-tracks]\n"
+        "  [--retag] [--no-cache] [--resume] [--batch] [--jobs=N] [--manifest=FILE]\n"
+        "  [-v|--verbose] [-?|--help] [--usage] inputfile outputfile [outputfile...]\n"
+        "  or: %s --verify [-i|--index] [--no-cache] [--jobs=N] [-v|--verbose]\n"
+        "  inputfile [inputfile...]\n";
 
-    static const char options_string[] = "pstv?";
+    static const char options_string[] = "pstikv?";
     static const struct option options_table[] = {
             { "output-dsdiff", no_argument, NULL, 'p' },
             { "output-dsf", no_argument, NULL, 's' },
             { "ignore-tags", no_argument, NULL, 't' },
+            { "index", no_argument, NULL, 'i' },
+            { "keep-dst", no_argument, NULL, 'k' },
+            { "start", required_argument, NULL, 'S' },
+            { "end", required_argument, NULL, 'E' },
+            { "split-tracks", no_argument, NULL, 'T' },
+            { "retag", no_argument, NULL, 'R' },
+            { "no-cache", no_argument, NULL, 'C' },
+            { "batch", no_argument, NULL, 'B' },
+            { "jobs", required_argument, NULL, 'J' },
+            { "manifest", required_argument, NULL, 'M' },
+            { "resume", no_argument, NULL, 'r' },
+            { "verify", no_argument, NULL, 'V' },
             { "verbose", no_argument, NULL, 'v' },
 
             { "help", no_argument, NULL, '?' },
@@ -92,6 +228,47 @@ static int parse_options(int argc, char *argv[])
         case 't':
             opts.ignore_tags = 1;
             break;
+        case 'i':
+            opts.build_index = 1;
+            break;
+        case 'k':
+            opts.keep_dst = 1;
+            break;
+        case 'S':
+            opts.start_time = optarg;
+            break;
+        case 'E':
+            opts.end_time = optarg;
+            break;
+        case 'T':
+            opts.split_tracks = 1;
+            break;
+        case 'R':
+            opts.retag = 1;
+            break;
+        case 'C':
+            opts.no_cache = 1;
+            break;
+        case 'B':
+            opts.batch = 1;
+            break;
+        case 'J':
+            opts.jobs = atoi(optarg);
+            if (opts.jobs < 1) {
+                fprintf(stderr, "invalid number of jobs\n");
+                fprintf(stderr, usage_text, program_name, program_name);
+                return 0;
+            }
+            break;
+        case 'M':
+            opts.manifest_file = optarg;
+            break;
+        case 'r':
+            opts.resume = 1;
+            break;
+        case 'V':
+            opts.verify = 1;
+            break;
         case 'v':
             opts.verbose = 1;
             break;
@@ -101,37 +278,124 @@ static int parse_options(int argc, char *argv[])
             return 0;
 
         case 'u':
-            fprintf(stderr, usage_text, program_name);
+            fprintf(stderr, usage_text, program_name, program_name);
             return 0;
         }
     }
 
     if (opts.output_dsf && opts.output_dsdiff) {
         fprintf(stderr, "can't output in both DSF and DSDIFF\n");
-        fprintf(stderr, usage_text, program_name);
+        fprintf(stderr, usage_text, program_name, program_name);
         return 0;
     }
 
-    if (optind < argc - 1) {
-        opts.input_file = argv[optind++];
+    if (opts.split_tracks && opts.keep_dst) {
+        fprintf(stderr, "can't split tracks without decoding DST\n");
+        fprintf(stderr, usage_text, program_name, program_name);
+        return 0;
+    }
+
+    if (opts.split_tracks && (opts.start_time || opts.end_time)) {
+        fprintf(stderr, "can't split tracks and convert a time range at once\n");
+        fprintf(stderr, usage_text, program_name, program_name);
+        return 0;
+    }
+
+    if (opts.retag && (opts.output_dsf || opts.output_dsdiff || opts.keep_dst || opts.split_tracks
+        || opts.start_time || opts.end_time)) {
+        fprintf(stderr, "can't convert and retag at once\n");
+        fprintf(stderr, usage_text, program_name, program_name);
+        return 0;
+    }
+
+    if (opts.verify) {
+        if (opts.output_dsf || opts.output_dsdiff || opts.keep_dst || opts.split_tracks || opts.retag
+            || opts.batch || opts.manifest_file || opts.resume || opts.start_time || opts.end_time) {
+            fprintf(stderr, "can't convert and verify at once\n");
+            fprintf(stderr, usage_text, program_name, program_name);
+            return 0;
+        }
+        if (optind == argc) {
+            fprintf(stderr, "input file not specified\n");
+            fprintf(stderr, usage_text, program_name, program_name);
+            return 0;
+        }
+        /* Nothing is written, so every argument is an input */
+        opts.input_file = argv[optind];
+        opts.input_files = (const char**) &argv[optind];
+        opts.input_count = argc - optind;
+        return 1;
+    }
+
+    if (opts.retag && opts.ignore_tags && optind == argc - 1) {
+        /* Just removing the tag, so there's no file to take one from */
         opts.output_file = argv[optind++];
+    } else if (optind < argc - 1) {
+        opts.input_file = argv[optind++];
+        opts.output_file = argv[optind];
+        opts.output_files = (const char**) &argv[optind];
+        opts.output_count = argc - optind;
 
-        /* Detect output format from filename if not specified */
-        if (!opts.output_dsf && !opts.output_dsdiff) {
-            size_t oflen = strlen(opts.output_file);
-            if (oflen > 4 && !strnicmp(opts.output_file + oflen - 4, ".dff", 4)) {
+        if (opts.batch) {
+            if (opts.retag || opts.split_tracks || opts.output_count > 1 || !strcmp(opts.input_file, "-")
+                || !strcmp(opts.output_file, "-")) {
+                fprintf(stderr, "batch mode takes an input directory or list and an output directory\n");
+                fprintf(stderr, usage_text, program_name, program_name);
+                return 0;
+            }
+        } else if (opts.manifest_file) {
+            fprintf(stderr, "a manifest is only kept in batch mode\n");
+            fprintf(stderr, usage_text, program_name, program_name);
+            return 0;
+        } else if (opts.output_count > 1) {
+            int i;
+
+            if (opts.retag || opts.split_tracks || opts.keep_dst || opts.output_dsf || opts.output_dsdiff) {
+                fprintf(stderr, "several output files can only be converted to, each in the format its name ends in\n");
+                fprintf(stderr, usage_text, program_name, program_name);
+                return 0;
+            }
+            for (i = 0; i < opts.output_count; i++) {
+                if (!format_from_name(opts.output_files[i])) {
+                    fprintf(stderr, "no output format specified for \"%s\"\n", opts.output_files[i]);
+                    fprintf(stderr, usage_text, program_name, program_name);
+                    return 0;
+                }
+            }
+        } else if (!opts.retag && !opts.output_dsf && !opts.output_dsdiff) {
+            /* Detect output format from filename if not specified */
+            uint32_t format = format_from_name(opts.output_file);
+            if (format == DSD_FORMAT_DSDIFF) {
                 opts.output_dsdiff = 1;
-            } else if (oflen > 4 && !strnicmp(opts.output_file + oflen - 4, ".dsf", 4)) {
+            } else if (format == DSD_FORMAT_DSF) {
                 opts.output_dsf = 1;
             } else {
                 fprintf(stderr, "no output format specified\n");
-                fprintf(stderr, usage_text, program_name);
+                fprintf(stderr, usage_text, program_name, program_name);
                 return 0;
             }
         }
     } else {
         fprintf(stderr, "input or output file not specified\n");
-        fprintf(stderr, usage_text, program_name);
+        fprintf(stderr, usage_text, program_name, program_name);
+        return 0;
+    }
+
+    /* Standard output is written in one go, which takes knowing every size up front */
+    if ((opts.retag || opts.split_tracks || opts.keep_dst) && !strcmp(opts.output_file, "-")) {
+        fprintf(stderr, "can't retag, split tracks or keep DST when writing to standard output\n");
+        fprintf(stderr, usage_text, program_name, program_name);
+        return 0;
+    }
+    if (opts.resume && (opts.retag || opts.split_tracks || opts.keep_dst || opts.output_count > 1
+        || !strcmp(opts.output_file, "-"))) {
+        fprintf(stderr, "can only resume converting the sound data into a single output file\n");
+        fprintf(stderr, usage_text, program_name, program_name);
+        return 0;
+    }
+    if (opts.retag && opts.input_file && !strcmp(opts.input_file, "-")) {
+        fprintf(stderr, "can't retag from standard input\n");
+        fprintf(stderr, usage_text, program_name, program_name);
         return 0;
     }
 
@@ -146,100 +410,1319 @@ static void init(void)
     opts.output_dsf    = 0;
     opts.output_dsdiff = 0;
     opts.ignore_tags   = 0;
+    opts.build_index   = 0;
+    opts.split_tracks  = 0;
+    opts.keep_dst      = 0;
+    opts.retag         = 0;
+    opts.no_cache      = 0;
+    opts.batch         = 0;
+    opts.jobs          = 0;
+    opts.manifest_file = NULL;
+    opts.resume        = 0;
+    opts.verify        = 0;
     opts.verbose       = 0;
+    opts.start_time    = NULL;
+    opts.end_time      = NULL;
     opts.input_file    = NULL;
     opts.output_file   = NULL;
+    opts.output_files  = NULL;
+    opts.output_count  = 1;
+    opts.input_files   = NULL;
+    opts.input_count   = 0;
 }
 
 
-int main(int argc, char* argv[])
+/* Move the next piece of the current chunk from reader to writer, letting the kernel copy it
+   when the input already holds it the way the output wants it, returns 0 at the end of the chunk */
+static size_t transfer(dsd_reader_t *reader, dsd_writer_t *writer, char *buffer)
 {
-    int result = 1;
+    size_t length = (size_t) dsd_copy_raw(reader, writer, COPY_SIZE);
 
-#ifdef PTW32_STATIC_LIB
-    pthread_win32_process_attach_np();
-    pthread_win32_thread_attach_np();
+    if (length == 0) {
+        length = dsd_copy_planar(reader, writer, buffer, BUFFER_SIZE);
+    }
+    if (length == 0 && (length = dsd_reader_read(buffer, BUFFER_SIZE, reader)) > 0) {
+        dsd_writer_write(buffer, length, writer);
+    }
+    return length;
+}
+
+/* Standard input, or when it can't be seeked (a pipe) a temporary copy of it, as the formats have
+   to look ahead in the file for the chunks after the sound data */
+static FILE *open_stdin(void)
+{
+    FILE *fp;
+    char *buffer;
+    size_t length;
+
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
 #endif
+    if (fseek(stdin, 0, SEEK_CUR) == 0) {
+        return stdin;
+    }
+    if ((fp = tmpfile()) == NULL) {
+        return NULL;
+    }
+    buffer = malloc(BUFFER_SIZE);
+    while ((length = fread(buffer, 1, BUFFER_SIZE, stdin)) > 0) {
+        if (fwrite(buffer, 1, length, fp) != length) {
+            fclose(fp);
+            fp = NULL;
+            break;
+        }
+    }
+    free(buffer);
+    if (fp) {
+        rewind(fp);
+    }
+    return fp;
+}
 
-    init();
+/* Read the ID3 tag of a DSF or DSDIFF file, or a whole file holding just a tag */
+static int read_tag(const char *filename, uint8_t **tag, size_t *tag_len)
+{
+    dsd_reader_t reader;
+    int opened = dsd_reader_open_file(filename, 0, &reader);
+    size_t capacity = BUFFER_SIZE;
+    size_t length = 0;
+
+    *tag = malloc(capacity);
+    *tag_len = 0;
+    if (opened == 1) {
+        uint32_t chunk;
+
+        while ((chunk = dsd_reader_next_chunk(&reader)) > 0 && chunk != MAKE_MARKER('I', 'D', '3', ' '))
+            ;
+        while (chunk && (length = dsd_reader_read((char*) *tag + *tag_len, capacity - *tag_len, &reader)) > 0) {
+            *tag_len += length;
+            if (*tag_len == capacity) {
+                capacity *= 2;
+                *tag = realloc(*tag, capacity);
+            }
+        }
+        dsd_reader_close(&reader);
+    } else if (opened == 0) {
+        FILE *fp = fopen(filename, "rb");
+
+        while (fp && (length = fread(*tag + *tag_len, 1, capacity - *tag_len, fp)) > 0) {
+            *tag_len += length;
+            if (*tag_len == capacity) {
+                capacity *= 2;
+                *tag = realloc(*tag, capacity);
+            }
+        }
+        if (fp) {
+            fclose(fp);
+        }
+        if (*tag_len < 3 || memcmp(*tag, "ID3", 3) != 0) {
+            *tag_len = 0;
+        }
+    } else {
+        fprintf(stderr, "could not open input file \"%s\"\n", filename);
+        free(*tag);
+        return 0;
+    }
+
+    if (*tag_len == 0) {
+        fprintf(stderr, "no ID3 tag found in \"%s\"\n", filename);
+        free(*tag);
+        return 0;
+    }
+    return 1;
+}
+
+/* Replace the tag of the output file with the tag of the input file, or remove it when ignoring
+   tags, leaving the sound data where it is */
+static int retag(void)
+{
+    uint8_t *tag = NULL;
+    size_t tag_len = 0;
+    int result;
+
+    if (!opts.ignore_tags && !read_tag(opts.input_file, &tag, &tag_len)) {
+        return 0;
+    }
+
+    result = dsd_retag_file(opts.output_file, tag, tag_len);
+    if (result == 1 && opts.verbose) {
+        if (tag_len) {
+            printf("Wrote %" PRIu64 " byte ID3 tag to %s\n", (uint64_t) tag_len, opts.output_file);
+        } else {
+            printf("Removed ID3 tag from %s\n", opts.output_file);
+        }
+    } else if (result == 0) {
+        fprintf(stderr, "\"%s\" is not valid DSF or DSDIFF, or its tag can't be replaced in place\n", opts.output_file);
+    } else if (result < 0) {
+        fprintf(stderr, "could not update \"%s\"\n", opts.output_file);
+    }
+    if (tag) {
+        free(tag);
+    }
+    return result == 1;
+}
+
+/* The output file for track 3 of "album.dsf" is "album-03.dsf" */
+static char *track_file_name(const char *output_file, uint32_t track)
+{
+    const char *dot = strrchr(output_file, '.');
+    const char *slash = strrchr(output_file, '/');
+    char *name = malloc(strlen(output_file) + 16);
+    size_t base_len;
+
+    if (!dot || (slash && dot < slash)) {
+        dot = output_file + strlen(output_file);
+    }
+    base_len = dot - output_file;
+    memcpy(name, output_file, base_len);
+    sprintf(name + base_len, "-%02" PRIu32 "%s", track, dot);
+    return name;
+}
+
+typedef struct track_output_t {
+    dsd_writer_t      writer;
+    dsd_bit_shifter_t shifter;
+    uint64_t          first;   /* bytes of the sound data feeding this track */
+    uint64_t          last;
+    uint64_t          remain;  /* bytes still to write */
+    int               shift;
+    int               state;   /* 0 = not started, 1 = writing, 2 = done */
+} track_output_t;
+
+static void finish_track(track_output_t *track, char *scratch)
+{
+    if (track->shift) {
+        size_t length = dsd_bit_shifter_flush(&track->shifter, scratch, BUFFER_SIZE);
+        dsd_writer_write(scratch, (size_t) ((length < track->remain) ? length : track->remain), &track->writer);
+    }
+    dsd_writer_close(&track->writer);
+    track->state = 2;
+}
+
+/* Write every track marked in the input to its own file, routing the sound data to the track
+   outputs as it is read so the input is only decoded once. Tracks that don't start on a byte
+   boundary are shifted into place. */
+static int split_tracks(dsd_reader_t *reader)
+{
+    uint32_t format = opts.output_dsdiff ? DSD_FORMAT_DSDIFF : DSD_FORMAT_DSF;
+    track_output_t *tracks;
+    char *buffer, *scratch;
+    uint64_t pos = 0;
+    size_t length;
+    uint32_t i;
+    int ok = 1;
+
+    if (reader->track_count == 0) {
+        fprintf(stderr, "input file has no track markers\n");
+        return 0;
+    }
+
+    tracks = calloc(reader->track_count, sizeof(track_output_t));
+    for (i = 0; i < reader->track_count; i++) {
+        uint64_t start = reader->tracks[i].start;
+        uint64_t bytes = (reader->tracks[i].end - start + 7) / 8;
 
-    if (parse_options(argc, argv)) {
-        FILE *in_file;
+        tracks[i].shift = (int) (start % 8);
+        tracks[i].first = start / 8 * reader->channel_count;
+        tracks[i].last = tracks[i].first + (bytes + (tracks[i].shift ? 1 : 0)) * reader->channel_count;
+        tracks[i].remain = bytes * reader->channel_count;
+    }
 
-        if ((in_file = fopen(opts.input_file, "rb")) != NULL) {
-            dsd_reader_t reader;
+    buffer = malloc(BUFFER_SIZE);
+    scratch = malloc(BUFFER_SIZE);
+    while (ok && (length = dsd_reader_read(buffer, BUFFER_SIZE, reader)) > 0) {
+        for (i = 0; ok && i < reader->track_count; i++) {
+            track_output_t *track = &tracks[i];
+            uint64_t from, to;
+            char *data;
+            size_t amount;
 
-            if (dsd_reader_open(in_file, &reader) == 1) {
-                FILE *out_file;
+            if (track->state == 2 || track->last <= pos) {
+                continue;
+            } else if (track->first >= pos + length) {
+                break;
+            }
 
-                if (opts.verbose) {
-                    uint64_t sample_count = reader.data_length * 8 / reader.channel_count;
+            if (track->state == 0) {
+                char *name = track_file_name(opts.output_file, i + 1);
+                FILE *out_file = fopen(name, "wb");
 
-                    if (reader.container_format == DSD_FORMAT_DSF) {
-                        printf("Source file is DSF\n");
-                    } else if (reader.compressed) {
-                        printf("Source file is DST-compressed DSDIFF\n");
-                    } else {
-                        printf("Source file is uncompressed DSDIFF\n");
+                if (out_file) {
+                    if (opts.verbose) {
+                        printf("Writing track %" PRIu32 " to %s\n", i + 1, name);
                     }
-                    printf("Uncompressed DSD size: %" PRIu64 ", sample rate: %" PRIu32 ", channels: %" PRIu8 "\n",
-                        reader.data_length, reader.sample_rate, reader.channel_count);
-                    printf("Duration: %02" PRIu64 ":%02" PRIu64 ":%02" PRIu64 ".%03" PRIu64 " (%" PRIu64 " samples)\n",
-                        sample_count / reader.sample_rate / 3600, (sample_count / reader.sample_rate / 60) % 60,
-                        (sample_count / reader.sample_rate) % 60, (sample_count * 1000 / reader.sample_rate) % 1000,
-                        sample_count);
+                    dsd_writer_open(out_file, format, reader->sample_rate, reader->channel_count, track->remain, &track->writer);
+                    dsd_writer_set_io_policy(&track->writer, opts.no_cache ? DSD_WRITER_DROP_BEHIND : 0);
+                    dsd_bit_shifter_init(&track->shifter, track->shift, reader->channel_count);
+                    track->state = 1;
+                } else {
+                    fprintf(stderr, "could not open output file \"%s\"\n", name);
+                    ok = 0;
                 }
+                free(name);
+                if (!ok) {
+                    break;
+                }
+            }
 
-                if ((out_file = fopen(opts.output_file, "wb")) != NULL) {
-                    dsd_writer_t writer;
-                    char* buffer = malloc(BUFFER_SIZE);
-                    size_t length;
-                    uint32_t ext;
+            from = (track->first > pos) ? track->first : pos;
+            to = (track->last < pos + length) ? track->last : pos + length;
+            data = buffer + (from - pos);
+            amount = (size_t) (to - from);
+            if (track->shift) {
+                /* Neighbouring tracks may share these bytes, so shift a copy */
+                memcpy(scratch, data, amount);
+                data = scratch;
+                amount = dsd_bit_shifter_process(&track->shifter, scratch, amount);
+            }
+            if (amount > track->remain) {
+                amount = (size_t) track->remain;
+            }
+            dsd_writer_write(data, amount, &track->writer);
+            track->remain -= amount;
 
-                    dsd_writer_open(out_file, opts.output_dsdiff ? DSD_FORMAT_DSDIFF : DSD_FORMAT_DSF,
-                        reader.sample_rate, reader.channel_count, &writer);
+            if (to == track->last) {
+                finish_track(track, scratch);
+            }
+        }
+        pos += length;
+    }
 
-                    /* Main audio data */
-                    while ((length = dsd_reader_read(buffer, BUFFER_SIZE, &reader)) > 0) {
-                        dsd_writer_write(buffer, length, &writer);
-                        if (opts.verbose) {
-                            printf("\r%2" PRIu64 "%%", writer.data_length * 100 / reader.data_length);
-                        }
+    /* The sound data may end early */
+    for (i = 0; i < reader->track_count; i++) {
+        if (tracks[i].state == 1) {
+            finish_track(&tracks[i], scratch);
+        }
+    }
+
+    free(scratch);
+    free(buffer);
+    free(tracks);
+    return ok;
+}
+
+/* The sound data on its way to several outputs: the input is read into a ring of buffers once,
+   and each output's thread writes every buffer out in turn */
+typedef struct fanout_t {
+    char           *buffers[FANOUT_BUFFERS];
+    size_t          lengths[FANOUT_BUFFERS];
+    uint64_t        filled;   /* buffers read into so far */
+    int             finished; /* no more are coming */
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} fanout_t;
+
+typedef struct fanout_output_t {
+    fanout_t     *fanout;
+    dsd_writer_t  writer;
+    uint64_t      written;    /* buffers written out so far */
+    pthread_t     thread;
+    int           running;
+    int           taking;     /* taking the chunk being copied after the sound data */
+} fanout_output_t;
+
+static void *fanout_thread(void *arg)
+{
+    fanout_output_t *output = (fanout_output_t*) arg;
+    fanout_t *fanout = output->fanout;
+
+    pthread_mutex_lock(&fanout->mutex);
+    for (;;) {
+        uint32_t slot = (uint32_t) (output->written % FANOUT_BUFFERS);
+
+        while (output->written == fanout->filled && !fanout->finished) {
+            pthread_cond_wait(&fanout->cond, &fanout->mutex);
+        }
+        if (output->written == fanout->filled) {
+            break;
+        }
+
+        /* The reader leaves the buffer alone until every output has written it */
+        pthread_mutex_unlock(&fanout->mutex);
+        dsd_writer_write(fanout->buffers[slot], fanout->lengths[slot], &output->writer);
+        pthread_mutex_lock(&fanout->mutex);
+        output->written++;
+        pthread_cond_broadcast(&fanout->cond);
+    }
+    pthread_mutex_unlock(&fanout->mutex);
+    return NULL;
+}
+
+/* Write every output file given from a single pass over the input, so DST is only decoded once */
+static int fan_out(dsd_reader_t *reader, uint64_t total_length, FILE *info)
+{
+    fanout_t fanout;
+    fanout_output_t *outputs = calloc(opts.output_count, sizeof(fanout_output_t));
+    uint64_t read_total = 0;
+    size_t length;
+    uint32_t ext;
+    int i, opened, ok = 1;
+
+    for (opened = 0; opened < opts.output_count; opened++) {
+        FILE *out_file = fopen(opts.output_files[opened], "wb");
+
+        if (!out_file) {
+            fprintf(stderr, "could not open output file \"%s\"\n", opts.output_files[opened]);
+            ok = 0;
+            break;
+        }
+        dsd_writer_open(out_file, format_from_name(opts.output_files[opened]), reader->sample_rate,
+            reader->channel_count, total_length, &outputs[opened].writer);
+        dsd_writer_set_io_policy(&outputs[opened].writer, opts.no_cache ? DSD_WRITER_DROP_BEHIND : 0);
+        outputs[opened].fanout = &fanout;
+    }
+
+    if (ok) {
+        for (i = 0; i < FANOUT_BUFFERS; i++) {
+            fanout.buffers[i] = malloc(BUFFER_SIZE);
+        }
+        fanout.filled = 0;
+        fanout.finished = 0;
+        pthread_mutex_init(&fanout.mutex, NULL);
+        pthread_cond_init(&fanout.cond, NULL);
+        for (i = 0; i < opts.output_count; i++) {
+            outputs[i].running = (pthread_create(&outputs[i].thread, NULL, fanout_thread, &outputs[i]) == 0);
+        }
+
+        /* Main audio data, read into each buffer once all the outputs are done with it */
+        for (;;) {
+            uint32_t slot = (uint32_t) (fanout.filled % FANOUT_BUFFERS);
+
+            pthread_mutex_lock(&fanout.mutex);
+            for (i = 0; i < opts.output_count; i++) {
+                while (outputs[i].written + FANOUT_BUFFERS <= fanout.filled) {
+                    pthread_cond_wait(&fanout.cond, &fanout.mutex);
+                }
+            }
+            pthread_mutex_unlock(&fanout.mutex);
+
+            if ((length = dsd_reader_read(fanout.buffers[slot], BUFFER_SIZE, reader)) == 0) {
+                break;
+            }
+            for (i = 0; i < opts.output_count; i++) {
+                if (!outputs[i].running) {
+                    /* No thread to spare, so write it here */
+                    dsd_writer_write(fanout.buffers[slot], length, &outputs[i].writer);
+                    outputs[i].written++;
+                }
+            }
+
+            pthread_mutex_lock(&fanout.mutex);
+            fanout.lengths[slot] = length;
+            fanout.filled++;
+            pthread_cond_broadcast(&fanout.cond);
+            pthread_mutex_unlock(&fanout.mutex);
+
+            read_total += length;
+            if (opts.verbose) {
+                fprintf(info, "\r%2" PRIu64 "%%", read_total * 100 / total_length);
+            }
+        }
+
+        pthread_mutex_lock(&fanout.mutex);
+        fanout.finished = 1;
+        pthread_cond_broadcast(&fanout.cond);
+        pthread_mutex_unlock(&fanout.mutex);
+        for (i = 0; i < opts.output_count; i++) {
+            if (outputs[i].running) {
+                pthread_join(outputs[i].thread, NULL);
+            }
+        }
+        pthread_cond_destroy(&fanout.cond);
+        pthread_mutex_destroy(&fanout.mutex);
+        if (opts.verbose) {
+            fprintf(info, "\n");
+        }
+
+        /* Format-specific extensions, copied to each output that has a place for them */
+        while ((ext = dsd_reader_next_chunk(reader)) > 0) {
+            int taken = 0;
+
+            if (opts.ignore_tags && ext == MAKE_MARKER('I', 'D', '3', ' ')) {
+                continue;
+            }
+            for (i = 0; i < opts.output_count; i++) {
+                outputs[i].taking = dsd_writer_next_chunk(ext, reader->chunk_length, &outputs[i].writer);
+                taken |= outputs[i].taking;
+            }
+            if (taken && opts.verbose) {
+                char *extc = (char*) &ext;
+                fprintf(info, "Writing %c%c%c%c...\n", extc[0], extc[1], extc[2], extc[3]);
+            }
+            while (taken && (length = dsd_reader_read(fanout.buffers[0], BUFFER_SIZE, reader)) > 0) {
+                for (i = 0; i < opts.output_count; i++) {
+                    if (outputs[i].taking) {
+                        dsd_writer_write(fanout.buffers[0], length, &outputs[i].writer);
                     }
+                }
+            }
+        }
 
-                    if (opts.verbose) {
-                        printf("\n");
+        for (i = 0; i < FANOUT_BUFFERS; i++) {
+            free(fanout.buffers[i]);
+        }
+    }
+
+    for (i = 0; i < opened; i++) {
+        dsd_writer_close(&outputs[i].writer);
+    }
+    free(outputs);
+    return ok;
+}
+
+
+/* The options an output depends on besides its input, as kept in checkpoints and the manifest */
+static void conversion_settings(uint32_t format, char *settings, size_t size)
+{
+    snprintf(settings, size, "%s%s%s start=%s end=%s", format == DSD_FORMAT_DSDIFF ? "dff" : "dsf",
+        opts.keep_dst ? " keep-dst" : "", opts.ignore_tags ? " ignore-tags" : "",
+        opts.start_time ? opts.start_time : "", opts.end_time ? opts.end_time : "");
+}
+
+/* Where a conversion with --resume got to, kept in foo.dsf.resume next to the output foo.dsf */
+typedef struct checkpoint_t {
+    char     *filename;
+    uint64_t  input_size;
+    int64_t   input_mtime;
+    char      settings[256];
+    uint64_t  written;      /* bytes of sound data in the output, see dsd_writer_sync */
+} checkpoint_t;
+
+/* Returns 1 if there's a checkpoint from converting the same input the same way, as far as the
+   output still goes, or 0 (and written 0) to start from the beginning */
+static int read_checkpoint(const char *output_file, dsd_reader_t *reader, uint32_t format, checkpoint_t *checkpoint)
+{
+    char line[512];
+    char settings[256];
+    uint64_t input_size, output_size, written;
+    int64_t input_mtime, output_mtime;
+    FILE *fp;
+    int found = 0;
+
+    checkpoint->written = 0;
+    checkpoint->filename = NULL;
+    if (!dsd_file_identity(reader->input, &checkpoint->input_size, &checkpoint->input_mtime)
+        || (checkpoint->filename = (char*) malloc(strlen(output_file) + 8)) == NULL) {
+        return 0;
+    }
+    sprintf(checkpoint->filename, "%s.resume", output_file);
+    conversion_settings(format, checkpoint->settings, sizeof(checkpoint->settings));
+
+    if ((fp = fopen(checkpoint->filename, "r")) == NULL) {
+        return 0;
+    }
+    if (fgets(line, sizeof(line), fp) && !strcmp(line, "dsdunpack resume 1\n") && fgets(line, sizeof(line), fp)
+        && sscanf(line, "%" SCNu64 "\t%" SCNd64 "\t%255[^\t]\t%" SCNu64, &input_size, &input_mtime, settings, &written) == 4) {
+        if (input_size == checkpoint->input_size && input_mtime == checkpoint->input_mtime
+            && !strcmp(settings, checkpoint->settings) && written % reader->channel_count == 0) {
+            FILE *out = fopen(output_file, "rb");
+
+            /* The output has to still have all of it, it only gets longer */
+            if (out && dsd_file_identity(out, &output_size, &output_mtime) && output_size >= written) {
+                checkpoint->written = written;
+                found = written > 0;
+            }
+            if (out) {
+                fclose(out);
+            }
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+/* Written next to the checkpoint and moved over it, so there's always a whole one */
+static void write_checkpoint(checkpoint_t *checkpoint)
+{
+    size_t length = strlen(checkpoint->filename);
+    char *temp_file = (char*) malloc(length + 5);
+    FILE *fp;
+    int written;
+
+    if (!temp_file) {
+        return;
+    }
+    sprintf(temp_file, "%s.new", checkpoint->filename);
+    if ((fp = fopen(temp_file, "w")) != NULL) {
+        fprintf(fp, "dsdunpack resume 1\n%" PRIu64 "\t%" PRId64 "\t%s\t%" PRIu64 "\n",
+            checkpoint->input_size, checkpoint->input_mtime, checkpoint->settings, checkpoint->written);
+        written = !ferror(fp);
+        written = fclose(fp) == 0 && written;
+#ifdef _WIN32
+        /* rename won't replace a file there */
+        if (written) {
+            remove(checkpoint->filename);
+        }
+#endif
+        if (!written || rename(temp_file, checkpoint->filename) != 0) {
+            remove(temp_file);
+        }
+    }
+    free(temp_file);
+}
+
+/* Convert one input file to one output file (or the outputs given for --split-tracks, or several
+   output files), in the given format, "-" standing for standard input or output. Returns 1 on
+   success. */
+static int convert(const char *input_file, const char *output_file, uint32_t format, int verbose)
+{
+    int result = 0;
+    dsd_reader_t reader;
+    int flags = (opts.build_index ? DSD_READER_BUILD_INDEX : 0) | (opts.no_cache ? DSD_READER_DROP_BEHIND : 0)
+        | (opts.batch ? DSD_READER_SHARE_DEVICE : 0);
+    int streaming = !strcmp(output_file, "-");
+    FILE *info = streaming ? stderr : stdout; /* for -v, out of the way of the output */
+    int opened;
+
+    if (strcmp(input_file, "-") != 0) {
+        opened = dsd_reader_open_file(input_file, flags, &reader);
+    } else {
+        FILE *in_file = open_stdin();
+
+        opened = in_file ? dsd_reader_open(in_file, flags, &reader) : -1;
+        if (opened == 0) {
+            fclose(in_file);
+        }
+    }
+
+    if (opened == 1) {
+        FILE *out_file;
+        uint64_t start = 0;
+        uint64_t end = reader.data_length * 8 / reader.channel_count;
+        uint64_t total_length = reader.data_length;
+        int ready = 1;
+        checkpoint_t checkpoint;
+
+        if (opts.keep_dst && (!reader.compressed || format != DSD_FORMAT_DSDIFF)) {
+            fprintf(stderr, "keeping DST needs DST-compressed DSDIFF input and DSDIFF output\n");
+            ready = 0;
+        }
+
+        /* Work out which part of the sound data to convert */
+        if (!ready) {
+            /* Already complained */
+        } else if ((opts.start_time && !parse_time(opts.start_time, reader.sample_rate, &start))
+            || (opts.end_time && !parse_time(opts.end_time, reader.sample_rate, &end))) {
+            fprintf(stderr, "invalid start or end time\n");
+            ready = 0;
+        } else {
+            if (end > reader.data_length * 8 / reader.channel_count) {
+                end = reader.data_length * 8 / reader.channel_count;
+            }
+            if (start >= end) {
+                fprintf(stderr, "start time must be before the end time and the end of the input\n");
+                ready = 0;
+            } else if (opts.start_time || opts.end_time) {
+                if (opts.keep_dst) {
+                    /* Frames can only be copied whole */
+                    uint64_t frame_samples = reader.sample_rate / reader.frame_rate;
+                    start = start / frame_samples * frame_samples;
+                    end = (end + frame_samples - 1) / frame_samples * frame_samples;
+                    if (end > reader.data_length * 8 / reader.channel_count) {
+                        end = reader.data_length * 8 / reader.channel_count;
                     }
+                }
+                if (start > 0 && !dsd_reader_seek(&reader, start)) {
+                    fprintf(stderr, "could not seek to the start time\n");
+                    ready = 0;
+                }
+                dsd_reader_set_end(&reader, end);
+                total_length = (end - start + 7) / 8 * reader.channel_count;
+            }
+        }
 
-                    /* Format-specific extensions (DSDIFF comment/edit master, ID3 tags, etc.) */
-                    while ((ext = dsd_reader_next_chunk(&reader)) > 0) {
-                        if ((!opts.ignore_tags || ext != MAKE_MARKER('I', 'D', '3', ' '))
-                            && dsd_writer_next_chunk(ext, &writer)) {
-                            if (opts.verbose) {
-                                char *extc = (char*) &ext;
-                                printf("Writing %c%c%c%c...\n", extc[0], extc[1], extc[2], extc[3]);
-                            }
-                            while ((length = dsd_reader_read(buffer, BUFFER_SIZE, &reader)) > 0) {
-                                dsd_writer_write(buffer, length, &writer);
-                            }
+        if (verbose) {
+            uint64_t sample_count = reader.data_length * 8 / reader.channel_count;
+
+            if (reader.container_format == DSD_FORMAT_DSF) {
+                fprintf(info, "Source file is DSF\n");
+            } else if (reader.compressed) {
+                fprintf(info, "Source file is DST-compressed DSDIFF\n");
+            } else {
+                fprintf(info, "Source file is uncompressed DSDIFF\n");
+            }
+            fprintf(info, "Uncompressed DSD size: %" PRIu64 ", sample rate: %" PRIu32 ", channels: %" PRIu8 "\n",
+                reader.data_length, reader.sample_rate, reader.channel_count);
+            fprintf(info, "Duration: %02" PRIu64 ":%02" PRIu64 ":%02" PRIu64 ".%03" PRIu64 " (%" PRIu64 " samples)\n",
+                sample_count / reader.sample_rate / 3600, (sample_count / reader.sample_rate / 60) % 60,
+                (sample_count / reader.sample_rate) % 60, (sample_count * 1000 / reader.sample_rate) % 1000,
+                sample_count);
+        }
+
+        checkpoint.filename = NULL;
+        checkpoint.written = 0;
+        if (ready && opts.resume && read_checkpoint(output_file, &reader, format, &checkpoint)) {
+            /* Carry on reading from where the output got to */
+            if (dsd_reader_seek(&reader, start + checkpoint.written / reader.channel_count * 8)) {
+                dsd_reader_set_end(&reader, end);
+            } else {
+                fprintf(stderr, "could not go back to where \"%s\" got to (-i helps with DST files without an index), "
+                    "starting again\n", output_file);
+                checkpoint.written = 0;
+            }
+        }
+
+        if (!ready) {
+            /* Already complained */
+        } else if (opts.split_tracks) {
+            result = split_tracks(&reader);
+        } else if (opts.output_count > 1) {
+            result = fan_out(&reader, total_length, info);
+        } else if ((out_file = streaming ? stdout : fopen(output_file, checkpoint.written ? "r+b" : "wb")) != NULL) {
+            dsd_writer_t writer;
+            char* buffer = malloc(BUFFER_SIZE);
+            dsd_chunk_info_t *trailer = NULL;
+            uint32_t ext, i, trailer_count = 0;
+            int failed = 0;
+
+            if (opts.keep_dst) {
+                dsd_frame_t frame;
+
+                dsd_writer_open_dst(out_file, reader.sample_rate, reader.channel_count, reader.frame_rate, total_length, &writer);
+                dsd_writer_set_io_policy(&writer, opts.no_cache ? DSD_WRITER_DROP_BEHIND : 0);
+
+                /* Main audio data, copied frame by frame */
+                frame.data = malloc(reader.frame_capacity);
+                while (dsd_reader_read_frame(&reader, &frame)) {
+                    dsd_writer_write_frame(&frame, &writer);
+                    if (verbose) {
+                        fprintf(info, "\r%2" PRIu64 "%%", writer.data_length * 100 / total_length);
+                    }
+                }
+                free(frame.data);
+            } else {
+                if (streaming) {
+#ifdef _WIN32
+                    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+                    /* The chunks that will be copied after the sound data, so the headers can
+                       be written once and for all */
+                    trailer = malloc((reader.chunk_count + 1) * sizeof(dsd_chunk_info_t));
+                    for (i = 0; i < reader.chunk_count; i++) {
+                        if (!opts.ignore_tags || reader.chunks[i].chunk_id != MAKE_MARKER('I', 'D', '3', ' ')) {
+                            trailer[trailer_count++] = reader.chunks[i];
                         }
                     }
+                    dsd_writer_open_stream(out_file, format, reader.sample_rate, reader.channel_count, total_length,
+                        trailer, trailer_count, &writer);
+                } else {
+                    dsd_writer_open(out_file, format, reader.sample_rate, reader.channel_count, total_length, &writer);
+                }
+                dsd_writer_set_io_policy(&writer, opts.no_cache ? DSD_WRITER_DROP_BEHIND : 0);
 
-                    dsd_writer_close(&writer);
+                if (opts.resume) {
+                    /* Main audio data, a buffer at a time so the output can be checkpointed
+                       every so often. dsd_copy_parallel and dsd_copy_raw are left out, as
+                       they fill in the output out of order or all in one go, with nowhere
+                       in between to checkpoint at (see the help for --resume). */
+                    time_t last_checkpoint = time(NULL);
+                    size_t length;
 
-                    result = 0; /* Success! */
+                    if (checkpoint.written) {
+                        if (!dsd_writer_resume(checkpoint.written, &writer)) {
+                            fprintf(stderr, "could not resume writing \"%s\"\n", output_file);
+                            failed = 1;
+                        } else if (verbose) {
+                            fprintf(info, "Resuming at %2" PRIu64 "%%\n", checkpoint.written * 100 / total_length);
+                        }
+                    } else if (checkpoint.filename) {
+                        /* Anything left from before doesn't go with this output */
+                        remove(checkpoint.filename);
+                    }
+                    while (!failed && (length = dsd_reader_read(buffer, BUFFER_SIZE, &reader)) > 0) {
+                        dsd_writer_write(buffer, length, &writer);
+                        if (checkpoint.filename && time(NULL) - last_checkpoint >= RESUME_INTERVAL) {
+                            if ((checkpoint.written = dsd_writer_sync(&writer)) > 0) {
+                                write_checkpoint(&checkpoint);
+                            }
+                            last_checkpoint = time(NULL);
+                        }
+                        if (verbose) {
+                            fprintf(info, "\r%2" PRIu64 "%%", writer.data_length * 100 / total_length);
+                        }
+                    }
                 } else {
-                    fprintf(stderr, "could not open output file \"%s\"\n", opts.output_file);
+                    /* Main audio data, all at once when it can be converted in parallel */
+                    if (dsd_copy_parallel(&reader, &writer) == DSD_COPY_FAILED) {
+                        failed = 1;
+                    }
+                    while (!failed && transfer(&reader, &writer, buffer) > 0) {
+                        if (verbose) {
+                            fprintf(info, "\r%2" PRIu64 "%%", writer.data_length * 100 / total_length);
+                        }
+                    }
                 }
+            }
+
+            if (verbose) {
+                fprintf(info, "\n");
+            }
+
+            /* Format-specific extensions (DSDIFF comment/edit master, ID3 tags, etc.) */
+            while ((ext = dsd_reader_next_chunk(&reader)) > 0) {
+                if ((!opts.ignore_tags || ext != MAKE_MARKER('I', 'D', '3', ' '))
+                    && dsd_writer_next_chunk(ext, reader.chunk_length, &writer)) {
+                    if (verbose) {
+                        char *extc = (char*) &ext;
+                        fprintf(info, "Writing %c%c%c%c...\n", extc[0], extc[1], extc[2], extc[3]);
+                    }
+                    while (transfer(&reader, &writer, buffer) > 0)
+                        ;
+                }
+            }
+
+            dsd_writer_close(&writer);
+            if (trailer) {
+                free(trailer);
+            }
+            free(buffer);
+            if (checkpoint.filename && !failed) {
+                /* Nothing left to resume */
+                remove(checkpoint.filename);
+            }
+
+            result = !failed; /* Success! */
+        } else {
+            fprintf(stderr, "could not open output file \"%s\"\n", output_file);
+        }
+
+        free(checkpoint.filename);
+        dsd_reader_close(&reader);
+
+        /* Only final now the decoder is done with the file */
+        if (result && reader.frame_errors > 0) {
+            /* The frames that couldn't be decoded went out as silence */
+            result = 0;
+        }
+    } else if (opened == 0) {
+        fprintf(stderr, "input file is not valid DSF or DSDIFF\n");
+    } else {
+        fprintf(stderr, "could not open input file \"%s\"\n", input_file);
+    }
+
+    return result;
+}
+
+/* Read all the sound data of input_file without writing it anywhere, the DST frames being decoded
+   and checked against their CRCs on the decoding threads. Returns 1 if it's all there and sound. */
+static int verify(const char *input_file)
+{
+    int result = 0;
+    dsd_reader_t reader;
+    int flags = DSD_READER_VERIFY | DSD_READER_SHARE_DEVICE | (opts.build_index ? DSD_READER_BUILD_INDEX : 0)
+        | (opts.no_cache ? DSD_READER_DROP_BEHIND : 0);
+    int opened;
+
+    if (strcmp(input_file, "-") != 0) {
+        opened = dsd_reader_open_file(input_file, flags, &reader);
+    } else {
+        FILE *in_file = open_stdin();
+
+        opened = in_file ? dsd_reader_open(in_file, flags, &reader) : -1;
+        if (opened == 0) {
+            fclose(in_file);
+        }
+    }
+
+    if (opened == 1) {
+        char *buffer = (char*) malloc(BUFFER_SIZE);
+        uint64_t total = 0;
+        size_t length;
+
+        if (buffer) {
+            while ((length = dsd_reader_read(buffer, BUFFER_SIZE, &reader)) > 0) {
+                total += length;
+            }
+        }
+        /* Closing waits for the frames still being decoded, which may add to frame_errors */
+        dsd_reader_close(&reader);
+
+        if (buffer) {
+            free(buffer);
+            if (reader.frame_errors > 0) {
+                fprintf(stderr, "%s: %" PRIu32 " bad DST frames\n", input_file, reader.frame_errors);
+            }
+            if (total < reader.data_length) {
+                fprintf(stderr, "%s: sound data ends early, after %" PRIu64 " of %" PRIu64 " bytes\n",
+                    input_file, total, reader.data_length);
+            }
+            result = reader.frame_errors == 0 && total == reader.data_length;
+            if (result && opts.verbose) {
+                printf("%s: ok\n", input_file);
+            }
+        }
+    } else if (opened == 0) {
+        fprintf(stderr, "%s: not valid DSF or DSDIFF\n", input_file);
+    } else {
+        fprintf(stderr, "could not open input file \"%s\"\n", input_file);
+    }
+
+    return result;
+}
+
+
+/* A file of a batch conversion */
+typedef struct batch_job_t {
+    char     *input_file;
+    char     *output_file;
+    uint32_t  format;
+    uint64_t  size;
+    int       converted;
+    int       up_to_date; /* skipped, as the manifest says */
+} batch_job_t;
+
+typedef struct batch_t {
+    batch_job_t     *jobs;
+    size_t           count;
+    size_t           allocated;
+    size_t           next;        /* next job to be taken by a converting thread */
+    pthread_mutex_t  mutex;
+    manifest_t       manifest;    /* if opts.manifest_file, kept under mutex */
+} batch_t;
+
+static char *join_path(const char *directory, const char *name)
+{
+    size_t length = strlen(directory);
+    char *path = (char*) malloc(length + strlen(name) + 2);
+
+    if (path) {
+        strcpy(path, directory);
+        if (length > 0 && directory[length - 1] != '/' && directory[length - 1] != '\\') {
+            strcat(path, "/");
+        }
+        strcat(path, name);
+    }
+    return path;
+}
+
+/* Returns name with its extension (if any) replaced by the one of format */
+static char *replace_extension(const char *name, uint32_t format)
+{
+    const char *extension = format == DSD_FORMAT_DSDIFF ? ".dff" : ".dsf";
+    const char *dot = strrchr(name, '.');
+    const char *slash = strrchr(name, '/');
+    size_t length;
+    char *path;
+
+    if (!slash) {
+        slash = strrchr(name, '\\');
+    }
+    length = dot && (!slash || dot > slash) ? (size_t) (dot - name) : strlen(name);
+    path = (char*) malloc(length + strlen(extension) + 1);
+    if (path) {
+        memcpy(path, name, length);
+        strcpy(path + length, extension);
+    }
+    return path;
+}
+
+/* Adds a file to convert, the output being named relative to the output directory unless it's absolute,
+   or with no output name a file to verify */
+static int batch_add(batch_t *batch, const char *input_file, const char *output_name, uint32_t format)
+{
+    batch_job_t *job;
+    struct stat st;
+
+    if (batch->count == batch->allocated) {
+        size_t allocated = batch->allocated ? batch->allocated * 2 : 64;
+        batch_job_t *jobs = (batch_job_t*) realloc(batch->jobs, allocated * sizeof(batch_job_t));
+
+        if (!jobs) {
+            return 0;
+        }
+        batch->jobs = jobs;
+        batch->allocated = allocated;
+    }
+    job = &batch->jobs[batch->count];
+    job->input_file = strdup(input_file);
+    job->output_file = !output_name ? NULL
+        : output_name[0] == '/' ? strdup(output_name) : join_path(opts.output_file, output_name);
+    job->format = format;
+    job->size = stat(input_file, &st) == 0 ? (uint64_t) st.st_size : 0;
+    job->converted = 0;
+    job->up_to_date = 0;
+    if (!job->input_file || (output_name && !job->output_file)) {
+        free(job->input_file);
+        free(job->output_file);
+        return 0;
+    }
+    batch->count++;
+    return 1;
+}
+
+/* Adds every DSF and DSDIFF file in and below directory, relative being its place below the top one */
+static int batch_scan(batch_t *batch, const char *directory, const char *relative)
+{
+    int result = 1;
+#ifdef _WIN32
+    struct _finddata_t entry;
+    intptr_t handle;
+    char *pattern = join_path(directory, "*");
+
+    if (!pattern) {
+        return 0;
+    }
+    handle = _findfirst(pattern, &entry);
+    free(pattern);
+    if (handle == -1) {
+        fprintf(stderr, "could not read directory \"%s\"\n", directory);
+        return 0;
+    }
+    do {
+        const char *name = entry.name;
+        int is_directory = (entry.attrib & _A_SUBDIR) != 0;
+#else
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+
+    if (!dir) {
+        fprintf(stderr, "could not read directory \"%s\"\n", directory);
+        return 0;
+    }
+    while (result && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        struct stat st;
+        int is_directory;
+#endif
+        char *path;
+        char *name_below;
+
+        if (!strcmp(name, ".") || !strcmp(name, "..")) {
+            continue;
+        }
+        path = join_path(directory, name);
+        name_below = relative[0] ? join_path(relative, name) : strdup(name);
+        if (!path || !name_below) {
+            result = 0;
+        } else {
+#ifndef _WIN32
+            is_directory = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+            if (is_directory) {
+                result = batch_scan(batch, path, name_below);
+            } else if (format_from_name(name) && opts.verify) {
+                result = batch_add(batch, path, NULL, 0);
+            } else if (format_from_name(name)) {
+                char *output_name = replace_extension(name_below, opts.output_dsdiff ? DSD_FORMAT_DSDIFF : DSD_FORMAT_DSF);
+
+                result = output_name && batch_add(batch, path, output_name,
+                    opts.output_dsdiff ? DSD_FORMAT_DSDIFF : DSD_FORMAT_DSF);
+                free(output_name);
+            }
+        }
+        free(path);
+        free(name_below);
+#ifdef _WIN32
+    } while (result && _findnext(handle, &entry) == 0);
+    _findclose(handle);
+#else
+    }
+    closedir(dir);
+#endif
+    return result;
+}
+
+/* Adds the files of a list, one input file per line, each maybe followed by a tab and its output file */
+static int batch_read_list(batch_t *batch, const char *list_file)
+{
+    char line[4096];
+    int result = 1;
+    FILE *fp = fopen(list_file, "r");
+
+    if (!fp) {
+        fprintf(stderr, "could not open list \"%s\"\n", list_file);
+        return 0;
+    }
+    while (result && fgets(line, sizeof(line), fp)) {
+        size_t length = strcspn(line, "\r\n");
+        char *output_name = strchr(line, '\t');
+        const char *base;
+        uint32_t format;
+
+        line[length] = '\0';
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        if (output_name) {
+            *output_name++ = '\0';
+            format = format_from_name(output_name);
+            if (!format && (opts.output_dsf || opts.output_dsdiff)) {
+                format = opts.output_dsdiff ? DSD_FORMAT_DSDIFF : DSD_FORMAT_DSF;
+            }
+            if (!format) {
+                fprintf(stderr, "no output format specified for \"%s\"\n", output_name);
+                result = 0;
+            } else {
+                result = batch_add(batch, line, output_name, format);
+            }
+        } else if (!opts.output_dsf && !opts.output_dsdiff) {
+            fprintf(stderr, "no output format specified for \"%s\"\n", line);
+            result = 0;
+        } else {
+            char *name;
+
+            /* Without a name of its own, the output goes straight into the output directory */
+            base = strrchr(line, '/');
+            if (!base) {
+                base = strrchr(line, '\\');
+            }
+            format = opts.output_dsdiff ? DSD_FORMAT_DSDIFF : DSD_FORMAT_DSF;
+            name = replace_extension(base ? base + 1 : line, format);
+            result = name && batch_add(batch, line, name, format);
+            free(name);
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+/* Creates the directories leading to path, those there already being fine */
+static int make_parent_dirs(const char *path)
+{
+    char *parent = strdup(path);
+    char *p;
+    int result = 1;
+
+    if (!parent) {
+        return 0;
+    }
+    for (p = parent + 1; *p && result; p++) {
+        if (*p == '/' || *p == '\\') {
+            char separator = *p;
+
+            *p = '\0';
+            if (mkdir(parent, 0777) != 0 && errno != EEXIST) {
+                fprintf(stderr, "could not create directory \"%s\"\n", parent);
+                result = 0;
+            }
+            *p = separator;
+        }
+    }
+    free(parent);
+    return result;
+}
+
+static int compare_batch_jobs(const void *a, const void *b)
+{
+    const batch_job_t *job_a = (const batch_job_t*) a;
+    const batch_job_t *job_b = (const batch_job_t*) b;
+
+    return job_a->size < job_b->size ? 1 : job_a->size > job_b->size ? -1 : 0;
+}
+
+static int same_file(const manifest_file_t *a, const manifest_file_t *b)
+{
+    return a->size == b->size && a->mtime == b->mtime && a->hash == b->hash;
+}
+
+/* Whether the manifest has the output made from the input as it is now, and the output is still
+   as it was made. Leaves the input's fingerprint in input, its size 0 if it couldn't be taken. */
+static int batch_up_to_date(batch_t *batch, const batch_job_t *job, const char *settings, manifest_file_t *input)
+{
+    manifest_entry_t *entry;
+    manifest_file_t recorded, output;
+    int known;
+
+    if (!manifest_fingerprint(job->input_file, input)) {
+        input->size = 0;
+        return 0;
+    }
+    pthread_mutex_lock(&batch->mutex);
+    entry = manifest_find(&batch->manifest, job->output_file);
+    known = entry && !strcmp(entry->settings, settings) && !strcmp(entry->input_file, job->input_file)
+        && same_file(&entry->input, input);
+    if (known) {
+        recorded = entry->output;
+    }
+    pthread_mutex_unlock(&batch->mutex);
 
-                dsd_reader_close(&reader);
+    return known && manifest_fingerprint(job->output_file, &output) && same_file(&recorded, &output);
+}
+
+static void *batch_thread(void *arg)
+{
+    batch_t *batch = (batch_t*) arg;
+
+    for (;;) {
+        batch_job_t *job;
+        char settings[256];
+        manifest_entry_t entry;
+
+        pthread_mutex_lock(&batch->mutex);
+        job = batch->next < batch->count ? &batch->jobs[batch->next++] : NULL;
+        pthread_mutex_unlock(&batch->mutex);
+        if (!job) {
+            break;
+        }
+
+        if (opts.verify) {
+            job->converted = verify(job->input_file);
+            continue;
+        }
+        if (opts.manifest_file) {
+            conversion_settings(job->format, settings, sizeof(settings));
+            job->up_to_date = batch_up_to_date(batch, job, settings, &entry.input);
+        }
+        if (opts.verbose) {
+            pthread_mutex_lock(&batch->mutex);
+            printf(job->up_to_date ? "%s -> %s (up to date)\n" : "%s -> %s\n", job->input_file, job->output_file);
+            pthread_mutex_unlock(&batch->mutex);
+        }
+        if (job->up_to_date) {
+            job->converted = 1;
+            continue;
+        }
+
+        job->converted = make_parent_dirs(job->output_file)
+            && convert(job->input_file, job->output_file, job->format, 0);
+        if (job->converted && opts.manifest_file && entry.input.size
+            && manifest_fingerprint(job->output_file, &entry.output)) {
+            entry.output_file = job->output_file;
+            entry.settings = settings;
+            entry.input_file = job->input_file;
+            pthread_mutex_lock(&batch->mutex);
+            manifest_set(&batch->manifest, &entry);
+            pthread_mutex_unlock(&batch->mutex);
+        }
+    }
+    return NULL;
+}
+
+/* Convert every file of a directory tree or list, several at once. The files are taken largest first,
+   so a long one isn't left running alone at the end, and the DST decoding threads and those writing
+   the sound data are shared out between all files being converted (see dsd_copy_parallel).
+   With --verify, check the files and directories given in the same way. */
+static int batch(void)
+{
+    batch_t batch;
+    struct stat st;
+    pthread_t *threads;
+    size_t thread_count = opts.jobs > 0 ? (size_t) opts.jobs : dsd_processor_count();
+    size_t i;
+    size_t failed = 0;
+    size_t up_to_date = 0;
+    int result;
+
+    memset(&batch, 0, sizeof(batch));
+    if (opts.manifest_file && !manifest_load(opts.manifest_file, &batch.manifest)) {
+        fprintf(stderr, "could not read manifest \"%s\"\n", opts.manifest_file);
+        manifest_free(&batch.manifest);
+        return 0;
+    }
+    if (opts.verify) {
+        /* Those that can't be opened are complained about when their turn comes */
+        result = 1;
+        for (i = 0; result && i < (size_t) opts.input_count; i++) {
+            if (stat(opts.input_files[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+                result = batch_scan(&batch, opts.input_files[i], "");
             } else {
-                fprintf(stderr, "input file is not valid DSF or DSDIFF\n");
-                fclose(in_file);
+                result = batch_add(&batch, opts.input_files[i], NULL, 0);
             }
+        }
+    } else if (stat(opts.input_file, &st) != 0) {
+        manifest_free(&batch.manifest);
+        fprintf(stderr, "could not open input \"%s\"\n", opts.input_file);
+        return 0;
+    } else if (S_ISDIR(st.st_mode)) {
+        if (!opts.output_dsf && !opts.output_dsdiff) {
+            fprintf(stderr, "no output format specified\n");
+            result = 0;
         } else {
-            fprintf(stderr, "could not open input file \"%s\"\n", opts.input_file);
+            result = batch_scan(&batch, opts.input_file, "");
+        }
+    } else {
+        result = batch_read_list(&batch, opts.input_file);
+    }
+
+    if (result && batch.count > 0) {
+        qsort(batch.jobs, batch.count, sizeof(batch_job_t), compare_batch_jobs);
+        if (thread_count > batch.count) {
+            thread_count = batch.count;
+        }
+        threads = (pthread_t*) malloc(thread_count * sizeof(pthread_t));
+        if (!threads) {
+            thread_count = 0;
+        }
+        pthread_mutex_init(&batch.mutex, NULL);
+        for (i = 0; i < thread_count; i++) {
+            if (pthread_create(&threads[i], NULL, batch_thread, &batch) != 0) {
+                break;
+            }
+        }
+        thread_count = i;
+        if (thread_count == 0) {
+            /* Convert them here, one after the other */
+            batch_thread(&batch);
+        }
+        for (i = 0; i < thread_count; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_destroy(&batch.mutex);
+        free(threads);
+
+        for (i = 0; i < batch.count; i++) {
+            if (!batch.jobs[i].converted) {
+                if (!opts.verify) {
+                    fprintf(stderr, "could not convert \"%s\"\n", batch.jobs[i].input_file);
+                }
+                failed++;
+            } else if (batch.jobs[i].up_to_date) {
+                up_to_date++;
+            }
+        }
+        if (opts.verbose && opts.manifest_file) {
+            printf("%lu of %lu files up to date\n", (unsigned long) up_to_date, (unsigned long) batch.count);
+        }
+        /* What did get converted is remembered either way */
+        if (batch.manifest.changed && !manifest_save(&batch.manifest)) {
+            fprintf(stderr, "could not write manifest \"%s\"\n", opts.manifest_file);
+            result = 0;
+        }
+        if (failed) {
+            fprintf(stderr, opts.verify ? "%lu of %lu files failed verification\n" : "%lu of %lu files not converted\n",
+                (unsigned long) failed, (unsigned long) batch.count);
+            result = 0;
+        } else if (opts.verbose && opts.verify) {
+            printf("%lu files verified\n", (unsigned long) batch.count);
+        }
+    } else if (result) {
+        fprintf(stderr, opts.verify ? "no files to verify in \"%s\"\n" : "no files to convert in \"%s\"\n", opts.input_file);
+        result = 0;
+    }
+
+    for (i = 0; i < batch.count; i++) {
+        free(batch.jobs[i].input_file);
+        free(batch.jobs[i].output_file);
+    }
+    free(batch.jobs);
+    manifest_free(&batch.manifest);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    int result = 1;
+
+#ifdef PTW32_STATIC_LIB
+    pthread_win32_process_attach_np();
+    pthread_win32_thread_attach_np();
+#endif
+
+    init();
+
+    if (!parse_options(argc, argv)) {
+        /* Already complained, or just showed the help */
+    } else if (opts.retag) {
+        if (retag()) {
+            result = 0;
+        }
+    } else if (opts.batch || opts.verify) {
+        if (batch()) {
+            result = 0;
         }
+    } else if (convert(opts.input_file, opts.output_file, opts.output_dsdiff ? DSD_FORMAT_DSDIFF : DSD_FORMAT_DSF,
+        opts.verbose)) {
+        result = 0;
     }
 
 #ifdef PTW32_STATIC_LIB
@@ -0,0 +1,279 @@
+/**
+* DSD Unpack - https://github.com/michaelburton/dsdunpack
+*
+* Copyright (c) 2014 by Michael Burton.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "dsdio.h"
+#include "manifest.h"
+
+#define MANIFEST_HEADER "# dsdunpack manifest 1"
+
+#define FINGERPRINT_ENDS    65536 /* Bytes of the start and end of a file hashed, where the headers and tags are */
+#define FINGERPRINT_SAMPLES 16    /* Pieces of the rest hashed */
+#define FINGERPRINT_SAMPLE  4096
+
+static char *next_field(char **line)
+{
+    char *field = *line;
+    char *end = strchr(field, '\t');
+
+    if (end) {
+        *end = '\0';
+        *line = end + 1;
+    } else {
+        *line = field + strlen(field);
+    }
+    return field;
+}
+
+static int read_file_fields(char **line, manifest_file_t *file)
+{
+    char *size = next_field(line);
+    char *mtime = next_field(line);
+    char *hash = next_field(line);
+
+    if (!*size || !*mtime || !*hash) {
+        return 0;
+    }
+    file->size = strtoull(size, NULL, 10);
+    file->mtime = strtoll(mtime, NULL, 10);
+    file->hash = strtoull(hash, NULL, 16);
+    return 1;
+}
+
+int manifest_load(const char *filename, manifest_t *manifest)
+{
+    char line[8192];
+    FILE *fp;
+    int result = 1;
+
+    manifest->filename = filename;
+    manifest->entries = NULL;
+    manifest->count = 0;
+    manifest->allocated = 0;
+    manifest->changed = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        return 1;
+    }
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0) {
+        fclose(fp);
+        return 0;
+    }
+    while (result && fgets(line, sizeof(line), fp)) {
+        manifest_entry_t entry;
+        char *rest = line;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        entry.output_file = next_field(&rest);
+        entry.settings = next_field(&rest);
+        entry.input_file = next_field(&rest);
+        if (!read_file_fields(&rest, &entry.input) || !read_file_fields(&rest, &entry.output)) {
+            /* Not one of ours, forget it rather than the whole manifest */
+            continue;
+        }
+        result = manifest_set(manifest, &entry);
+    }
+    fclose(fp);
+    manifest->changed = 0;
+    return result;
+}
+
+/* Written next to the manifest and moved over it, so it's never left half written */
+int manifest_save(manifest_t *manifest)
+{
+    size_t length = strlen(manifest->filename);
+    char *temp_file = (char*) malloc(length + 5);
+    FILE *fp;
+    size_t i;
+    int result;
+
+    if (!temp_file) {
+        return 0;
+    }
+    strcpy(temp_file, manifest->filename);
+    strcpy(temp_file + length, ".new");
+    if ((fp = fopen(temp_file, "w")) == NULL) {
+        free(temp_file);
+        return 0;
+    }
+    fprintf(fp, "%s\n", MANIFEST_HEADER);
+    for (i = 0; i < manifest->count; i++) {
+        manifest_entry_t *entry = &manifest->entries[i];
+
+        fprintf(fp, "%s\t%s\t%s\t%" PRIu64 "\t%" PRId64 "\t%016" PRIx64 "\t%" PRIu64 "\t%" PRId64 "\t%016" PRIx64 "\n",
+            entry->output_file, entry->settings, entry->input_file,
+            entry->input.size, entry->input.mtime, entry->input.hash,
+            entry->output.size, entry->output.mtime, entry->output.hash);
+    }
+    result = !ferror(fp);
+    result = fclose(fp) == 0 && result;
+#ifdef _WIN32
+    /* rename won't replace a file there */
+    if (result) {
+        remove(manifest->filename);
+    }
+#endif
+    if (!result || rename(temp_file, manifest->filename) != 0) {
+        remove(temp_file);
+        result = 0;
+    } else {
+        manifest->changed = 0;
+    }
+    free(temp_file);
+    return result;
+}
+
+void manifest_free(manifest_t *manifest)
+{
+    size_t i;
+
+    for (i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].output_file);
+        free(manifest->entries[i].settings);
+        free(manifest->entries[i].input_file);
+    }
+    free(manifest->entries);
+    manifest->entries = NULL;
+    manifest->count = 0;
+    manifest->allocated = 0;
+}
+
+manifest_entry_t *manifest_find(manifest_t *manifest, const char *output_file)
+{
+    size_t i;
+
+    for (i = 0; i < manifest->count; i++) {
+        if (!strcmp(manifest->entries[i].output_file, output_file)) {
+            return &manifest->entries[i];
+        }
+    }
+    return NULL;
+}
+
+int manifest_set(manifest_t *manifest, const manifest_entry_t *entry)
+{
+    manifest_entry_t *existing;
+    manifest_entry_t copy;
+
+    /* Each entry is a line, its fields separated by tabs */
+    if (strpbrk(entry->output_file, "\t\r\n") || strpbrk(entry->settings, "\t\r\n")
+        || strpbrk(entry->input_file, "\t\r\n")) {
+        return 0;
+    }
+    copy = *entry;
+    copy.output_file = strdup(entry->output_file);
+    copy.settings = strdup(entry->settings);
+    copy.input_file = strdup(entry->input_file);
+    if (!copy.output_file || !copy.settings || !copy.input_file) {
+        free(copy.output_file);
+        free(copy.settings);
+        free(copy.input_file);
+        return 0;
+    }
+
+    if ((existing = manifest_find(manifest, entry->output_file)) != NULL) {
+        free(existing->output_file);
+        free(existing->settings);
+        free(existing->input_file);
+    } else {
+        if (manifest->count == manifest->allocated) {
+            size_t allocated = manifest->allocated ? manifest->allocated * 2 : 64;
+            manifest_entry_t *entries = (manifest_entry_t*) realloc(manifest->entries, allocated * sizeof(manifest_entry_t));
+
+            if (!entries) {
+                free(copy.output_file);
+                free(copy.settings);
+                free(copy.input_file);
+                return 0;
+            }
+            manifest->entries = entries;
+            manifest->allocated = allocated;
+        }
+        existing = &manifest->entries[manifest->count++];
+    }
+    *existing = copy;
+    manifest->changed = 1;
+    return 1;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_range(uint64_t hash, FILE *fp, uint64_t offset, size_t len, uint8_t *buffer)
+{
+    size_t amount = dsd_pread(fp, buffer, len, offset);
+
+    return hash_bytes(hash, buffer, amount);
+}
+
+int manifest_fingerprint(const char *filename, manifest_file_t *file)
+{
+    FILE *fp = fopen(filename, "rb");
+    uint8_t *buffer;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
+
+    if (!fp) {
+        return 0;
+    }
+    if (!dsd_file_identity(fp, &file->size, &file->mtime)
+        || (buffer = (uint8_t*) malloc(FINGERPRINT_ENDS)) == NULL) {
+        fclose(fp);
+        return 0;
+    }
+
+    if (file->size <= 2 * FINGERPRINT_ENDS + FINGERPRINT_SAMPLE) {
+        uint64_t offset;
+
+        for (offset = 0; offset < file->size; offset += FINGERPRINT_ENDS) {
+            hash = hash_range(hash, fp, offset, FINGERPRINT_ENDS, buffer);
+        }
+    } else {
+        /* The headers, tags, and the sound data spread evenly between them */
+        uint64_t middle = file->size - 2 * FINGERPRINT_ENDS - FINGERPRINT_SAMPLE;
+
+        hash = hash_range(hash, fp, 0, FINGERPRINT_ENDS, buffer);
+        for (i = 0; i < FINGERPRINT_SAMPLES; i++) {
+            hash = hash_range(hash, fp, FINGERPRINT_ENDS + middle * i / (FINGERPRINT_SAMPLES - 1), FINGERPRINT_SAMPLE, buffer);
+        }
+        hash = hash_range(hash, fp, file->size - FINGERPRINT_ENDS, FINGERPRINT_ENDS, buffer);
+    }
+    file->hash = hash;
+
+    free(buffer);
+    fclose(fp);
+    return 1;
+}
@@ -0,0 +1,68 @@
+/**
+* DSD Unpack - https://github.com/michaelburton/dsdunpack
+*
+* Copyright (c) 2014 by Michael Burton.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*
+*/
+
+#ifndef MANIFEST_H_INCLUDED
+#define MANIFEST_H_INCLUDED
+
+#include <inttypes.h>
+
+
+/* What's known about a file, enough to tell it has changed without reading all of it */
+typedef struct manifest_file_t {
+    uint64_t size;
+    int64_t  mtime;
+    uint64_t hash;      /* of the start and end of the file and samples in between */
+} manifest_file_t;
+
+/* An output file made by a batch conversion, from which input and how */
+typedef struct manifest_entry_t {
+    char            *output_file;
+    char            *settings;  /* the options the output depends on */
+    char            *input_file;
+    manifest_file_t  input;
+    manifest_file_t  output;
+} manifest_entry_t;
+
+/* The outputs of earlier batch conversions, kept in a text file with a line for each output and
+   its fields separated by tabs */
+typedef struct manifest_t {
+    const char       *filename;
+    manifest_entry_t *entries;
+    size_t            count;
+    size_t            allocated;
+    int               changed;
+} manifest_t;
+
+/* Returns 0 if the manifest exists but can't be read, a missing one is just empty */
+extern int               manifest_load(const char *filename, manifest_t *manifest);
+extern int               manifest_save(manifest_t *manifest);
+extern void              manifest_free(manifest_t *manifest);
+
+extern manifest_entry_t *manifest_find(manifest_t *manifest, const char *output_file);
+
+/* Add an entry, or replace the one for the same output file. Returns 0 if out of memory or the
+   file names can't be kept in the manifest. */
+extern int               manifest_set(manifest_t *manifest, const manifest_entry_t *entry);
+
+/* Returns 0 if the file can't be opened */
+extern int               manifest_fingerprint(const char *filename, manifest_file_t *file);
+
+#endif /* MANIFEST_H_INCLUDED */
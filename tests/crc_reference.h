@@ -0,0 +1,51 @@
+/**
+* DSD Unpack - https://github.com/michaelburton/dsdunpack
+*
+* Copyright (c) 2014 by Michael Burton.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*
+*/
+
+#ifndef CRC_REFERENCE_H
+#define CRC_REFERENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 of the DSD data of a frame, as in DSTC chunks (polynomial 0x04C11DB7, MSB first, no
+   initial or final inversion), worked out bit by bit straight from the polynomial rather than
+   with the decoder's table. These are the CRC-32/CKSUM parameters without its final inversion,
+   so "123456789" gives 0x89A1897F (its check value 0x765E7680, inverted). */
+static uint32_t reference_crc(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0;
+    size_t i;
+    int bit;
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            int feedback = (int) (crc >> 31) ^ ((data[i] >> bit) & 1);
+
+            crc <<= 1;
+            if (feedback) {
+                crc ^= 0x04C11DB7;
+            }
+        }
+    }
+    return crc;
+}
+
+#endif
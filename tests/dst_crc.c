@@ -0,0 +1,101 @@
+/**
+* DSD Unpack - https://github.com/michaelburton/dsdunpack
+*
+* Copyright (c) 2014 by Michael Burton.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*
+*/
+
+/* Checks the DST decoder's frame CRC checking (dst_decoder_expect_crc) in every output layout:
+   a frame with its right CRC passes, the same frame with another CRC is reported. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dst_decoder.h"
+#include "conststr.h"
+#include "crc_reference.h"
+
+#define CHANNELS     2
+#define CHANNEL_BYTES (MAX_DSDBITS_INFRAME / 8)
+#define FRAME_BYTES  (CHANNEL_BYTES * CHANNELS)
+
+static int crc_errors;
+static int other_errors;
+static int frames_decoded;
+
+static void frame_decoded(uint8_t *frame_data, size_t frame_size, void *userdata)
+{
+    frames_decoded++;
+}
+
+static void frame_error(int frame_count, int frame_error_code, const char *frame_error_message, void *userdata)
+{
+    if (frame_error_code == DSTErr_FrameCRC) {
+        crc_errors++;
+    } else {
+        other_errors++;
+    }
+}
+
+int main(void)
+{
+    uint8_t frame[FRAME_BYTES + 1];
+    uint32_t seed = 4711;
+    uint32_t crc;
+    int failures = 0;
+    int layout;
+    size_t i;
+
+    /* The reference itself, against the published check value of its parameters */
+    if (reference_crc((const uint8_t*) "123456789", 9) != 0x89A1897F) {
+        fprintf(stderr, "FAILED: reference CRC of \"123456789\" is not 0x89A1897F\n");
+        return 1;
+    }
+
+    /* A frame stored without DST coding: a zero byte, then the DSD data interleaved MSB first */
+    frame[0] = 0;
+    for (i = 1; i <= FRAME_BYTES; i++) {
+        seed = seed * 1103515245 + 12345;
+        frame[i] = (uint8_t) (seed >> 24);
+    }
+    crc = reference_crc(frame + 1, FRAME_BYTES);
+
+    for (layout = 0; layout < 4; layout++) {
+        int planar = layout & 1;
+        int lsb_first = (layout >> 1) & 1;
+        dst_decoder_t *decoder = dst_decoder_create(CHANNELS, 64, frame_decoded, frame_error, NULL);
+
+        crc_errors = other_errors = frames_decoded = 0;
+        dst_decoder_set_output_layout(decoder, planar, lsb_first);
+        dst_decoder_expect_crc(decoder, crc);
+        dst_decoder_decode(decoder, frame, sizeof(frame));
+        dst_decoder_expect_crc(decoder, crc ^ 0x00010000);
+        dst_decoder_decode(decoder, frame, sizeof(frame));
+        dst_decoder_decode(decoder, frame, sizeof(frame)); /* not checked */
+        dst_decoder_destroy(decoder);
+
+        if (frames_decoded != 3 || crc_errors != 1 || other_errors != 0) {
+            fprintf(stderr, "FAILED: planar %d, lsb_first %d: %d frames, %d CRC errors, %d other errors\n",
+                planar, lsb_first, frames_decoded, crc_errors, other_errors);
+            failures++;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,228 @@
+/**
+* DSD Unpack - https://github.com/michaelburton/dsdunpack
+*
+* Copyright (c) 2014 by Michael Burton.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*
+*/
+
+/* Usage: dst_errors dsdunpack scratchdir
+
+   Writes small DST-compressed DSDIFF files, sound ones and ones with a frame that can't be
+   decoded or doesn't match its CRC, and checks that converting and verifying them succeeds
+   and fails as it should, whichever way the frames get decoded. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "crc_reference.h"
+
+#define CHANNELS     2
+#define FRAMES       8
+#define FRAME_BYTES  (4704 * CHANNELS) /* DSD64, 1/75 s */
+#define BAD_FRAME    3
+
+/* What write_dst_file puts in the file */
+#define BAD_HEADER   0x01 /* BAD_FRAME can't be decoded */
+#define WITH_CRC     0x02 /* each frame is followed by its CRC chunk */
+#define BAD_CRC      0x04 /* the CRC of BAD_FRAME is wrong */
+
+static const char *program;
+static const char *directory;
+static int failures = 0;
+
+typedef struct buffer_t {
+    uint8_t *data;
+    size_t   length;
+    size_t   allocated;
+} buffer_t;
+
+static void put(buffer_t *buffer, const void *data, size_t length)
+{
+    if (buffer->length + length > buffer->allocated) {
+        buffer->allocated = (buffer->length + length) * 2;
+        buffer->data = (uint8_t*) realloc(buffer->data, buffer->allocated);
+        if (!buffer->data) {
+            fprintf(stderr, "out of memory\n");
+            exit(2);
+        }
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void put_be(buffer_t *buffer, uint64_t value, int bytes)
+{
+    uint8_t out[8];
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        out[i] = (uint8_t) (value >> (8 * (bytes - 1 - i)));
+    }
+    put(buffer, out, bytes);
+}
+
+/* A chunk with its header, padded to an even length */
+static void put_chunk(buffer_t *buffer, const char *id, const buffer_t *data)
+{
+    put(buffer, id, 4);
+    put_be(buffer, data->length, 8);
+    put(buffer, data->data, data->length);
+    if (data->length & 1) {
+        put_be(buffer, 0, 1);
+    }
+}
+
+/* A DSDIFF file of FRAMES DST frames stored without DST coding (a zero byte, then the DSD data
+   as it is), with the flags above */
+static void write_dst_file(const char *filename, int flags)
+{
+    buffer_t form = { NULL, 0, 0 }, body = { NULL, 0, 0 }, prop = { NULL, 0, 0 };
+    buffer_t chunk = { NULL, 0, 0 }, dst = { NULL, 0, 0 }, frame = { NULL, 0, 0 };
+    uint32_t seed = 12345;
+    int i, j;
+    FILE *fp;
+
+    put(&body, "DSD ", 4);
+    put_be(&chunk, 0x01050000, 4);
+    put_chunk(&body, "FVER", &chunk);
+
+    put(&prop, "SND ", 4);
+    chunk.length = 0;
+    put_be(&chunk, 2822400, 4);
+    put_chunk(&prop, "FS  ", &chunk);
+    chunk.length = 0;
+    put_be(&chunk, CHANNELS, 2);
+    put(&chunk, "SLFTSRGT", 8);
+    put_chunk(&prop, "CHNL", &chunk);
+    chunk.length = 0;
+    put(&chunk, "DST \013DST Encoded", 16);
+    put_chunk(&prop, "CMPR", &chunk);
+    chunk.length = 0;
+    put_be(&chunk, 0, 2);
+    put_chunk(&prop, "LSCO", &chunk);
+    put_chunk(&body, "PROP", &prop);
+
+    chunk.length = 0;
+    put_be(&chunk, FRAMES, 4);
+    put_be(&chunk, 75, 2);
+    put_chunk(&dst, "FRTE", &chunk);
+    for (i = 0; i < FRAMES; i++) {
+        frame.length = 0;
+        put_be(&frame, (flags & BAD_HEADER) && i == BAD_FRAME ? 0xff : 0x00, 1);
+        for (j = 0; j < FRAME_BYTES; j++) {
+            seed = seed * 1103515245 + 12345;
+            put_be(&frame, seed >> 24, 1);
+        }
+        put_chunk(&dst, "DSTF", &frame);
+        if (flags & WITH_CRC) {
+            uint32_t crc = reference_crc(frame.data + 1, FRAME_BYTES);
+
+            chunk.length = 0;
+            put_be(&chunk, (flags & BAD_CRC) && i == BAD_FRAME ? crc ^ 1 : crc, 4);
+            put_chunk(&dst, "DSTC", &chunk);
+        }
+    }
+    put_chunk(&body, "DST ", &dst);
+
+    put_chunk(&form, "FRM8", &body);
+    if ((fp = fopen(filename, "wb")) == NULL || fwrite(form.data, 1, form.length, fp) != form.length
+        || fclose(fp) != 0) {
+        fprintf(stderr, "could not write \"%s\"\n", filename);
+        exit(2);
+    }
+
+    free(form.data);
+    free(body.data);
+    free(prop.data);
+    free(chunk.data);
+    free(dst.data);
+    free(frame.data);
+}
+
+/* Runs dsdunpack with arguments, expecting it to succeed or not */
+static void expect(int success, const char *arguments)
+{
+    char command[4096];
+    int status;
+
+    snprintf(command, sizeof(command), "\"%s\" %s", program, arguments);
+    status = system(command);
+    if ((status == 0) != success) {
+        fprintf(stderr, "FAILED: %s %s\n", command, success ? "failed" : "succeeded");
+        failures++;
+    }
+}
+
+static char *path(const char *name)
+{
+    static char paths[8][1024];
+    static int next = 0;
+    char *result = paths[next++ % 8];
+
+    snprintf(result, sizeof(paths[0]), "\"%s/%s\"", directory, name);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    char arguments[4096];
+    char filename[1024];
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s dsdunpack scratchdir\n", argv[0]);
+        return 2;
+    }
+    program = argv[1];
+    directory = argv[2];
+
+    snprintf(filename, sizeof(filename), "%s/good.dff", directory);
+    write_dst_file(filename, 0);
+    snprintf(filename, sizeof(filename), "%s/bad.dff", directory);
+    write_dst_file(filename, BAD_HEADER);
+    snprintf(filename, sizeof(filename), "%s/good-crc.dff", directory);
+    write_dst_file(filename, WITH_CRC);
+    snprintf(filename, sizeof(filename), "%s/bad-crc.dff", directory);
+    write_dst_file(filename, WITH_CRC | BAD_CRC);
+
+    /* Decoded straight into the output (DSDIFF), and through the read-ahead ring (DSF) */
+    snprintf(arguments, sizeof(arguments), "%s %s", path("good.dff"), path("good-out.dff"));
+    expect(1, arguments);
+    snprintf(arguments, sizeof(arguments), "%s %s", path("good.dff"), path("good-out.dsf"));
+    expect(1, arguments);
+    snprintf(arguments, sizeof(arguments), "%s %s", path("bad.dff"), path("bad-out.dff"));
+    expect(0, arguments);
+    snprintf(arguments, sizeof(arguments), "%s %s", path("bad.dff"), path("bad-out.dsf"));
+    expect(0, arguments);
+
+    /* CRCs are only checked when verifying */
+    snprintf(arguments, sizeof(arguments), "%s %s", path("bad-crc.dff"), path("bad-crc-out.dff"));
+    expect(1, arguments);
+    snprintf(arguments, sizeof(arguments), "--verify %s %s", path("good.dff"), path("good-crc.dff"));
+    expect(1, arguments);
+    snprintf(arguments, sizeof(arguments), "--verify %s", path("bad.dff"));
+    expect(0, arguments);
+    snprintf(arguments, sizeof(arguments), "--verify %s", path("bad-crc.dff"));
+    expect(0, arguments);
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}